@@ -8,6 +8,25 @@
 #include <cassert>
 #include <iostream>
 #include <random>
+#include <bit>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <cstdlib>
+#include <new>
+#include <algorithm>
+#include <cctype>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 template <typename T>
 concept Hashable = requires(T t) {
@@ -16,114 +35,1024 @@ concept Hashable = requires(T t) {
 	} -> std::convertible_to<std::size_t>;
 };
 
-template <typename K, typename V>
-	requires Hashable<K> && std::equality_comparable<V>
+// the hash both maps use. strings hash as string_view (the standard guarantees the same value),
+// so a std::string key can be looked up by string_view or C string without building a std::string
+template <typename K>
+struct QuickHash
+{
+	size_t operator()(const K &key) const
+	{
+		return std::hash<K>{}(key);
+	}
+};
+
+template <>
+struct QuickHash<std::string>
+{
+	using is_transparent = void;
+	size_t operator()(std::string_view key) const
+	{
+		return std::hash<std::string_view>{}(key);
+	}
+};
+
+// a key type Hash takes as it is and KeyEqual compares with K directly (both is_transparent)
+template <typename Q, typename K, typename Hash = QuickHash<K>, typename KeyEqual = std::equal_to<>>
+concept HeterogeneousKey = requires(const Q &q, const K &k, const Hash &hash, const KeyEqual &equal) {
+	typename Hash::is_transparent;
+	typename KeyEqual::is_transparent;
+	{
+		hash(q)
+	} -> std::convertible_to<std::size_t>;
+	{
+		equal(k, q)
+	} -> std::convertible_to<bool>;
+};
+
+// what a map keyed by K can be probed with, anything that isn't heterogeneous is converted to K first
+template <typename Q, typename K, typename Hash = QuickHash<K>, typename KeyEqual = std::equal_to<>>
+concept LookupKey = HeterogeneousKey<Q, K, Hash, KeyEqual> || std::convertible_to<const Q &, K>;
+
+// key as the maps probe with it: untouched when it already is a K or is heterogeneous, otherwise converted to K
+template <typename K, typename Hash = QuickHash<K>, typename KeyEqual = std::equal_to<>, typename Q>
+decltype(auto) quickProbe(const Q &key)
+{
+	if constexpr (std::same_as<Q, K> || HeterogeneousKey<Q, K, Hash, KeyEqual>)
+	{
+		return (key);
+	}
+	else
+	{
+		return K(key);
+	}
+}
+
+// wyhash style finalizer: one 64x64->128 bit multiply folded in half. every input bit reaches the
+// whole result, so identity hashes (std::hash of integers) don't cluster and the high bits are usable
+inline size_t quickMix(size_t hash)
+{
+	unsigned __int128 product = static_cast<unsigned __int128>(hash ^ 0xA0761D6478BD642Full) * 0xE7037ED1A0B428DBull;
+	return static_cast<size_t>(product) ^ static_cast<size_t>(product >> 64);
+}
+
+// lemire's fast range: a mixed hash onto [0, n) with a multiply instead of a division, any n works
+inline size_t quickRange(size_t hash, size_t n)
+{
+	return static_cast<size_t>((static_cast<unsigned __int128>(hash) * n) >> 64);
+}
+
+// slab arena for map nodes. small allocations are rounded up to a size class and cut from large slabs,
+// freed chunks go on a free list for their class, and rewind() hands all slabs out again from the
+// start in one step once nothing allocated from them is alive. the slabs themselves are only returned
+// to the system when the arena goes away. not thread safe
+class QuickArena
+{
+public:
+	// size classes step by GRAIN, which is also every chunk's alignment
+	static constexpr size_t GRAIN = alignof(std::max_align_t);
+	static constexpr size_t MAX_CHUNK = 256;
+	static constexpr size_t FIRST_SLAB = 4096;
+	static constexpr size_t MAX_SLAB = 1 << 20;
+
+	QuickArena() = default;
+	QuickArena(const QuickArena &) = delete;
+	QuickArena &operator=(const QuickArena &) = delete;
+	~QuickArena()
+	{
+		for (auto &slab : slabs)
+		{
+			::operator delete(slab.memory);
+		}
+	}
+
+	static constexpr bool pooled(size_t size, size_t align)
+	{
+		return size <= MAX_CHUNK && align <= GRAIN;
+	}
+
+	void *allocate(size_t size)
+	{
+		size_t cls = classOf(size);
+		this->live++;
+		if (FreeChunk *chunk = this->free[cls])
+		{
+			this->free[cls] = chunk->next;
+			return chunk;
+		}
+		size_t bytes = cls * GRAIN;
+		while (this->current < this->slabs.size() && this->used + bytes > this->slabs[this->current].bytes)
+		{
+			this->current++;
+			this->used = 0;
+		}
+		if (this->current == this->slabs.size())
+		{
+			size_t slab = this->slabs.empty() ? FIRST_SLAB : std::min(this->slabs.back().bytes * 2, MAX_SLAB);
+			this->slabs.push_back({static_cast<std::byte *>(::operator new(slab)), slab});
+		}
+		void *result = this->slabs[this->current].memory + this->used;
+		this->used += bytes;
+		return result;
+	}
+	void deallocate(void *ptr, size_t size)
+	{
+		size_t cls = classOf(size);
+		this->free[cls] = ::new (ptr) FreeChunk{this->free[cls]};
+		this->live--;
+	}
+
+	// makes every slab free again without touching the chunks one by one. only does so when every
+	// chunk has been given back, returns whether it did
+	bool rewind()
+	{
+		if (this->live != 0)
+		{
+			return false;
+		}
+		std::fill(std::begin(this->free), std::end(this->free), nullptr);
+		this->current = 0;
+		this->used = 0;
+		return true;
+	}
+
+	// chunks handed out and not given back yet
+	size_t liveChunks() const
+	{
+		return this->live;
+	}
+	// bytes held in slabs, used or not
+	size_t reservedBytes() const
+	{
+		size_t result = 0;
+		for (auto &slab : slabs)
+		{
+			result += slab.bytes;
+		}
+		return result;
+	}
+
+private:
+	struct FreeChunk
+	{
+		FreeChunk *next;
+	};
+	struct Slab
+	{
+		std::byte *memory;
+		size_t bytes;
+	};
+
+	static size_t classOf(size_t size)
+	{
+		return (std::max(size, sizeof(FreeChunk)) + GRAIN - 1) / GRAIN;
+	}
+
+	std::vector<Slab> slabs;
+	// slab being cut from and how far into it
+	size_t current = 0;
+	size_t used = 0;
+	FreeChunk *free[MAX_CHUNK / GRAIN + 1] = {};
+	size_t live = 0;
+};
+
+// allocator over a shared QuickArena. every single object small enough for the arena comes from it:
+// the list nodes, and a bucket table when the map has just one bucket. larger arrays go to the global
+// allocator. copies and rebinds share the arena, so a long lived allocator passed to many short lived
+// maps keeps reusing the same slabs
+template <typename T>
+class QuickPoolAllocator
+{
+public:
+	using value_type = T;
+	using propagate_on_container_move_assignment = std::true_type;
+	using propagate_on_container_swap = std::true_type;
+
+	QuickPoolAllocator() : arena(std::make_shared<QuickArena>()){}
+	template <typename U>
+	QuickPoolAllocator(const QuickPoolAllocator<U> &other) : arena(other.arena){}
+
+	T *allocate(size_t n)
+	{
+		if (n == 1 && QuickArena::pooled(sizeof(T), alignof(T)))
+		{
+			return static_cast<T *>(this->arena->allocate(sizeof(T)));
+		}
+		return std::allocator<T>().allocate(n);
+	}
+	void deallocate(T *ptr, size_t n)
+	{
+		if (n == 1 && QuickArena::pooled(sizeof(T), alignof(T)))
+		{
+			this->arena->deallocate(ptr, sizeof(T));
+			return;
+		}
+		std::allocator<T>().deallocate(ptr, n);
+	}
+
+	// see QuickArena::rewind
+	bool rewind()
+	{
+		return this->arena->rewind();
+	}
+	QuickArena &pool() const
+	{
+		return *this->arena;
+	}
+
+	template <typename U>
+	bool operator==(const QuickPoolAllocator<U> &other) const
+	{
+		return this->arena == other.arena;
+	}
+
+private:
+	template <typename U>
+	friend class QuickPoolAllocator;
+	std::shared_ptr<QuickArena> arena;
+};
+
+// separate chaining, one list per bucket. growing doesn't rehash everything at once: the full table
+// becomes the old table and every later lookup, insert or erase moves REHASH_STEP of its buckets
+// over, lookups check both tables until the old one is empty
+// Hash, KeyEqual and Allocator are used like unordered_map's. whatever Hash returns goes through
+// quickMix once and is kept in the node, bucket positions are a quickRange of that and growing
+// never calls Hash again
+template <typename K, typename V, typename Hash = QuickHash<K>, typename KeyEqual = std::equal_to<>, typename Allocator = std::allocator<std::pair<K, V>>>
+	requires std::is_invocable_r_v<size_t, const Hash &, const K &> && std::equality_comparable<V>
 class QuickHashMap
 {
 public:
-	static_assert(Hashable<K>, "Key type must be hashable!");
+	static_assert(std::is_invocable_r_v<size_t, const Hash &, const K &>, "Hash must take the key type!");
 	static_assert(std::equality_comparable<V>, "Key type must be equality comparable!");
-	QuickHashMap(size_t cap)
+	QuickHashMap(size_t cap, const Hash &hash = Hash(), const KeyEqual &equal = KeyEqual(), const Allocator &alloc = Allocator())
+		: hasher(hash), equal(equal), alloc(alloc), store(BucketAlloc(alloc)), old(BucketAlloc(alloc))
+	{
+		this->sz = 0;
+		this->cap = cap;
+		store = this->makeTable(cap);
+	};
+	QuickHashMap() : QuickHashMap(1024){};
+	~QuickHashMap(){};
+	void insert(K key, V value)
+	{
+		this->insert_or_assign(std::move(key), std::move(value));
+	};
+
+	// builds the value from args only if key is missing, returns the value and whether it was inserted
+	template <typename KK, typename... Args>
+		requires LookupKey<KK, K, Hash, KeyEqual> && std::constructible_from<K, KK &&>
+	std::pair<V *, bool> try_emplace(KK &&key, Args &&...args)
+	{
+		this->rehashStep();
+		const auto &probe = quickProbe<K, Hash, KeyEqual>(key);
+		size_t hash = this->hashOf(probe);
+		if (const V *found = this->locate(probe, hash))
+		{
+			return {const_cast<V *>(found), false};
+		}
+		return {this->emplaceNew(hash, std::forward<KK>(key), std::forward<Args>(args)...), true};
+	};
+
+	// sets key to value, the key is only converted to K if it wasn't there yet
+	template <typename KK, typename M>
+		requires LookupKey<KK, K, Hash, KeyEqual> && std::constructible_from<K, KK &&> && std::assignable_from<V &, M &&>
+	std::pair<V *, bool> insert_or_assign(KK &&key, M &&value)
+	{
+		this->rehashStep();
+		const auto &probe = quickProbe<K, Hash, KeyEqual>(key);
+		size_t hash = this->hashOf(probe);
+		if (const V *found = this->locate(probe, hash))
+		{
+			*const_cast<V *>(found) = std::forward<M>(value);
+			return {const_cast<V *>(found), false};
+		}
+		return {this->emplaceNew(hash, std::forward<KK>(key), std::forward<M>(value)), true};
+	};
+
+	template <typename Q>
+		requires LookupKey<Q, K, Hash, KeyEqual>
+	void erase(const Q &key)
+	{
+		this->rehashStep();
+		const auto &probe = quickProbe<K, Hash, KeyEqual>(key);
+		size_t hash = this->hashOf(probe);
+		for (auto *bucket : bucketsOf(store, old, this->migrated, hash))
+		{
+			if (!bucket)
+			{
+				continue;
+			}
+			for (auto itr = bucket->begin(); itr != bucket->end(); itr++)
+			{
+				if (itr->hash == hash && this->equal(itr->pair.first, probe))
+				{
+					bucket->erase(itr);
+					this->sz--;
+					return;
+				}
+			}
+		}
+	};
+
+	template <typename Q>
+		requires LookupKey<Q, K, Hash, KeyEqual>
+	bool has(const Q &key)
+	{
+		return this->find(key) != nullptr;
+	};
+
+	// the stored value or nullptr, valid until the pair is erased (rehashing relinks nodes, it doesn't move them)
+	template <typename Q>
+		requires LookupKey<Q, K, Hash, KeyEqual>
+	V *find(const Q &key)
+	{
+		this->rehashStep();
+		return const_cast<V *>(std::as_const(*this).find(key));
+	};
+	// doesn't advance a running rehash, so it never modifies the map
+	template <typename Q>
+		requires LookupKey<Q, K, Hash, KeyEqual>
+	const V *find(const Q &key) const
+	{
+		const auto &probe = quickProbe<K, Hash, KeyEqual>(key);
+		return this->locate(probe, this->hashOf(probe));
+	};
+
+	// copy of the value, find() avoids the copy
+	template <typename Q>
+		requires LookupKey<Q, K, Hash, KeyEqual>
+	std::optional<V> get(const Q &key)
+	{
+		if (V *found = this->find(key))
+		{
+			return std::optional<V>{*found};
+		}
+		return std::optional<V>();
+	};
+
+	// rehashes everything right away, finishing a running incremental rehash first
+	void resize(size_t new_size)
+	{
+		this->finishRehash();
+		Table newStore = this->makeTable(new_size);
+		for (auto &list : store)
+		{
+			while (!list.empty())
+			{
+				auto &target = newStore[quickRange(list.front().hash, new_size)];
+				target.splice(target.end(), list, list.begin());
+			}
+		}
+		store.swap(newStore);
+		cap = new_size;
+	}
+
+	// drops every pair and keeps the capacity. with an allocator that can rewind (QuickPoolAllocator)
+	// the freed nodes are then handed back to it as whole slabs
+	void clear()
+	{
+		for (auto &list : store)
+		{
+			list.clear();
+		}
+		this->old = this->makeTable(0);
+		this->migrated = 0;
+		this->sz = 0;
+		if constexpr (requires(Allocator &alloc) { alloc.rewind(); })
+		{
+			this->alloc.rewind();
+		}
+	}
+
+	// true while pairs are still being moved out of the old table
+	bool rehashing() const
+	{
+		return !this->old.empty();
+	}
+
+	size_t size()
+	{
+		return this->sz;
+	}
+	size_t capacity()
+	{
+		return this->cap;
+	}
+
+private:
+	// old buckets moved per operation. growth starts with sz == old cap and the new table fills up
+	// after another old cap inserts, so any step >= 1 finishes well before the next growth
+	static constexpr size_t REHASH_STEP = 8;
+
+	// the pair and its mixed hash, lookups only compare keys when the hashes match
+	struct Entry
+	{
+		template <typename... Args>
+		Entry(size_t hash, Args &&...args) : hash(hash), pair(std::forward<Args>(args)...){};
+		size_t hash;
+		std::pair<K, V> pair;
+	};
+	using NodeAlloc = typename std::allocator_traits<Allocator>::template rebind_alloc<Entry>;
+	using Bucket = std::list<Entry, NodeAlloc>;
+	using BucketAlloc = typename std::allocator_traits<Allocator>::template rebind_alloc<Bucket>;
+	using Table = std::vector<Bucket, BucketAlloc>;
+
+	// every bucket shares the map's allocator, splicing between lists needs equal allocators
+	Table makeTable(size_t n) const
+	{
+		return Table(n, Bucket(NodeAlloc(this->alloc)), BucketAlloc(this->alloc));
+	}
+	template <typename Q>
+	size_t hashOf(const Q &probe) const
+	{
+		return quickMix(this->hasher(probe));
+	}
+	// the buckets hash can be in: its bucket in the new table, then the one in the old table unless
+	// there is none or it was already moved
+	template <typename T>
+	static std::array<decltype(&std::declval<T &>()[0]), 2> bucketsOf(T &store, T &old, size_t migrated, size_t hash)
+	{
+		size_t pos = quickRange(hash, old.size());
+		return {&store[quickRange(hash, store.size())], pos >= migrated && pos < old.size() ? &old[pos] : nullptr};
+	}
+	template <typename Q>
+	const V *locate(const Q &probe, size_t hash) const
+	{
+		for (const auto *bucket : bucketsOf(store, old, this->migrated, hash))
+		{
+			if (!bucket)
+			{
+				continue;
+			}
+			for (const auto &entry : *bucket)
+			{
+				if (entry.hash == hash && this->equal(entry.pair.first, probe))
+				{
+					return &entry.pair.second;
+				}
+			}
+		}
+		return nullptr;
+	}
+	// splices the nodes of the next REHASH_STEP old buckets into the new table, no pair is copied or moved
+	void rehashStep(size_t buckets = REHASH_STEP)
+	{
+		if (this->old.empty())
+		{
+			return;
+		}
+		size_t end = std::min(this->migrated + buckets, this->old.size());
+		for (; this->migrated < end; this->migrated++)
+		{
+			auto &list = this->old[this->migrated];
+			while (!list.empty())
+			{
+				auto &target = store[quickRange(list.front().hash, this->cap)];
+				target.splice(target.end(), list, list.begin());
+			}
+		}
+		if (this->migrated == this->old.size())
+		{
+			this->old = this->makeTable(0);
+			this->migrated = 0;
+		}
+	}
+	void finishRehash()
+	{
+		this->rehashStep(this->old.size());
+	}
+	template <typename KK, typename... Args>
+	V *emplaceNew(size_t hash, KK &&key, Args &&...args)
+	{
+		if (this->sz == this->cap)
+		{
+			// only an explicit resize to something small gets here mid rehash
+			this->finishRehash();
+			this->old.swap(store);
+			this->cap *= 2;
+			store = this->makeTable(this->cap);
+		}
+		auto &bucket = store[quickRange(hash, this->cap)];
+		bucket.emplace_back(hash, std::piecewise_construct, std::forward_as_tuple(std::forward<KK>(key)), std::forward_as_tuple(std::forward<Args>(args)...));
+		this->sz++;
+		return &bucket.back().pair.second;
+	}
+	[[no_unique_address]] Hash hasher;
+	[[no_unique_address]] KeyEqual equal;
+	[[no_unique_address]] Allocator alloc;
+	size_t sz;
+	size_t cap;
+	Table store;
+	// the table being drained and how many of its buckets are already moved
+	Table old;
+	size_t migrated = 0;
+};
+
+// one control byte per slot: EMPTY, DELETED, or the low 7 bits of the hash (h2) when the slot is full
+// slots are probed a group of 16 control bytes at a time, so most lookups touch one cache line of
+// metadata and only compare keys whose h2 already matches
+struct QuickGroup
+{
+	static constexpr size_t width = 16;
+	static constexpr int8_t EMPTY = -128;
+	static constexpr int8_t DELETED = -2;
+
+	// bit i set if ctrl[i] == h2
+	static uint32_t match(const int8_t *ctrl, int8_t h2)
+	{
+#if defined(__SSE2__)
+		__m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ctrl));
+		return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(h2)));
+#else
+		uint32_t mask = 0;
+		for (size_t i = 0; i < width; i++)
+		{
+			mask |= uint32_t(ctrl[i] == h2) << i;
+		}
+		return mask;
+#endif
+	}
+	static uint32_t matchEmpty(const int8_t *ctrl)
+	{
+		return match(ctrl, EMPTY);
+	}
+	// EMPTY and DELETED are the only negative control bytes, so this is just the sign bits
+	static uint32_t matchFree(const int8_t *ctrl)
+	{
+#if defined(__SSE2__)
+		return _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(ctrl)));
+#else
+		uint32_t mask = 0;
+		for (size_t i = 0; i < width; i++)
+		{
+			mask |= uint32_t(ctrl[i] < 0) << i;
+		}
+		return mask;
+#endif
+	}
+};
+
+// open addressing alternative to QuickHashMap with the same api, pairs live inline in one array
+// so there is no node to chase and no allocation per insert
+template <typename K, typename V>
+	requires Hashable<K> && std::equality_comparable<V>
+class QuickFlatHashMap
+{
+public:
+	QuickFlatHashMap(size_t cap)
+	{
+		this->allocate(roundCapacity(cap));
+	};
+	QuickFlatHashMap() : QuickFlatHashMap(1024){};
+	QuickFlatHashMap(const QuickFlatHashMap &other) : QuickFlatHashMap(other.cap)
+	{
+		for (size_t i = 0; i < other.cap; i++)
+		{
+			if (other.ctrl[i] >= 0)
+			{
+				this->place(other.hashOf(other.slots[i].first), other.slots[i]);
+			}
+		}
+	};
+	QuickFlatHashMap(QuickFlatHashMap &&other) noexcept
+		: ctrl(std::move(other.ctrl)), slots(std::exchange(other.slots, nullptr)),
+		  sz(std::exchange(other.sz, 0)), cap(std::exchange(other.cap, 0)), tombstones(std::exchange(other.tombstones, 0)){};
+	QuickFlatHashMap &operator=(QuickFlatHashMap other) noexcept
+	{
+		std::swap(ctrl, other.ctrl);
+		std::swap(slots, other.slots);
+		std::swap(sz, other.sz);
+		std::swap(cap, other.cap);
+		std::swap(tombstones, other.tombstones);
+		return *this;
+	};
+	~QuickFlatHashMap()
+	{
+		this->release();
+	};
+
+	void insert(K key, V value)
+	{
+		this->insert_or_assign(std::move(key), std::move(value));
+	};
+
+	// builds the value from args only if key is missing, returns the value and whether it was inserted
+	template <typename KK, typename... Args>
+		requires LookupKey<KK, K> && std::constructible_from<K, KK &&>
+	std::pair<V *, bool> try_emplace(KK &&key, Args &&...args)
+	{
+		const auto &probe = quickProbe<K>(key);
+		size_t hash = this->hashOf(probe);
+		size_t pos = this->locate(probe, hash);
+		if (pos != npos)
+		{
+			return {&slots[pos].second, false};
+		}
+		return {this->emplaceNew(hash, std::forward<KK>(key), std::forward<Args>(args)...), true};
+	};
+
+	// sets key to value, the key is only converted to K if it wasn't there yet
+	template <typename KK, typename M>
+		requires LookupKey<KK, K> && std::constructible_from<K, KK &&> && std::assignable_from<V &, M &&>
+	std::pair<V *, bool> insert_or_assign(KK &&key, M &&value)
+	{
+		const auto &probe = quickProbe<K>(key);
+		size_t hash = this->hashOf(probe);
+		size_t pos = this->locate(probe, hash);
+		if (pos != npos)
+		{
+			slots[pos].second = std::forward<M>(value);
+			return {&slots[pos].second, false};
+		}
+		return {this->emplaceNew(hash, std::forward<KK>(key), std::forward<M>(value)), true};
+	};
+
+	template <typename Q>
+		requires LookupKey<Q, K>
+	void erase(const Q &key)
+	{
+		const auto &probe = quickProbe<K>(key);
+		size_t pos = this->locate(probe, this->hashOf(probe));
+		if (pos == npos)
+		{
+			return;
+		}
+		std::destroy_at(&slots[pos]);
+		// a group with an empty slot never sent a probe on to the next group, so nothing can be
+		// relying on this slot being taken and it can go straight back to EMPTY
+		size_t group = pos & ~(QuickGroup::width - 1);
+		if (QuickGroup::matchEmpty(&ctrl[group]))
+		{
+			ctrl[pos] = QuickGroup::EMPTY;
+		}
+		else
+		{
+			ctrl[pos] = QuickGroup::DELETED;
+			this->tombstones++;
+		}
+		this->sz--;
+	};
+
+	template <typename Q>
+		requires LookupKey<Q, K>
+	bool has(const Q &key) const
+	{
+		return this->find(key) != nullptr;
+	};
+
+	// the stored value or nullptr, valid until the next insert or erase
+	template <typename Q>
+		requires LookupKey<Q, K>
+	V *find(const Q &key)
+	{
+		const auto &probe = quickProbe<K>(key);
+		size_t pos = this->locate(probe, this->hashOf(probe));
+		return pos == npos ? nullptr : &slots[pos].second;
+	};
+	template <typename Q>
+		requires LookupKey<Q, K>
+	const V *find(const Q &key) const
+	{
+		return const_cast<QuickFlatHashMap *>(this)->find(key);
+	};
+
+	// copy of the value, find() avoids the copy
+	template <typename Q>
+		requires LookupKey<Q, K>
+	std::optional<V> get(const Q &key)
+	{
+		if (V *found = this->find(key))
+		{
+			return std::optional<V>{*found};
+		}
+		return std::optional<V>();
+	};
+
+	// rehashes into at least new_size slots (never fewer than the pairs need), moving the pairs over
+	void resize(size_t new_size)
+	{
+		new_size = roundCapacity(std::max(new_size, this->sz + this->sz / 7 + 1));
+		std::vector<int8_t> old_ctrl = std::move(ctrl);
+		std::pair<K, V> *old_slots = slots;
+		size_t old_cap = this->cap;
+		this->allocate(new_size);
+		for (size_t i = 0; i < old_cap; i++)
+		{
+			if (old_ctrl[i] >= 0)
+			{
+				this->place(this->hashOf(old_slots[i].first), std::move(old_slots[i]));
+				std::destroy_at(&old_slots[i]);
+			}
+		}
+		std::allocator<std::pair<K, V>>{}.deallocate(old_slots, old_cap);
+	}
+
+	size_t size() const
+	{
+		return this->sz;
+	}
+	size_t capacity() const
+	{
+		return this->cap;
+	}
+
+private:
+	static constexpr size_t npos = static_cast<size_t>(-1);
+
+	// powers of two, so the group index is a mask, and at least one group
+	static size_t roundCapacity(size_t cap)
+	{
+		return std::bit_ceil(std::max(cap, QuickGroup::width));
+	}
+	// std::hash is the identity for integers, fold it through a 128-bit multiply so both the
+	// group index (high bits) and h2 (low 7 bits) see every input bit
+	template <typename Q>
+	static size_t hashOf(const Q &key)
+	{
+		return quickMix(QuickHash<K>{}(key));
+	}
+	static int8_t h2(size_t hash)
+	{
+		return hash & 0x7F;
+	}
+	// groups are visited in triangular order (1, 2, 3, ... apart), which hits every group once
+	// when the group count is a power of two
+	template <typename Q>
+	size_t locate(const Q &key, size_t hash)
+	{
+		if (this->cap == 0)
+		{
+			return npos; // moved from
+		}
+		size_t mask = this->cap / QuickGroup::width - 1;
+		size_t group = (hash >> 7) & mask;
+		for (size_t step = 1;; step++)
+		{
+			const int8_t *g = &ctrl[group * QuickGroup::width];
+			for (uint32_t m = QuickGroup::match(g, h2(hash)); m; m &= m - 1)
+			{
+				size_t pos = group * QuickGroup::width + std::countr_zero(m);
+				if (slots[pos].first == key)
+				{
+					return pos;
+				}
+			}
+			if (QuickGroup::matchEmpty(g) || step > mask)
+			{
+				return npos;
+			}
+			group = (group + step) & mask;
+		}
+	}
+	// grows or cleans up the table if needed, then builds the pair from key and args
+	template <typename KK, typename... Args>
+	V *emplaceNew(size_t hash, KK &&key, Args &&...args)
+	{
+		if (this->sz + this->tombstones >= this->maxLoad())
+		{
+			// tombstones are cleared out by rehashing, only grow if the live pairs need it
+			this->resize(this->sz >= this->maxLoad() / 2 ? this->cap * 2 : this->cap);
+		}
+		size_t pos = this->place(hash, std::piecewise_construct, std::forward_as_tuple(std::forward<KK>(key)), std::forward_as_tuple(std::forward<Args>(args)...));
+		return &slots[pos].second;
+	}
+	// builds a pair that is known not to be in the map in the first free slot of its probe sequence
+	template <typename... Args>
+	size_t place(size_t hash, Args &&...args)
+	{
+		size_t mask = this->cap / QuickGroup::width - 1;
+		size_t group = (hash >> 7) & mask;
+		for (size_t step = 1;; step++)
+		{
+			if (uint32_t m = QuickGroup::matchFree(&ctrl[group * QuickGroup::width]))
+			{
+				size_t pos = group * QuickGroup::width + std::countr_zero(m);
+				std::construct_at(&slots[pos], std::forward<Args>(args)...);
+				if (ctrl[pos] == QuickGroup::DELETED)
+				{
+					this->tombstones--;
+				}
+				ctrl[pos] = h2(hash);
+				this->sz++;
+				return pos;
+			}
+			group = (group + step) & mask;
+		}
+	}
+	size_t maxLoad()
+	{
+		return this->cap - this->cap / 8;
+	}
+	void allocate(size_t new_cap)
+	{
+		ctrl.assign(new_cap, QuickGroup::EMPTY);
+		slots = std::allocator<std::pair<K, V>>{}.allocate(new_cap);
+		this->cap = new_cap;
+		this->sz = 0;
+		this->tombstones = 0;
+	}
+	void release()
+	{
+		if (!slots)
+		{
+			return;
+		}
+		for (size_t i = 0; i < this->cap; i++)
+		{
+			if (ctrl[i] >= 0)
+			{
+				std::destroy_at(&slots[i]);
+			}
+		}
+		std::allocator<std::pair<K, V>>{}.deallocate(slots, this->cap);
+		slots = nullptr;
+	}
+
+	std::vector<int8_t> ctrl;
+	std::pair<K, V> *slots = nullptr;
+	size_t sz = 0;
+	size_t cap = 0;
+	size_t tombstones = 0;
+};
+
+// thread-safe map split into Shards independent QuickFlatHashMaps, each behind its own reader-writer
+// lock, so threads working on different shards never touch the same lock or cache line and a
+// resize only rehashes the one shard that filled up. values are handed out as copies or visited
+// under the shard lock, a pointer into a shard could be invalidated by another thread at any time
+template <typename K, typename V, size_t Shards = 64>
+	requires Hashable<K> && std::equality_comparable<V>
+class ConcurrentQuickHashMap
+{
+	static_assert(std::has_single_bit(Shards), "Shard count must be a power of two!");
+
+public:
+	ConcurrentQuickHashMap(size_t cap)
 	{
-		this->sz = 0;
-		this->cap = cap;
-		store.resize(cap);
+		for (auto &shard : shards)
+		{
+			shard.map = QuickFlatHashMap<K, V>(cap / Shards);
+		}
 	};
-	QuickHashMap() : QuickHashMap(1024){};
-	~QuickHashMap(){};
+	ConcurrentQuickHashMap() : ConcurrentQuickHashMap(1024){};
+	ConcurrentQuickHashMap(const ConcurrentQuickHashMap &) = delete;
+	ConcurrentQuickHashMap &operator=(const ConcurrentQuickHashMap &) = delete;
+	~ConcurrentQuickHashMap(){};
+
 	void insert(K key, V value)
 	{
-		if (this->sz == this->cap)
-		{
-			this->resize(this->cap * 2);
-		}
-		for (auto &pair : store[this->getPos(key)])
-		{
-			if (pair.first == key)
-			{
-				pair.second = value;
-				return;
-			}
-		}
-		size_t pos = this->getPos(key);
-		store[pos].push_back({key, value});
-		this->sz++;
+		this->insert_or_assign(std::move(key), std::move(value));
+	};
+
+	// true if key was missing and the value got built from args
+	template <typename KK, typename... Args>
+		requires LookupKey<KK, K> && std::constructible_from<K, KK &&>
+	bool try_emplace(KK &&key, Args &&...args)
+	{
+		auto &shard = this->shardOf(key);
+		std::unique_lock lock(shard.lock);
+		return shard.map.try_emplace(std::forward<KK>(key), std::forward<Args>(args)...).second;
+	};
+
+	// true if key was missing
+	template <typename KK, typename M>
+		requires LookupKey<KK, K> && std::constructible_from<K, KK &&> && std::assignable_from<V &, M &&>
+	bool insert_or_assign(KK &&key, M &&value)
+	{
+		auto &shard = this->shardOf(key);
+		std::unique_lock lock(shard.lock);
+		return shard.map.insert_or_assign(std::forward<KK>(key), std::forward<M>(value)).second;
+	};
+
+	template <typename Q>
+		requires LookupKey<Q, K>
+	void erase(const Q &key)
+	{
+		auto &shard = this->shardOf(key);
+		std::unique_lock lock(shard.lock);
+		shard.map.erase(key);
 	};
 
-	void erase(K key)
+	template <typename Q>
+		requires LookupKey<Q, K>
+	bool has(const Q &key) const
 	{
-		size_t pos = this->getPos(key);
-		for (auto itr = store[pos].begin(); itr != store[pos].end(); itr++)
+		auto &shard = this->shardOf(key);
+		std::shared_lock lock(shard.lock);
+		return shard.map.has(key);
+	};
+
+	template <typename Q>
+		requires LookupKey<Q, K>
+	std::optional<V> get(const Q &key) const
+	{
+		auto &shard = this->shardOf(key);
+		std::shared_lock lock(shard.lock);
+		if (const V *found = shard.map.find(key))
 		{
-			if (itr->first == key)
-			{
-				store[pos].erase(itr);
-				this->sz--;
-				return;
-			}
+			return std::optional<V>{*found};
 		}
+		return std::optional<V>();
 	};
 
-	bool has(K key)
+	// calls f(const V &) under the shard's read lock if key is there, for reads that shouldn't copy
+	template <typename Q, typename F>
+		requires LookupKey<Q, K>
+	bool visit(const Q &key, F &&f) const
 	{
-		size_t pos = this->getPos(key);
-		for (auto &pair : store[pos])
+		auto &shard = this->shardOf(key);
+		std::shared_lock lock(shard.lock);
+		if (const V *found = shard.map.find(key))
 		{
-			if (pair.first == key)
-			{
-				return true;
-			}
+			f(*found);
+			return true;
 		}
 		return false;
 	};
 
-	std::optional<V> get(const K &key)
+	// calls f(V &) under the shard's write lock, inserting V{} first if key is missing
+	template <typename KK, typename F>
+		requires LookupKey<KK, K> && std::constructible_from<K, KK &&> && std::default_initializable<V>
+	void update(KK &&key, F &&f)
 	{
-		size_t pos = this->getPos(key);
-		// iterate through the list and check if the value is there.
-		for (auto &pair : store[pos])
-		{
-			if (pair.first == key)
-			{
-				return std::optional<V>{pair.second};
-			}
-		}
-		return std::optional<V>();
+		auto &shard = this->shardOf(key);
+		std::unique_lock lock(shard.lock);
+		f(*shard.map.try_emplace(std::forward<KK>(key)).first);
 	};
 
-	void resize(size_t new_size)
+	// sum over the shards, each one read under its lock but not all at the same instant
+	size_t size() const
 	{
-		std::vector<std::list<std::pair<K, V>>> newStore(new_size);
-		for (const auto &list : store)
+		size_t result = 0;
+		for (auto &shard : shards)
 		{
-			for (const auto &pair : list)
-			{
-				size_t new_pos = std::hash<K>{}(pair.first) % new_size;
-				newStore[new_pos].push_back(pair);
-			}
+			std::shared_lock lock(shard.lock);
+			result += shard.map.size();
 		}
-		store.swap(newStore);
-		cap = new_size;
+		return result;
+	}
+	size_t capacity() const
+	{
+		size_t result = 0;
+		for (auto &shard : shards)
+		{
+			std::shared_lock lock(shard.lock);
+			result += shard.map.capacity();
+		}
+		return result;
 	}
 
-	size_t size()
+private:
+	// own cache line each, so locking one shard doesn't bounce the neighbouring lock
+	struct alignas(64) Shard
 	{
-		return this->sz;
+		mutable std::shared_mutex lock;
+		QuickFlatHashMap<K, V> map;
+	};
+
+	// the top bits of a second multiply pick the shard, the shard's map probes with the low bits
+	// of its own mix, so keys of one shard still spread over the whole shard table
+	template <typename Q>
+	Shard &shardOf(const Q &key)
+	{
+		// one shard would shift by the full width
+		if constexpr (Shards == 1)
+		{
+			return shards[0];
+		}
+		else
+		{
+			size_t hash = QuickHash<K>{}(quickProbe<K>(key)) * 0xD6E8FEB86659FD93ull;
+			return shards[hash >> (64 - std::countr_zero(Shards))];
+		}
 	}
-	size_t capacity()
+	template <typename Q>
+	const Shard &shardOf(const Q &key) const
 	{
-		return this->cap;
+		return const_cast<ConcurrentQuickHashMap *>(this)->shardOf(key);
 	}
 
-private:
-	size_t getPos(const K &key)
+	std::array<Shard, Shards> shards;
+};
+
+// counts trips to the global allocator, so tests can check a lookup stays off it. atomic since
+// testConcurrent allocates from several threads at once
+static std::atomic<size_t> allocations = 0;
+
+void *operator new(size_t size)
+{
+	allocations++;
+	if (void *result = std::malloc(size ? size : 1))
 	{
-		return std::hash<K>{}(key) % this->cap;
+		return result;
 	}
-	size_t sz;
-	size_t cap;
-	std::vector<std::list<std::pair<K, V>>> store;
-};
+	throw std::bad_alloc();
+}
+// kept out of line, gcc inlines it down to free() and then warns that operator new's result is freed
+[[gnu::noinline]] void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { operator delete(ptr); }
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete[](void *ptr) noexcept { operator delete(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { operator delete(ptr); }
 
 void testInsertAndGet()
 {
@@ -243,6 +1172,496 @@ void testRandomized()
 	}
 }
 
+void testIncrementalRehash()
+{
+	QuickHashMap<int, std::string> map(64);
+	std::vector<std::string *> values;
+	for (int i = 0; i < 64; i++)
+	{
+		map.insert(i, "value-that-is-long-enough-to-allocate-" + std::to_string(i));
+		values.push_back(map.find(i));
+	}
+	assert(!map.rehashing());
+
+	map.insert(64, "sixty-four"); // grows, but moves only a few buckets
+	assert(map.rehashing());
+	assert(map.capacity() == 128);
+	assert(map.size() == 65);
+
+	// const lookups see both tables and don't move anything
+	const auto &view = map;
+	for (int i = 0; i <= 64; i++)
+	{
+		assert(view.find(i) != nullptr);
+	}
+	assert(map.rehashing());
+
+	map.erase(3);
+	map.erase(60);
+	assert(!map.has(3) && !map.has(60));
+	assert(map.size() == 63);
+
+	// nodes are relinked, not copied: no allocations and the values stay where they were
+	size_t before = allocations;
+	for (int i = 0; map.rehashing(); i++)
+	{
+		assert(i < 64 / 8);
+		assert(map.find(i) != nullptr || i == 3);
+	}
+	assert(allocations == before);
+	for (int i = 0; i < 64; i++)
+	{
+		if (i != 3 && i != 60)
+		{
+			assert(map.find(i) == values[i]);
+			assert(*values[i] == "value-that-is-long-enough-to-allocate-" + std::to_string(i));
+		}
+	}
+
+	// an explicit resize finishes a running rehash first
+	for (int i = 65; i <= 130; i++)
+	{
+		map.insert(i, std::to_string(i));
+	}
+	assert(map.rehashing());
+	map.resize(1000);
+	assert(!map.rehashing());
+	assert(map.size() == 129);
+	for (int i = 0; i <= 130; i++)
+	{
+		assert(map.has(i) == (i != 3 && i != 60));
+	}
+}
+
+// case insensitive hash and equality, the hash counts its calls
+struct FoldedHash
+{
+	size_t *calls;
+	size_t operator()(const std::string &key) const
+	{
+		(*calls)++;
+		size_t hash = 0;
+		for (char c : key)
+		{
+			hash = hash * 31 + std::tolower(static_cast<unsigned char>(c));
+		}
+		return hash;
+	}
+};
+struct FoldedEqual
+{
+	size_t *calls;
+	bool operator()(const std::string &a, const std::string &b) const
+	{
+		(*calls)++;
+		return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y)
+												  { return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y)); });
+	}
+};
+// counts the bytes it hands out
+template <typename T>
+struct CountingAllocator
+{
+	using value_type = T;
+	size_t *bytes;
+	CountingAllocator(size_t *bytes) : bytes(bytes){};
+	template <typename U>
+	CountingAllocator(const CountingAllocator<U> &other) : bytes(other.bytes){};
+	T *allocate(size_t n)
+	{
+		*bytes += n * sizeof(T);
+		return std::allocator<T>().allocate(n);
+	}
+	void deallocate(T *ptr, size_t n)
+	{
+		*bytes -= n * sizeof(T);
+		std::allocator<T>().deallocate(ptr, n);
+	}
+	template <typename U>
+	bool operator==(const CountingAllocator<U> &other) const
+	{
+		return bytes == other.bytes;
+	}
+};
+
+void testCustomHash()
+{
+	size_t calls = 0;
+	size_t compares = 0;
+	size_t bytes = 0;
+	{
+		using Map = QuickHashMap<std::string, int, FoldedHash, FoldedEqual, CountingAllocator<std::pair<std::string, int>>>;
+		Map map(4, FoldedHash{&calls}, FoldedEqual{&compares}, CountingAllocator<std::pair<std::string, int>>(&bytes));
+		assert(bytes > 0);
+
+		// keys are compared with FoldedEqual, not ==
+		map.insert("Alpha", 1);
+		assert(calls == 1 && compares == 0);
+		map.insert("ALPHA", 2);
+		assert(calls == 2 && compares == 1);
+		assert(map.size() == 1);
+		assert(map.get("alpha").value() == 2);
+		assert(compares == 2);
+
+		// one hash per insert, also the ones that grow the table or move buckets of a running rehash
+		for (int i = 0; i < 100; i++)
+		{
+			size_t before = calls;
+			map.insert("key" + std::to_string(i), i);
+			assert(calls == before + 1);
+		}
+		assert(map.size() == 101);
+		assert(map.capacity() > 4);
+
+		// try_emplace hashes once whether or not the key is there
+		size_t before = calls;
+		assert(!map.try_emplace(std::string("KEY7"), 0).second);
+		assert(calls == before + 1);
+		assert(map.try_emplace(std::string("fresh"), 5).second);
+		assert(calls == before + 2);
+
+		// resizing uses the cached hashes
+		before = calls;
+		map.resize(1000);
+		map.resize(3);
+		assert(calls == before);
+		for (int i = 0; i < 100; i++)
+		{
+			assert(map.get("KEY" + std::to_string(i)).value() == i);
+		}
+		map.erase("aLpHa");
+		assert(!map.has("alpha"));
+		assert(map.size() == 101);
+	}
+	assert(bytes == 0);
+
+	// integers hash to themselves in libstdc++, keys that only differ in their high bits still land in
+	// different buckets once mixed
+	QuickHashMap<uint64_t, int> map(1 << 12);
+	for (uint64_t i = 0; i < 1 << 12; i++)
+	{
+		map.insert(i << 20, 0);
+	}
+	for (uint64_t i = 0; i < 1 << 12; i++)
+	{
+		assert(map.has(i << 20));
+	}
+	assert(quickRange(quickMix(0), 1000) < 1000);
+	assert(quickRange(~size_t(0), 1000) == 999);
+}
+
+void testNodePool()
+{
+	using Pool = QuickPoolAllocator<std::pair<int, int>>;
+	using Map = QuickHashMap<int, int, QuickHash<int>, std::equal_to<>, Pool>;
+	Pool pool;
+	QuickArena &arena = pool.pool();
+	{
+		Map map(1024, QuickHash<int>(), std::equal_to<>(), pool);
+
+		// nodes come out of a few slabs instead of one allocation each, after the first slab is cut
+		// the next inserts don't touch the global allocator at all
+		map.insert(0, 0);
+		size_t before = allocations;
+		for (int i = 1; i < 50; i++)
+		{
+			map.insert(i, i * 2);
+		}
+		assert(allocations == before);
+		for (int i = 50; i < 500; i++)
+		{
+			map.insert(i, i * 2);
+		}
+		assert(allocations - before < 10);
+		assert(arena.liveChunks() == 500);
+
+		// erased nodes are reused
+		before = allocations;
+		for (int i = 0; i < 100; i++)
+		{
+			map.erase(i);
+		}
+		for (int i = 1000; i < 1100; i++)
+		{
+			map.insert(i, i * 2);
+		}
+		assert(allocations == before);
+		assert(map.size() == 500);
+
+		// clear rewinds the arena, refilling takes no new memory
+		size_t reserved = arena.reservedBytes();
+		map.clear();
+		assert(map.size() == 0 && !map.has(500));
+		assert(arena.liveChunks() == 0);
+		before = allocations;
+		for (int i = 0; i < 500; i++)
+		{
+			map.insert(i, -i);
+		}
+		assert(allocations == before);
+		assert(arena.reservedBytes() == reserved);
+		for (int i = 0; i < 500; i++)
+		{
+			assert(map.get(i).value() == -i);
+		}
+
+		// a map sharing the arena keeps it from rewinding under the other one
+		Map other(16, QuickHash<int>(), std::equal_to<>(), pool);
+		other.insert(7, 7);
+		map.clear();
+		assert(arena.liveChunks() == 1);
+		for (int i = 0; i < 500; i++)
+		{
+			map.insert(i, i);
+		}
+		assert(other.get(7).value() == 7);
+		assert(map.get(499).value() == 499);
+	}
+	assert(arena.liveChunks() == 0);
+
+	// a one bucket table is a single object, it comes from the arena and goes back with the map
+	{
+		Map tiny(1, QuickHash<int>(), std::equal_to<>(), pool);
+		assert(arena.liveChunks() == 1);
+		for (int i = 0; i < 20; i++)
+		{
+			tiny.insert(i, i);
+		}
+		assert(tiny.get(19).value() == 19);
+	}
+	assert(arena.liveChunks() == 0);
+	assert(pool.rewind());
+
+	// clear works the same with the default allocator, mid rehash too
+	QuickHashMap<int, std::string> plain(8);
+	for (int i = 0; i < 9; i++)
+	{
+		plain.insert(i, std::to_string(i));
+	}
+	assert(plain.rehashing());
+	plain.clear();
+	assert(!plain.rehashing() && plain.size() == 0 && !plain.has(3));
+	plain.insert(3, "three");
+	assert(plain.get(3).value() == "three");
+}
+
+void testFlatInsertAndGet()
+{
+	QuickFlatHashMap<int, std::string> map;
+
+	map.insert(1, "one");
+	map.insert(2, "two");
+	map.insert(3, "three");
+	map.insert(2, "deux");
+
+	assert(map.size() == 3);
+	assert(map.get(1).value() == "one");
+	assert(map.get(2).value() == "deux");
+	assert(map.get(3).value() == "three");
+	assert(!map.get(4).has_value());
+	assert(map.has(3));
+	assert(!map.has(4));
+}
+
+void testFlatEraseAndReuse()
+{
+	// a full table of erased slots has to keep working: tombstones get reused or rehashed away
+	QuickFlatHashMap<int, std::string> map(16);
+	for (int round = 0; round < 50; ++round)
+	{
+		for (int i = 0; i < 12; ++i)
+		{
+			map.insert(round * 100 + i, "value" + std::to_string(i));
+		}
+		for (int i = 0; i < 12; ++i)
+		{
+			assert(map.get(round * 100 + i).value() == "value" + std::to_string(i));
+			map.erase(round * 100 + i);
+			assert(!map.has(round * 100 + i));
+		}
+		assert(map.size() == 0);
+	}
+	assert(map.capacity() == 16);
+}
+
+void testFlatResize()
+{
+	QuickFlatHashMap<int, std::string> map(2);
+	assert(map.capacity() == 16); // one group at least
+
+	for (int i = 0; i < 10000; ++i)
+	{
+		map.insert(i * 64, "value" + std::to_string(i)); // same low bits everywhere
+	}
+	assert(map.size() == 10000);
+	assert(map.capacity() >= 10000 && std::has_single_bit(map.capacity()));
+	for (int i = 0; i < 10000; ++i)
+	{
+		assert(map.get(i * 64).value() == "value" + std::to_string(i));
+	}
+}
+
+void testFlatCopyAndMove()
+{
+	QuickFlatHashMap<std::string, std::string> map;
+	for (int i = 0; i < 100; ++i)
+	{
+		map.insert("key" + std::to_string(i), "value" + std::to_string(i));
+	}
+	QuickFlatHashMap<std::string, std::string> copy = map;
+	copy.erase("key0");
+	assert(map.has("key0") && !copy.has("key0"));
+
+	QuickFlatHashMap<std::string, std::string> moved = std::move(map);
+	assert(moved.size() == 100);
+	assert(moved.get("key42").value() == "value42");
+	assert(!map.has("key42"));
+	map.insert("key42", "again");
+	assert(map.get("key42").value() == "again");
+	map = copy;
+	assert(map.size() == 99);
+	assert(map.get("key99").value() == "value99");
+}
+
+void testFlatRandomized()
+{
+	const size_t numOperations = 100000;
+	std::mt19937 gen(20);
+	std::uniform_real_distribution<> dis(0, 1);
+	std::uniform_int_distribution<> valueDist(0, 5000);
+
+	QuickFlatHashMap<int, std::string> testMap(16);
+	std::unordered_map<int, std::string> referenceMap;
+
+	for (size_t i = 0; i < numOperations; ++i)
+	{
+		double prob = dis(gen);
+		int key = valueDist(gen);
+		if (prob < 0.5)
+		{
+			std::string value = "value" + std::to_string(valueDist(gen));
+			testMap.insert(key, value);
+			referenceMap[key] = value;
+		}
+		else if (prob < 0.8)
+		{
+			testMap.erase(key);
+			referenceMap.erase(key);
+		}
+		else
+		{
+			auto expected = referenceMap.find(key);
+			auto got = testMap.get(key);
+			assert(got.has_value() == (expected != referenceMap.end()));
+			assert(!got || *got == expected->second);
+		}
+		assert(testMap.size() == referenceMap.size());
+	}
+	for (const auto &[k, v] : referenceMap)
+	{
+		assert(testMap.get(k).value() == v);
+	}
+}
+
+template <typename Map>
+void checkHeterogeneousLookup()
+{
+	Map map;
+	// long enough to be past the small string buffer, so building a std::string would allocate
+	std::string key = "a-request-route-that-is-long-enough-to-allocate/0";
+	for (int i = 0; i < 100; ++i)
+	{
+		key.back() = '0' + i % 10;
+		map.insert(key + std::to_string(i), "handler" + std::to_string(i));
+	}
+	std::string_view probe = "a-request-route-that-is-long-enough-to-allocate/77";
+	size_t before = allocations;
+	assert(map.has(probe));
+	assert(map.has("a-request-route-that-is-long-enough-to-allocate/77"));
+	assert(!map.has(std::string_view("a-request-route-that-is-long-enough-to-allocate/78")));
+	std::string *found = map.find(probe);
+	assert(found && *found == "handler7");
+	assert(allocations == before);
+
+	// try_emplace leaves its arguments alone when the key is there, insert_or_assign overwrites
+	std::string value = "replacement-value-that-is-long-enough-to-allocate";
+	auto [existing, inserted] = map.try_emplace(probe, std::move(value));
+	assert(!inserted && *existing == "handler7" && !value.empty());
+	auto [assigned, fresh] = map.insert_or_assign(probe, std::move(value));
+	assert(!fresh && *assigned == "replacement-value-that-is-long-enough-to-allocate");
+	auto [added, created] = map.try_emplace(std::string_view("new-route"), 3, 'x');
+	assert(created && *added == "xxx");
+	assert(map.get("new-route").value() == "xxx");
+	map.erase(std::string_view("new-route"));
+	assert(!map.has("new-route"));
+	assert(map.size() == 100);
+}
+
+void testHeterogeneousLookup()
+{
+	checkHeterogeneousLookup<QuickHashMap<std::string, std::string>>();
+	checkHeterogeneousLookup<QuickFlatHashMap<std::string, std::string>>();
+}
+
+void testConcurrent()
+{
+	ConcurrentQuickHashMap<int, int, 8> map(64);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 4; t++)
+	{
+		threads.emplace_back([&map, t]()
+							 {
+			// own keys, grown well past the starting capacity so every shard resizes
+			for (int i = 0; i < 2000; i++)
+			{
+				map.insert(t * 10000 + i, i);
+				map.update(-1, [](int &count) { count++; });
+			}
+			for (int i = 0; i < 2000; i += 2)
+			{
+				map.erase(t * 10000 + i);
+			}
+			// other threads' keys, present or not depending on how far along they are
+			for (int i = 0; i < 2000; i++)
+			{
+				map.visit(((t + 1) % 4) * 10000 + i, [i](const int &value) { assert(value == i); });
+			} });
+	}
+	for (auto &thread : threads)
+	{
+		thread.join();
+	}
+	assert(map.size() == 4 * 1000 + 1);
+	assert(map.get(-1).value() == 4 * 2000);
+	for (int t = 0; t < 4; t++)
+	{
+		for (int i = 0; i < 2000; i++)
+		{
+			assert(map.has(t * 10000 + i) == (i % 2 == 1));
+		}
+	}
+	assert(!map.try_emplace(1, 5));
+	assert(map.get(1).value() == 1);
+	assert(map.try_emplace(0, 5));
+	assert(!map.insert_or_assign(0, 6));
+	assert(map.get(0).value() == 6);
+
+	ConcurrentQuickHashMap<std::string, std::string> names;
+	names.insert("session", "alive");
+	assert(names.get(std::string_view("session")).value() == "alive");
+	assert(!names.has("missing"));
+
+	// a single shard is just a locked map
+	ConcurrentQuickHashMap<int, int, 1> single(4);
+	for (int i = 0; i < 100; i++)
+	{
+		single.insert(i, i);
+	}
+	single.erase(50);
+	assert(single.size() == 99);
+	assert(single.get(99).value() == 99 && !single.has(50));
+}
+
 int main()
 {
 	std::cout << "Running testInsertAndGet..." << std::endl;
@@ -269,6 +1688,46 @@ int main()
 	testRandomized();
 	std::cout << "testRandomized passed!" << std::endl;
 
+	std::cout << "Running testIncrementalRehash..." << std::endl;
+	testIncrementalRehash();
+	std::cout << "testIncrementalRehash passed!" << std::endl;
+
+	std::cout << "Running testCustomHash..." << std::endl;
+	testCustomHash();
+	std::cout << "testCustomHash passed!" << std::endl;
+
+	std::cout << "Running testNodePool..." << std::endl;
+	testNodePool();
+	std::cout << "testNodePool passed!" << std::endl;
+
+	std::cout << "Running testFlatInsertAndGet..." << std::endl;
+	testFlatInsertAndGet();
+	std::cout << "testFlatInsertAndGet passed!" << std::endl;
+
+	std::cout << "Running testFlatEraseAndReuse..." << std::endl;
+	testFlatEraseAndReuse();
+	std::cout << "testFlatEraseAndReuse passed!" << std::endl;
+
+	std::cout << "Running testFlatResize..." << std::endl;
+	testFlatResize();
+	std::cout << "testFlatResize passed!" << std::endl;
+
+	std::cout << "Running testFlatCopyAndMove..." << std::endl;
+	testFlatCopyAndMove();
+	std::cout << "testFlatCopyAndMove passed!" << std::endl;
+
+	std::cout << "Running testFlatRandomized..." << std::endl;
+	testFlatRandomized();
+	std::cout << "testFlatRandomized passed!" << std::endl;
+
+	std::cout << "Running testHeterogeneousLookup..." << std::endl;
+	testHeterogeneousLookup();
+	std::cout << "testHeterogeneousLookup passed!" << std::endl;
+
+	std::cout << "Running testConcurrent..." << std::endl;
+	testConcurrent();
+	std::cout << "testConcurrent passed!" << std::endl;
+
 	std::cout << "All tests passed successfully!" << std::endl;
 	return 0;
 }
@@ -1,260 +1,3417 @@
+//this implements something called a roaring_bitmap
+//mostly just wanted to mess around with variants & testing & profiling in c++
 #ifndef BARKING_BITMAP_HPP
 #define BARKING_BITMAP_HPP
 
 #include <vector>
 #include <variant>
-#include <bitset>
 #include <ranges>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <bit>
+#include <cstring>
+#include <stdexcept>
+#include <optional>
+#include <queue>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <iterator>
+#include <type_traits>
+
+#include "barking_simd.hpp"
 
 #define BB_BUCKET_SZ 65536
 #define BB_BSET_SZ 65536
 #define BB_ARRAY_THRESHOLD 4096
+// unsorted batches are sorted this many values at a time before they are merged in
+#define BB_BATCH_CHUNK 65536
+// most bytes of spare container buffers a bitmap keeps around for reuse (32 bitsets worth)
+#define BB_POOL_BYTES (1 << 18)
+// parallel set operations hand out buckets in slices of this size, and stay on one thread
+// unless every worker gets at least one slice
+#define BB_PARALLEL_GRAIN 16
+
+// compile-time tuning for BasicBarkingBitmap / BasicBBData, derive from this and override what you need.
+// the chunk width stays at 16 bits: the uint16_t containers and the portable format are built on it
+struct bb_default_policy
+{
+	// a chunk with at least this many values is a bitset, with fewer a sorted array
+	static constexpr size_t array_threshold = BB_ARRAY_THRESHOLD;
+	// allocator of the top-level index (the sorted keys and the bucket handles)
+	template <typename T>
+	using allocator = std::allocator<T>;
+};
+
+// a closed interval [start, last] of a run container
+struct bb_interval
+{
+	uint16_t start;
+	uint16_t last;
+	bool operator==(bb_interval const &) const = default;
+};
+
+// the bits of a bitset container, bit i lives in bit (i % 64) of word i / 64 (same as the portable format)
+// cache line aligned so the word kernels never straddle lines
+struct alignas(64) bb_words
+{
+	uint64_t w[BB_BSET_SZ / 64];
+};
+
+// mask of bits [lo, hi] within one word, 0 <= lo <= hi < 64
+static constexpr auto bb_word_mask(size_t lo, size_t hi) -> uint64_t
+{
+	return (~uint64_t(0) >> (63 - hi)) & (~uint64_t(0) << lo);
+}
+
+// 8 KiB of words inline would make every bb_variant that big no matter which alternative it holds,
+// so the words live on the heap and only a pointer sits in the variant
+class bb_bset
+{
+public:
+	static constexpr size_t words = BB_BSET_SZ / 64;
+
+	bb_bset() : bits(std::make_unique<bb_words>()){};
+	bb_bset(bb_bset const &other) : bits(std::make_unique<bb_words>(*other.bits)){};
+	bb_bset(bb_bset &&other) noexcept = default;
+	bb_bset &operator=(bb_bset const &other)
+	{
+		if (this != &other)
+		{
+			*bits = *other.bits;
+		}
+		return *this;
+	}
+	bb_bset &operator=(bb_bset &&other) noexcept = default;
+	~bb_bset() = default;
+
+	void set(size_t i) { bits->w[i / 64] |= uint64_t(1) << (i % 64); }
+	void reset(size_t i) { bits->w[i / 64] &= ~(uint64_t(1) << (i % 64)); }
+	void flip(size_t i) { bits->w[i / 64] ^= uint64_t(1) << (i % 64); }
+	bool test(size_t i) const { return bits->w[i / 64] >> (i % 64) & 1; }
+	size_t count() const { return bb_popcount_words(bits->w, words); }
+	bool none() const
+	{
+		return std::all_of(std::begin(bits->w), std::end(bits->w), [](uint64_t w)
+						   { return w == 0; });
+	}
+	void clear() { std::memset(bits->w, 0, sizeof(bits->w)); }
+
+	// word-level range updates over [lo, hi], whole words in the middle and masks at the ends
+	template <typename Op>
+	void applyRange(size_t lo, size_t hi, Op op)
+	{
+		size_t first = lo / 64, last = hi / 64;
+		if (first == last)
+		{
+			op(bits->w[first], bb_word_mask(lo % 64, hi % 64));
+			return;
+		}
+		op(bits->w[first], bb_word_mask(lo % 64, 63));
+		for (size_t w = first + 1; w < last; w++)
+		{
+			op(bits->w[w], ~uint64_t(0));
+		}
+		op(bits->w[last], bb_word_mask(0, hi % 64));
+	}
+	void setRange(size_t lo, size_t hi)
+	{
+		applyRange(lo, hi, [](uint64_t &w, uint64_t mask)
+				   { w |= mask; });
+	}
+	void resetRange(size_t lo, size_t hi)
+	{
+		applyRange(lo, hi, [](uint64_t &w, uint64_t mask)
+				   { w &= ~mask; });
+	}
+	void flipRange(size_t lo, size_t hi)
+	{
+		applyRange(lo, hi, [](uint64_t &w, uint64_t mask)
+				   { w ^= mask; });
+	}
+	// set bits in [lo, hi]
+	size_t countRange(size_t lo, size_t hi) const
+	{
+		size_t first = lo / 64, last = hi / 64;
+		if (first == last)
+		{
+			return std::popcount(bits->w[first] & bb_word_mask(lo % 64, hi % 64));
+		}
+		return std::popcount(bits->w[first] & bb_word_mask(lo % 64, 63)) +
+			   bb_popcount_words(bits->w + first + 1, last - first - 1) +
+			   std::popcount(bits->w[last] & bb_word_mask(0, hi % 64));
+	}
+	// number of set bits at or below i
+	size_t rank(size_t i) const
+	{
+		return countRange(0, i);
+	}
+	// lowest clear bit at or above pos, BB_BSET_SZ if there is none
+	size_t nextClear(size_t pos) const
+	{
+		if (pos >= BB_BSET_SZ)
+		{
+			return BB_BSET_SZ;
+		}
+		size_t w = pos / 64;
+		uint64_t word = ~bits->w[w] & (~uint64_t(0) << (pos % 64));
+		while (!word)
+		{
+			if (++w == words)
+			{
+				return BB_BSET_SZ;
+			}
+			word = ~bits->w[w];
+		}
+		return w * 64 + std::countr_zero(word);
+	}
+	// lowest set bit at or above pos, BB_BSET_SZ if there is none
+	size_t next(size_t pos) const
+	{
+		if (pos >= BB_BSET_SZ)
+		{
+			return BB_BSET_SZ;
+		}
+		size_t w = pos / 64;
+		uint64_t word = bits->w[w] & (~uint64_t(0) << (pos % 64));
+		while (!word)
+		{
+			if (++w == words)
+			{
+				return BB_BSET_SZ;
+			}
+			word = bits->w[w];
+		}
+		return w * 64 + std::countr_zero(word);
+	}
+	// position of the i-th set bit, i has to be below count()
+	size_t select(size_t i) const
+	{
+		size_t w = 0;
+		for (size_t c; (c = std::popcount(bits->w[w])) <= i; w++)
+		{
+			i -= c;
+		}
+		uint64_t word = bits->w[w];
+		while (i--)
+		{
+			word &= word - 1;
+		}
+		return w * 64 + std::countr_zero(word);
+	}
+	// lowest and highest set bit, the set must not be empty
+	size_t first() const
+	{
+		return next(0);
+	}
+	size_t last() const
+	{
+		size_t w = words - 1;
+		while (!bits->w[w])
+		{
+			w--;
+		}
+		return w * 64 + 63 - std::countl_zero(bits->w[w]);
+	}
+	// calls f(i) for every set bit i in order, lowest bit of each word peeled off with ctz
+	template <typename F>
+	void forEach(F &&f) const
+	{
+		for (size_t w = 0; w < words; w++)
+		{
+			for (uint64_t word = bits->w[w]; word; word &= word - 1)
+			{
+				f(w * 64 + std::countr_zero(word));
+			}
+		}
+	}
+	// writes the set bits, or-ed with high, to out and returns how many there were
+	template <typename T>
+	size_t extract(T *out, uint32_t high = 0) const
+	{
+		size_t n = 0;
+		for (size_t w = 0; w < words; w++)
+		{
+			for (uint64_t word = bits->w[w]; word; word &= word - 1)
+			{
+				out[n++] = static_cast<T>(high | (w * 64 + std::countr_zero(word)));
+			}
+		}
+		return n;
+	}
+
+	bb_bset &operator&=(bb_bset const &other)
+	{
+		bb_and_words(bits->w, other.bits->w, words);
+		return *this;
+	}
+	bb_bset &operator|=(bb_bset const &other)
+	{
+		bb_or_words(bits->w, other.bits->w, words);
+		return *this;
+	}
+	bb_bset &operator^=(bb_bset const &other)
+	{
+		for (size_t w = 0; w < words; w++)
+		{
+			bits->w[w] ^= other.bits->w[w];
+		}
+		return *this;
+	}
+	// this &= ~other
+	void andNot(bb_bset const &other)
+	{
+		for (size_t w = 0; w < words; w++)
+		{
+			bits->w[w] &= ~other.bits->w[w];
+		}
+	}
+	// count() of this & other without building it
+	size_t andCount(bb_bset const &other) const
+	{
+		size_t result = 0;
+		for (size_t w = 0; w < words; w++)
+		{
+			result += std::popcount(bits->w[w] & other.bits->w[w]);
+		}
+		return result;
+	}
+	friend bb_bset operator&(bb_bset lhs, bb_bset const &rhs) { return lhs &= rhs; }
+	friend bb_bset operator|(bb_bset lhs, bb_bset const &rhs) { return lhs |= rhs; }
+	bool operator==(bb_bset const &other) const { return std::memcmp(bits->w, other.bits->w, sizeof(bits->w)) == 0; }
+
+	// direct word access, for the serialized format and the run conversions
+	uint64_t const *data() const { return bits->w; }
+	uint64_t *data() { return bits->w; }
+
+private:
+	std::unique_ptr<bb_words> bits;
+};
 
 // using bb_array = std::array<int, BB_SZ>;
 using bb_array = std::vector<uint16_t>;
-using bb_bset = std::bitset<BB_BSET_SZ>;
-using bb_variant = std::variant<bb_array, bb_bset>;
+// sorted, non-overlapping and non-adjacent intervals
+using bb_run = std::vector<bb_interval>;
+using bb_variant = std::variant<bb_array, bb_bset, bb_run>;
+
+// serialized footprint of each encoding, used to pick the smallest one
+static constexpr auto bb_array_bytes(size_t cardinality) -> size_t { return 2 * cardinality; }
+static constexpr auto bb_bset_bytes() -> size_t { return BB_BSET_SZ / 8; }
+static constexpr auto bb_run_bytes(size_t runs) -> size_t { return 2 + 4 * runs; }
 
 static auto convert_bset_to_array(bb_bset const &bset) -> bb_array
+{
+	bb_array result(bset.count());
+	bset.extract(result.data());
+	return result;
+}
+
+static auto convert_array_to_bset(bb_array const &array) -> bb_bset
+{
+	bb_bset result;
+	for (auto const &i : array)
+	{
+		result.set(i);
+	}
+	return result;
+}
+
+static auto convert_array_to_run(bb_array const &array) -> bb_run
+{
+	bb_run result;
+	for (auto const &i : array)
+	{
+		if (!result.empty() && static_cast<int>(result.back().last) + 1 == i)
+		{
+			result.back().last = i;
+		}
+		else
+		{
+			result.push_back({i, i});
+		}
+	}
+	return result;
+}
+
+static auto convert_bset_to_run(bb_bset const &bset) -> bb_run
+{
+	// hop from the start of a run to its end and on to the next start, a word at a time
+	bb_run result;
+	for (size_t start = bset.next(0); start < BB_BSET_SZ;)
+	{
+		size_t end = bset.nextClear(start);
+		result.push_back({static_cast<uint16_t>(start), static_cast<uint16_t>(end - 1)});
+		start = bset.next(end);
+	}
+	return result;
+}
+
+static auto convert_run_to_array(bb_run const &run) -> bb_array
+{
+	bb_array result;
+	for (auto const &r : run)
+	{
+		for (int i = r.start; i <= r.last; i++)
+		{
+			result.push_back(i);
+		}
+	}
+	return result;
+}
+
+static auto convert_run_to_bset(bb_run const &run) -> bb_bset
+{
+	bb_bset result;
+	for (auto const &r : run)
+	{
+		result.setRange(r.start, r.last);
+	}
+	return result;
+}
+
+static auto run_cardinality(bb_run const &run) -> size_t
+{
+	size_t result = 0;
+	for (auto const &r : run)
+	{
+		result += static_cast<size_t>(r.last) - r.start + 1;
+	}
+	return result;
+}
+
+static auto cardinality(bb_variant const &data) -> size_t
+{
+	return std::visit([](auto const &arg) -> size_t
+					  {
+		using T = std::decay_t<decltype(arg)>;
+		if constexpr (std::is_same_v<T, bb_array>)
+		{
+			return arg.size();
+		}
+		else if constexpr (std::is_same_v<T, bb_bset>)
+		{
+			return arg.count();
+		}
+		else if constexpr (std::is_same_v<T, bb_run>)
+		{
+			return run_cardinality(arg);
+		} },
+					  data);
+}
+
+// number of runs the data would need if it were stored as a bb_run
+static auto run_count(bb_variant const &data) -> size_t
+{
+	return std::visit([](auto const &arg) -> size_t
+					  {
+		using T = std::decay_t<decltype(arg)>;
+		if constexpr (std::is_same_v<T, bb_array>)
+		{
+			size_t result = 0;
+			for (size_t i = 0; i < arg.size(); i++)
+			{
+				if (i == 0 || static_cast<int>(arg[i - 1]) + 1 != arg[i])
+				{
+					result++;
+				}
+			}
+			return result;
+		}
+		else if constexpr (std::is_same_v<T, bb_bset>)
+		{
+			// a run starts at every set bit whose lower neighbour (carried over from the last word) is clear
+			size_t result = 0;
+			uint64_t carry = 0;
+			for (size_t w = 0; w < bb_bset::words; w++)
+			{
+				uint64_t word = arg.data()[w];
+				result += std::popcount(word & ~(word << 1 | carry));
+				carry = word >> 63;
+			}
+			return result;
+		}
+		else if constexpr (std::is_same_v<T, bb_run>)
+		{
+			return arg.size();
+		} },
+					  data);
+}
+
+// is this the best semantic for this?
+static auto convertForCardinality(bb_variant const &data, size_t threshold = BB_ARRAY_THRESHOLD) -> bb_variant
+{
+	return std::visit([threshold](auto &&arg) -> bb_variant
+					  {
+		using T = std::decay_t<decltype(arg)>;
+		if constexpr (std::is_same_v<T, bb_array>)
+		{
+			if(arg.size() >= threshold)
+			{
+				return convert_array_to_bset(arg);
+			}
+			return arg;
+		}
+		else if constexpr (std::is_same_v<T, bb_bset>)
+		{
+			if(arg.count() < threshold)
+			{
+				return convert_bset_to_array(arg);
+			}
+			return arg;
+		}
+		else if constexpr (std::is_same_v<T, bb_run>)
+		{
+			// runs are only kept while they are no bigger than the alternative
+			size_t card = run_cardinality(arg);
+			if (card < threshold && bb_run_bytes(arg.size()) > bb_array_bytes(card))
+			{
+				return convert_run_to_array(arg);
+			}
+			if (card >= threshold && bb_run_bytes(arg.size()) > bb_bset_bytes())
+			{
+				return convert_run_to_bset(arg);
+			}
+			return arg;
+		} },
+					  data);
+}
+
+// run kernels, the (array, bitset) variants are kept inline in BBData like the originals
+static auto intersect_run_array(bb_run const &run, bb_array const &array) -> bb_array
 {
 	bb_array result;
-	result.reserve(BB_ARRAY_THRESHOLD);
-	for (int i = 0; i < BB_BSET_SZ; i++)
+	auto r = run.begin();
+	for (auto const &i : array)
+	{
+		while (r != run.end() && r->last < i)
+		{
+			r++;
+		}
+		if (r == run.end())
+		{
+			break;
+		}
+		if (r->start <= i)
+		{
+			result.push_back(i);
+		}
+	}
+	return result;
+}
+
+static auto intersect_run_bset(bb_run const &run, bb_bset const &bset) -> bb_variant
+{
+	// mask of the runs, then one pass of word ands
+	bb_bset result;
+	for (auto const &r : run)
+	{
+		result.setRange(r.start, r.last);
+	}
+	result &= bset;
+	return convertForCardinality(result);
+}
+
+static auto intersect_run_run(bb_run const &run1, bb_run const &run2) -> bb_variant
+{
+	bb_run result;
+	auto a = run1.begin();
+	auto b = run2.begin();
+	while (a != run1.end() && b != run2.end())
+	{
+		uint16_t start = std::max(a->start, b->start);
+		uint16_t last = std::min(a->last, b->last);
+		if (start <= last)
+		{
+			result.push_back({start, last});
+		}
+		if (a->last < b->last)
+		{
+			a++;
+		}
+		else
+		{
+			b++;
+		}
+	}
+	return convertForCardinality(result);
+}
+
+static auto unite_run_run(bb_run const &run1, bb_run const &run2) -> bb_variant
+{
+	bb_run result;
+	result.reserve(run1.size() + run2.size());
+	auto a = run1.begin();
+	auto b = run2.begin();
+	while (a != run1.end() || b != run2.end())
+	{
+		bb_interval next;
+		if (b == run2.end() || (a != run1.end() && a->start < b->start))
+		{
+			next = *a++;
+		}
+		else
+		{
+			next = *b++;
+		}
+		if (!result.empty() && static_cast<int>(result.back().last) + 1 >= next.start)
+		{
+			result.back().last = std::max(result.back().last, next.last);
+		}
+		else
+		{
+			result.push_back(next);
+		}
+	}
+	return convertForCardinality(result);
+}
+
+static auto unite_run_bset(bb_run const &run, bb_bset const &bset) -> bb_bset
+{
+	bb_bset result = bset;
+	for (auto const &r : run)
+	{
+		result.setRange(r.start, r.last);
+	}
+	return result;
+}
+
+// combines two run containers under any boolean op by sweeping their interval boundaries
+template <typename Op>
+static auto combine_run_run(bb_run const &run1, bb_run const &run2, Op op) -> bb_run
+{
+	// one past the last position, no boundary lies beyond it
+	static constexpr uint32_t done = BB_BSET_SZ + 1;
+	bb_run result;
+	size_t a = 0, b = 0;
+	bool in_a = false, in_b = false, inside = false;
+	uint32_t open = 0;
+	// a run boundary is its start while outside it and last + 1 while inside it
+	auto boundary = [](bb_run const &run, size_t i, bool in) -> uint32_t
+	{
+		return i == run.size() ? done : in ? run[i].last + 1u : run[i].start;
+	};
+	for (;;)
+	{
+		uint32_t pos = std::min(boundary(run1, a, in_a), boundary(run2, b, in_b));
+		if (pos == done)
+		{
+			break;
+		}
+		if (boundary(run1, a, in_a) == pos)
+		{
+			a += in_a;
+			in_a = !in_a;
+		}
+		if (boundary(run2, b, in_b) == pos)
+		{
+			b += in_b;
+			in_b = !in_b;
+		}
+		if (op(in_a, in_b) != inside)
+		{
+			inside = !inside;
+			if (inside)
+			{
+				open = pos;
+			}
+			else
+			{
+				result.push_back({static_cast<uint16_t>(open), static_cast<uint16_t>(pos - 1)});
+			}
+		}
+	}
+	return result;
+}
+
+inline auto difference_run_run(bb_run const &run1, bb_run const &run2) -> bb_variant
+{
+	return convertForCardinality(combine_run_run(run1, run2, [](bool a, bool b)
+												 { return a && !b; }));
+}
+
+inline auto xor_run_run(bb_run const &run1, bb_run const &run2) -> bb_variant
+{
+	return convertForCardinality(combine_run_run(run1, run2, [](bool a, bool b)
+												 { return a != b; }));
+}
+
+// count-only intersections, nothing is materialized
+inline auto and_count_run_array(bb_run const &run, bb_array const &array) -> size_t
+{
+	size_t result = 0;
+	auto r = run.begin();
+	for (auto const &i : array)
+	{
+		while (r != run.end() && r->last < i)
+		{
+			r++;
+		}
+		if (r == run.end())
+		{
+			break;
+		}
+		result += r->start <= i;
+	}
+	return result;
+}
+
+inline auto and_count_run_bset(bb_run const &run, bb_bset const &bset) -> size_t
+{
+	size_t result = 0;
+	for (auto const &r : run)
+	{
+		result += bset.countRange(r.start, r.last);
+	}
+	return result;
+}
+
+inline auto and_count_run_run(bb_run const &run1, bb_run const &run2) -> size_t
+{
+	size_t result = 0;
+	auto a = run1.begin();
+	auto b = run2.begin();
+	while (a != run1.end() && b != run2.end())
+	{
+		uint16_t start = std::max(a->start, b->start);
+		uint16_t last = std::min(a->last, b->last);
+		if (start <= last)
+		{
+			result += static_cast<size_t>(last) - start + 1;
+		}
+		if (a->last < b->last)
+		{
+			a++;
+		}
+		else
+		{
+			b++;
+		}
+	}
+	return result;
+}
+
+// recycled container buffers, so that set operations don't go back to the allocator for every bucket
+// the pool is scratch space and not part of a bitmap's value: copies start out empty
+class bb_pool
+{
+public:
+	bb_pool() = default;
+	bb_pool(bb_pool const &){};
+	bb_pool(bb_pool &&) noexcept = default;
+	bb_pool &operator=(bb_pool const &) { return *this; }
+	bb_pool &operator=(bb_pool &&) noexcept = default;
+	~bb_pool() = default;
+
+	// empty array with room for at least capacity values
+	bb_array takeArray(size_t capacity)
+	{
+		bb_array result;
+		if (spare && !spare->arrays.empty())
+		{
+			result = std::move(spare->arrays.back());
+			spare->arrays.pop_back();
+			spare->bytes -= bb_array_bytes(result.capacity());
+			result.clear();
+		}
+		result.reserve(capacity);
+		return result;
+	}
+	// bytes of spare buffers held right now
+	size_t bytes() const
+	{
+		return spare ? spare->bytes : 0;
+	}
+	void release()
+	{
+		spare.reset();
+	}
+	// all-zero bitset
+	bb_bset takeBset()
+	{
+		if (spare && !spare->bsets.empty())
+		{
+			bb_bset result = std::move(spare->bsets.back());
+			spare->bsets.pop_back();
+			spare->bytes -= bb_bset_bytes();
+			result.clear();
+			return result;
+		}
+		return bb_bset();
+	}
+	void give(bb_array &&array)
+	{
+		if (array.capacity() == 0)
+		{
+			return;
+		}
+		if (!spare)
+		{
+			spare = std::make_unique<buffers>();
+		}
+		if (spare->bytes + bb_array_bytes(array.capacity()) <= BB_POOL_BYTES)
+		{
+			spare->bytes += bb_array_bytes(array.capacity());
+			spare->arrays.push_back(std::move(array));
+		}
+	}
+	void give(bb_bset &&bset)
+	{
+		if (!spare)
+		{
+			spare = std::make_unique<buffers>();
+		}
+		if (spare->bytes + bb_bset_bytes() <= BB_POOL_BYTES)
+		{
+			spare->bytes += bb_bset_bytes();
+			spare->bsets.push_back(std::move(bset));
+		}
+	}
+	// hands whatever buffer data holds back to the pool
+	void recycle(bb_variant &&data)
+	{
+		if (auto array = std::get_if<bb_array>(&data))
+		{
+			give(std::move(*array));
+		}
+		else if (auto bset = std::get_if<bb_bset>(&data))
+		{
+			give(std::move(*bset));
+		}
+		data = bb_array();
+	}
+
+private:
+	struct buffers
+	{
+		std::vector<bb_array> arrays;
+		std::vector<bb_bset> bsets;
+		size_t bytes = 0;
+	};
+	// allocated on first give(), an unused pool costs a pointer
+	std::unique_ptr<buffers> spare;
+};
+
+template <typename Policy = bb_default_policy>
+class BasicBBData
+{
+public:
+	using BBData = BasicBBData;
+
+	BasicBBData() : data(bb_array()), sz(0){};
+	explicit BasicBBData(bb_variant data) : data(std::move(data)), sz(cardinality(this->data)){};
+	bb_variant data;
+	// cardinality of data, kept up to date by every operation
+	size_t sz;
+	void add(const uint16_t value)
+	{
+		std::visit([value, this](auto &&arg)
+				   {
+			using T = std::decay_t<decltype(arg)>;
+			if constexpr (std::is_same_v<T, bb_array>)
+			{
+				// keep the array sorted & unique, contains() relies on it
+				auto itr = std::lower_bound(arg.begin(), arg.end(), value);
+				if (itr != arg.end() && *itr == value)
+				{
+					return;
+				}
+				arg.insert(itr, value);
+				sz++;
+				if (arg.size() >= Policy::array_threshold)
+				{
+					data = convert_array_to_bset(arg);
+				}
+			}
+			else if constexpr (std::is_same_v<T, bb_bset>)
+			{
+				if (!arg.test(value))
+				{
+					arg.set(value);
+					sz++;
+				}
+			}
+			else if constexpr (std::is_same_v<T, bb_run>)
+			{
+				// first run starting after value, the one before it may already hold it
+				auto next = std::upper_bound(arg.begin(), arg.end(), value, [](uint16_t v, bb_interval const &r)
+											 { return v < r.start; });
+				if (next != arg.begin())
+				{
+					auto prev = std::prev(next);
+					if (value <= prev->last)
+					{
+						return;
+					}
+					if (static_cast<int>(prev->last) + 1 == value)
+					{
+						sz++;
+						prev->last = value;
+						if (next != arg.end() && static_cast<int>(value) + 1 == next->start)
+						{
+							prev->last = next->last;
+							arg.erase(next);
+						}
+						return;
+					}
+				}
+				sz++;
+				if (next != arg.end() && static_cast<int>(value) + 1 == next->start)
+				{
+					next->start = value;
+					return;
+				}
+				arg.insert(next, {value, value});
+			} },
+				   data);
+	}
+	// bulk add of sorted, unique values
+	void addMany(uint16_t const *values, size_t n)
+	{
+		std::visit([values, n, this](auto &&arg)
+				   {
+			using T = std::decay_t<decltype(arg)>;
+			if constexpr (std::is_same_v<T, bb_array>)
+			{
+				bb_array result(arg.size() + n + BB_SIMD_SLACK);
+				result.resize(bb_union_u16(arg.data(), arg.size(), values, n, result.data()));
+				sz = result.size();
+				if (result.size() >= Policy::array_threshold)
+				{
+					data = convert_array_to_bset(result);
+				}
+				else
+				{
+					arg.swap(result);
+				}
+			}
+			else if constexpr (std::is_same_v<T, bb_bset>)
+			{
+				for (size_t i = 0; i < n; i++)
+				{
+					sz += !arg.test(values[i]);
+					arg.set(values[i]);
+				}
+			}
+			else if constexpr (std::is_same_v<T, bb_run>)
+			{
+				data = unite_run_run(arg, convert_array_to_run(bb_array(values, values + n)));
+				sz = cardinality(data);
+			} },
+				   data);
+	}
+	// out[i] = contains(values[i] & 0xFFFF), the container type is resolved once for the whole batch
+	void containsMany(uint32_t const *values, size_t n, bool *out) const
+	{
+		std::visit([values, n, out](auto const &arg)
+				   {
+			using T = std::decay_t<decltype(arg)>;
+			for (size_t i = 0; i < n; i++)
+			{
+				uint16_t value = values[i] & 0xFFFF;
+				if constexpr (std::is_same_v<T, bb_array>)
+				{
+					out[i] = std::binary_search(arg.begin(), arg.end(), value);
+				}
+				else if constexpr (std::is_same_v<T, bb_bset>)
+				{
+					out[i] = arg.test(value);
+				}
+				else if constexpr (std::is_same_v<T, bb_run>)
+				{
+					auto next = std::upper_bound(arg.begin(), arg.end(), value, [](uint16_t v, bb_interval const &r)
+												 { return v < r.start; });
+					out[i] = next != arg.begin() && value <= std::prev(next)->last;
+				}
+			} },
+				   data);
+	}
+	void clear()
+	{
+		data = bb_array();
+		sz = 0;
+	}
+	bool empty() const
+	{
+		return sz == 0;
+	}
+	// smallest & largest value, the container must not be empty
+	uint16_t minimum() const
+	{
+		return std::visit([](auto const &arg) -> uint16_t
+						  {
+			using T = std::decay_t<decltype(arg)>;
+			if constexpr (std::is_same_v<T, bb_array>)
+			{
+				return arg.front();
+			}
+			else if constexpr (std::is_same_v<T, bb_bset>)
+			{
+				return arg.first();
+			}
+			else if constexpr (std::is_same_v<T, bb_run>)
+			{
+				return arg.front().start;
+			} },
+						  data);
+	}
+	uint16_t maximum() const
+	{
+		return std::visit([](auto const &arg) -> uint16_t
+						  {
+			using T = std::decay_t<decltype(arg)>;
+			if constexpr (std::is_same_v<T, bb_array>)
+			{
+				return arg.back();
+			}
+			else if constexpr (std::is_same_v<T, bb_bset>)
+			{
+				return arg.last();
+			}
+			else if constexpr (std::is_same_v<T, bb_run>)
+			{
+				return arg.back().last;
+			} },
+						  data);
+	}
+	// number of values <= value
+	size_t rank(uint16_t value) const
+	{
+		return std::visit([value](auto const &arg) -> size_t
+						  {
+			using T = std::decay_t<decltype(arg)>;
+			if constexpr (std::is_same_v<T, bb_array>)
+			{
+				return std::upper_bound(arg.begin(), arg.end(), value) - arg.begin();
+			}
+			else if constexpr (std::is_same_v<T, bb_bset>)
+			{
+				return arg.rank(value);
+			}
+			else if constexpr (std::is_same_v<T, bb_run>)
+			{
+				size_t result = 0;
+				for (auto const &r : arg)
+				{
+					if (r.start > value)
+					{
+						break;
+					}
+					result += static_cast<size_t>(std::min(r.last, value)) - r.start + 1;
+				}
+				return result;
+			} },
+						  data);
+	}
+	// the i-th smallest value, i has to be below sz
+	uint16_t select(size_t i) const
+	{
+		return std::visit([i](auto const &arg) mutable -> uint16_t
+						  {
+			using T = std::decay_t<decltype(arg)>;
+			if constexpr (std::is_same_v<T, bb_array>)
+			{
+				return arg[i];
+			}
+			else if constexpr (std::is_same_v<T, bb_bset>)
+			{
+				return arg.select(i);
+			}
+			else if constexpr (std::is_same_v<T, bb_run>)
+			{
+				for (auto const &r : arg)
+				{
+					size_t len = static_cast<size_t>(r.last) - r.start + 1;
+					if (i < len)
+					{
+						return r.start + i;
+					}
+					i -= len;
+				}
+				return 0; // should *not* reach here
+			} },
+						  data);
+	}
+	// cursor/value walk used by the bitmap iterator: value is the current 16-bit value, cursor the
+	// index of the array slot or run holding it (unused for bitsets)
+	// moves to the first value >= target, target must not be below the current value
+	bool seek(size_t &cursor, uint32_t &value, uint32_t target) const
+	{
+		return std::visit([&cursor, &value, target](auto const &arg) -> bool
+						  {
+			using T = std::decay_t<decltype(arg)>;
+			if constexpr (std::is_same_v<T, bb_array>)
+			{
+				cursor = std::lower_bound(arg.begin() + cursor, arg.end(), target) - arg.begin();
+				if (cursor == arg.size())
+				{
+					return false;
+				}
+				value = arg[cursor];
+				return true;
+			}
+			else if constexpr (std::is_same_v<T, bb_bset>)
+			{
+				value = arg.next(target);
+				return value < BB_BSET_SZ;
+			}
+			else if constexpr (std::is_same_v<T, bb_run>)
+			{
+				cursor = std::lower_bound(arg.begin() + cursor, arg.end(), target, [](bb_interval const &r, uint32_t t)
+										  { return r.last < t; }) -
+						 arg.begin();
+				if (cursor == arg.size())
+				{
+					return false;
+				}
+				value = std::max<uint32_t>(arg[cursor].start, target);
+				return true;
+			} },
+						  data);
+	}
+	// moves to the next value, false once the container is exhausted
+	bool advance(size_t &cursor, uint32_t &value) const
+	{
+		return std::visit([&cursor, &value](auto const &arg) -> bool
+						  {
+			using T = std::decay_t<decltype(arg)>;
+			if constexpr (std::is_same_v<T, bb_array>)
+			{
+				if (++cursor == arg.size())
+				{
+					return false;
+				}
+				value = arg[cursor];
+				return true;
+			}
+			else if constexpr (std::is_same_v<T, bb_bset>)
+			{
+				value = arg.next(value + 1);
+				return value < BB_BSET_SZ;
+			}
+			else if constexpr (std::is_same_v<T, bb_run>)
+			{
+				if (value < arg[cursor].last)
+				{
+					value++;
+					return true;
+				}
+				if (++cursor == arg.size())
+				{
+					return false;
+				}
+				value = arg[cursor].start;
+				return true;
+			} },
+						  data);
+	}
+	// calls f(high | value) in order until f returns false, returns whether it ran to the end
+	template <class F>
+	bool forEach(uint32_t high, F &f) const
+	{
+		return std::visit([high, &f](auto const &arg) -> bool
+						  {
+			using T = std::decay_t<decltype(arg)>;
+			if constexpr (std::is_same_v<T, bb_array>)
+			{
+				for (auto const &i : arg)
+				{
+					if (!f(high | i))
+					{
+						return false;
+					}
+				}
+			}
+			else if constexpr (std::is_same_v<T, bb_bset>)
+			{
+				for (size_t w = 0; w < bb_bset::words; w++)
+				{
+					for (uint64_t word = arg.data()[w]; word; word &= word - 1)
+					{
+						if (!f(high | static_cast<uint32_t>(w * 64 + std::countr_zero(word))))
+						{
+							return false;
+						}
+					}
+				}
+			}
+			else if constexpr (std::is_same_v<T, bb_run>)
+			{
+				for (auto const &r : arg)
+				{
+					for (uint32_t i = r.start; i <= r.last; i++)
+					{
+						if (!f(high | i))
+						{
+							return false;
+						}
+					}
+				}
+			}
+			return true; },
+						  data);
+	}
+	// writes up to limit values (high | value) to out, starting at the skip-th one (skip < sz)
+	// returns how many were written
+	size_t decode(uint32_t high, size_t skip, size_t limit, uint32_t *out) const
+	{
+		return std::visit([high, skip, limit, out](auto const &arg) -> size_t
+						  {
+			using T = std::decay_t<decltype(arg)>;
+			size_t written = 0;
+			if constexpr (std::is_same_v<T, bb_array>)
+			{
+				written = std::min(limit, arg.size() - skip);
+				for (size_t i = 0; i < written; i++)
+				{
+					out[i] = high | arg[skip + i];
+				}
+			}
+			else if constexpr (std::is_same_v<T, bb_bset>)
+			{
+				if (skip == 0 && limit >= arg.count())
+				{
+					return arg.extract(out, high);
+				}
+				// whole words are skipped by popcount, the rest is peeled off with ctz
+				size_t w = 0;
+				size_t left = skip;
+				for (size_t c; (c = std::popcount(arg.data()[w])) <= left; w++)
+				{
+					left -= c;
+				}
+				for (; w < bb_bset::words && written < limit; w++)
+				{
+					uint64_t word = arg.data()[w];
+					for (; left; left--)
+					{
+						word &= word - 1;
+					}
+					for (; word && written < limit; word &= word - 1)
+					{
+						out[written++] = high | static_cast<uint32_t>(w * 64 + std::countr_zero(word));
+					}
+				}
+			}
+			else if constexpr (std::is_same_v<T, bb_run>)
+			{
+				size_t left = skip;
+				for (auto const &r : arg)
+				{
+					size_t len = static_cast<size_t>(r.last) - r.start + 1;
+					if (left >= len)
+					{
+						left -= len;
+						continue;
+					}
+					for (uint32_t i = r.start + left; i <= r.last && written < limit; i++)
+					{
+						out[written++] = high | i;
+					}
+					left = 0;
+					if (written == limit)
+					{
+						break;
+					}
+				}
+			}
+			return written; },
+						  data);
+	}
+	void remove(uint16_t value)
+	{
+		std::visit([this, value](auto &&arg)
+				   {
+			using T = std::decay_t<decltype(arg)>;
+			if constexpr (std::is_same_v<T, bb_array>)
+			{
+				auto itr = std::lower_bound(arg.begin(), arg.end(), value);
+				if (itr != arg.end() && *itr == value)
+				{
+					arg.erase(itr);
+					sz--;
+				}
+			}
+			else if constexpr (std::is_same_v<T, bb_bset>)
+			{
+				if (arg.test(value))
+				{
+					arg.reset(value);
+					sz--;
+					if (sz < Policy::array_threshold)
+					{
+						data = convert_bset_to_array(arg);
+					}
+				}
+			}
+			else if constexpr (std::is_same_v<T, bb_run>)
+			{
+				auto next = std::upper_bound(arg.begin(), arg.end(), value, [](uint16_t v, bb_interval const &r)
+											 { return v < r.start; });
+				if (next == arg.begin())
+				{
+					return;
+				}
+				auto r = std::prev(next);
+				if (value > r->last)
+				{
+					return;
+				}
+				sz--;
+				if (r->start == r->last)
+				{
+					arg.erase(r);
+				}
+				else if (value == r->start)
+				{
+					r->start++;
+				}
+				else if (value == r->last)
+				{
+					r->last--;
+				}
+				else
+				{
+					// split the run around value
+					bb_interval upper{static_cast<uint16_t>(value + 1), r->last};
+					r->last = value - 1;
+					arg.insert(next, upper);
+				}
+			} },
+				   data);
+	}
+	bool contains(uint16_t value) const
+	{
+		return std::visit([value](auto &&arg) -> bool
+						  {
+        using T = std::decay_t<decltype(arg)>;
+        if constexpr (std::is_same_v<T, bb_array>)
+        {
+            return std::binary_search(arg.begin(), arg.end(), value);
+        }
+        else if constexpr (std::is_same_v<T, bb_bset>)
+        {
+            return arg.test(value);
+        }
+        else if constexpr (std::is_same_v<T, bb_run>)
+        {
+            auto next = std::upper_bound(arg.begin(), arg.end(), value, [](uint16_t v, bb_interval const &r)
+                                         { return v < r.start; });
+            return next != arg.begin() && value <= std::prev(next)->last;
+        }
+        else
+        {
+			//should *not* reach here
+            return false; // or handle other types appropriately
+        } },
+						  data);
+		;
+	}
+	void intersect(BBData const &other)
+	{
+		bb_pool pool;
+		intersect(other, pool);
+	}
+	// results are written in place where the container type allows it, otherwise into pooled buffers
+	void intersect(BBData const &other, bb_pool &pool)
+	{
+		std::visit([this, &pool](auto &arg1, auto const &arg2)
+				   {
+		using T1 = std::decay_t<decltype(arg1)>;
+		using T2 = std::decay_t<decltype(arg2)>;
+
+		if constexpr (std::is_same_v<T1, bb_array> && std::is_same_v<T2, bb_array>)
+		{
+			// the simd kernel reads ahead of what it writes, so it can't work in place: use a spare buffer
+			bb_array result = pool.takeArray(std::min(arg1.size(), arg2.size()) + BB_SIMD_SLACK);
+			result.resize(std::min(arg1.size(), arg2.size()) + BB_SIMD_SLACK);
+			result.resize(bb_intersect_u16(arg1.data(), arg1.size(), arg2.data(), arg2.size(), result.data()));
+			arg1.swap(result);
+			pool.give(std::move(result));
+		}
+		else if constexpr (std::is_same_v<T1, bb_array> && std::is_same_v<T2, bb_bset>)
+		{
+			// filter in place, the write position never passes the read position
+			size_t out = 0;
+			for (auto const &i : arg1)
+			{
+				if (arg2.test(i))
+				{
+					arg1[out++] = i;
+				}
+			}
+			arg1.resize(out);
+		}
+		else if constexpr (std::is_same_v<T1, bb_bset> && std::is_same_v<T2, bb_array>)
+		{
+			// handle intersection for bb_bset vs bb_array
+			bb_array result = pool.takeArray(arg2.size());
+			for (auto const &i : arg2)
+			{
+				if (arg1.test(i))
+				{
+					result.push_back(i);
+				}
+			}
+			pool.give(std::move(arg1));
+			data = std::move(result);
+		}
+		else if constexpr (std::is_same_v<T1, bb_bset> && std::is_same_v<T2, bb_bset>)
+		{
+			// handle intersection for bb_bset vs bb_bset, repack() below moves it to an array if it got small
+			arg1 &= arg2;
+		}
+		else if constexpr (std::is_same_v<T1, bb_run> && std::is_same_v<T2, bb_array>)
+		{
+			data = intersect_run_array(arg1, arg2); // skip redundant check
+		}
+		else if constexpr (std::is_same_v<T1, bb_array> && std::is_same_v<T2, bb_run>)
+		{
+			data = intersect_run_array(arg2, arg1); // skip redundant check
+		}
+		else if constexpr (std::is_same_v<T1, bb_run> && std::is_same_v<T2, bb_bset>)
+		{
+			data = intersect_run_bset(arg1, arg2);
+		}
+		else if constexpr (std::is_same_v<T1, bb_bset> && std::is_same_v<T2, bb_run>)
+		{
+			bb_variant result = intersect_run_bset(arg2, arg1);
+			pool.give(std::move(arg1));
+			data = std::move(result);
+		}
+		else if constexpr (std::is_same_v<T1, bb_run> && std::is_same_v<T2, bb_run>)
+		{
+			data = intersect_run_run(arg1, arg2);
+		} },
+				   data, other.data);
+		sz = cardinality(data);
+		repack(pool);
+	}
+
+	void unite(BBData const &other)
+	{
+		bb_pool pool;
+		unite(other, pool);
+	}
+	void unite(BBData const &other, bb_pool &pool)
+	{
+		std::visit([this, &pool](auto &arg1, auto const &arg2)
+				   {
+		using T1 = std::decay_t<decltype(arg1)>;
+		using T2 = std::decay_t<decltype(arg2)>;
+
+		if constexpr (std::is_same_v<T1, bb_array> && std::is_same_v<T2, bb_array>)
+		{
+			// merge the sorted arrays, only go to a bitset if the union really crosses the threshold
+			bb_array result = pool.takeArray(arg1.size() + arg2.size() + BB_SIMD_SLACK);
+			result.resize(arg1.size() + arg2.size() + BB_SIMD_SLACK);
+			result.resize(bb_union_u16(arg1.data(), arg1.size(), arg2.data(), arg2.size(), result.data()));
+			arg1.swap(result);
+			pool.give(std::move(result));
+		}
+		else if constexpr (std::is_same_v<T1, bb_array> && std::is_same_v<T2, bb_bset>)
+		{
+			//lower-bounded by bset, which is guaranteed to be above threshold
+			bb_bset result = pool.takeBset();
+			result = arg2;
+			for(auto const &i : arg1) result.set(i);
+			pool.give(std::move(arg1));
+			data = std::move(result);
+		}
+		else if constexpr (std::is_same_v<T1, bb_bset> && std::is_same_v<T2, bb_array>)
+		{
+			for(auto const &i : arg2) arg1.set(i);
+		}
+		else if constexpr (std::is_same_v<T1, bb_bset> && std::is_same_v<T2, bb_bset>)
+		{
+			arg1 |= arg2;
+		}
+		else if constexpr (std::is_same_v<T1, bb_run> && std::is_same_v<T2, bb_array>)
+		{
+			data = unite_run_run(arg1, convert_array_to_run(arg2));
+		}
+		else if constexpr (std::is_same_v<T1, bb_array> && std::is_same_v<T2, bb_run>)
+		{
+			bb_variant result = unite_run_run(convert_array_to_run(arg1), arg2);
+			pool.give(std::move(arg1));
+			data = std::move(result);
+		}
+		else if constexpr (std::is_same_v<T1, bb_run> && std::is_same_v<T2, bb_bset>)
+		{
+			data = unite_run_bset(arg1, arg2); //skip redundant check
+		}
+		else if constexpr (std::is_same_v<T1, bb_bset> && std::is_same_v<T2, bb_run>)
+		{
+			for (auto const &r : arg2)
+			{
+				arg1.setRange(r.start, r.last);
+			}
+		}
+		else if constexpr (std::is_same_v<T1, bb_run> && std::is_same_v<T2, bb_run>)
+		{
+			data = unite_run_run(arg1, arg2);
+		} },
+				   data, other.data);
+		sz = cardinality(data);
+		repack(pool);
+	}
+
+	void difference(BBData const &other)
+	{
+		bb_pool pool;
+		difference(other, pool);
+	}
+	// removes every value of other (andnot), in place unless a run has to become something else
+	void difference(BBData const &other, bb_pool &pool)
+	{
+		std::visit([this, &pool](auto &arg1, auto const &arg2)
+				   {
+		using T1 = std::decay_t<decltype(arg1)>;
+		using T2 = std::decay_t<decltype(arg2)>;
+
+		if constexpr (std::is_same_v<T1, bb_array> && std::is_same_v<T2, bb_array>)
+		{
+			bb_array result = pool.takeArray(arg1.size() + BB_SIMD_SLACK);
+			result.resize(arg1.size() + BB_SIMD_SLACK);
+			result.resize(bb_difference_u16(arg1.data(), arg1.size(), arg2.data(), arg2.size(), result.data()));
+			arg1.swap(result);
+			pool.give(std::move(result));
+		}
+		else if constexpr (std::is_same_v<T1, bb_array> && std::is_same_v<T2, bb_bset>)
+		{
+			std::erase_if(arg1, [&arg2](uint16_t i)
+						  { return arg2.test(i); });
+		}
+		else if constexpr (std::is_same_v<T1, bb_array> && std::is_same_v<T2, bb_run>)
+		{
+			// values only increase, so the run cursor never goes back
+			auto r = arg2.begin();
+			std::erase_if(arg1, [&r, &arg2](uint16_t i)
+						  {
+				while (r != arg2.end() && r->last < i)
+				{
+					r++;
+				}
+				return r != arg2.end() && r->start <= i; });
+		}
+		else if constexpr (std::is_same_v<T1, bb_bset> && std::is_same_v<T2, bb_array>)
+		{
+			for (auto const &i : arg2)
+			{
+				arg1.reset(i);
+			}
+		}
+		else if constexpr (std::is_same_v<T1, bb_bset> && std::is_same_v<T2, bb_bset>)
+		{
+			arg1.andNot(arg2);
+		}
+		else if constexpr (std::is_same_v<T1, bb_bset> && std::is_same_v<T2, bb_run>)
+		{
+			for (auto const &r : arg2)
+			{
+				arg1.resetRange(r.start, r.last);
+			}
+		}
+		else if constexpr (std::is_same_v<T1, bb_run> && std::is_same_v<T2, bb_array>)
+		{
+			data = difference_run_run(arg1, convert_array_to_run(arg2));
+		}
+		else if constexpr (std::is_same_v<T1, bb_run> && std::is_same_v<T2, bb_bset>)
+		{
+			bb_bset result = pool.takeBset();
+			for (auto const &r : arg1)
+			{
+				result.setRange(r.start, r.last);
+			}
+			result.andNot(arg2);
+			data = std::move(result);
+		}
+		else if constexpr (std::is_same_v<T1, bb_run> && std::is_same_v<T2, bb_run>)
+		{
+			data = difference_run_run(arg1, arg2);
+		} },
+				   data, other.data);
+		sz = cardinality(data);
+		repack(pool);
+	}
+
+	void symmetricDifference(BBData const &other)
+	{
+		bb_pool pool;
+		symmetricDifference(other, pool);
+	}
+	// values in exactly one of the two
+	void symmetricDifference(BBData const &other, bb_pool &pool)
+	{
+		std::visit([this, &pool](auto &arg1, auto const &arg2)
+				   {
+		using T1 = std::decay_t<decltype(arg1)>;
+		using T2 = std::decay_t<decltype(arg2)>;
+
+		if constexpr (std::is_same_v<T1, bb_array> && std::is_same_v<T2, bb_array>)
+		{
+			bb_array result = pool.takeArray(arg1.size() + arg2.size());
+			std::set_symmetric_difference(arg1.begin(), arg1.end(), arg2.begin(), arg2.end(), std::back_inserter(result));
+			arg1.swap(result);
+			pool.give(std::move(result));
+		}
+		else if constexpr (std::is_same_v<T1, bb_array> && std::is_same_v<T2, bb_bset>)
+		{
+			bb_bset result = pool.takeBset();
+			result = arg2;
+			for (auto const &i : arg1)
+			{
+				result.flip(i);
+			}
+			pool.give(std::move(arg1));
+			data = std::move(result);
+		}
+		else if constexpr (std::is_same_v<T1, bb_bset> && std::is_same_v<T2, bb_array>)
+		{
+			for (auto const &i : arg2)
+			{
+				arg1.flip(i);
+			}
+		}
+		else if constexpr (std::is_same_v<T1, bb_bset> && std::is_same_v<T2, bb_bset>)
+		{
+			arg1 ^= arg2;
+		}
+		else if constexpr (std::is_same_v<T1, bb_array> && std::is_same_v<T2, bb_run>)
+		{
+			bb_variant result = xor_run_run(convert_array_to_run(arg1), arg2);
+			pool.give(std::move(arg1));
+			data = std::move(result);
+		}
+		else if constexpr (std::is_same_v<T1, bb_run> && std::is_same_v<T2, bb_array>)
+		{
+			data = xor_run_run(arg1, convert_array_to_run(arg2));
+		}
+		else if constexpr (std::is_same_v<T1, bb_run> && std::is_same_v<T2, bb_bset>)
+		{
+			bb_bset result = pool.takeBset();
+			result = arg2;
+			for (auto const &r : arg1)
+			{
+				result.flipRange(r.start, r.last);
+			}
+			data = std::move(result);
+		}
+		else if constexpr (std::is_same_v<T1, bb_bset> && std::is_same_v<T2, bb_run>)
+		{
+			for (auto const &r : arg2)
+			{
+				arg1.flipRange(r.start, r.last);
+			}
+		}
+		else if constexpr (std::is_same_v<T1, bb_run> && std::is_same_v<T2, bb_run>)
+		{
+			data = xor_run_run(arg1, arg2);
+		} },
+				   data, other.data);
+		sz = cardinality(data);
+		repack(pool);
+	}
+
+	void flip(uint16_t lo, uint16_t hi)
+	{
+		bb_pool pool;
+		flip(lo, hi, pool);
+	}
+	// toggles every value in [lo, hi]
+	void flip(uint16_t lo, uint16_t hi, bb_pool &pool)
+	{
+		symmetricDifference(BBData(bb_run{{lo, hi}}), pool);
+	}
+
+	// size of the intersection with other, without building it
+	size_t andCardinality(BBData const &other) const
+	{
+		return std::visit([](auto const &arg1, auto const &arg2) -> size_t
+						  {
+		using T1 = std::decay_t<decltype(arg1)>;
+		using T2 = std::decay_t<decltype(arg2)>;
+
+		if constexpr (std::is_same_v<T1, bb_array> && std::is_same_v<T2, bb_array>)
+		{
+			return bb_intersect_count_u16(arg1.data(), arg1.size(), arg2.data(), arg2.size());
+		}
+		else if constexpr (std::is_same_v<T1, bb_array> && std::is_same_v<T2, bb_bset>)
+		{
+			return std::count_if(arg1.begin(), arg1.end(), [&arg2](uint16_t i)
+								 { return arg2.test(i); });
+		}
+		else if constexpr (std::is_same_v<T1, bb_bset> && std::is_same_v<T2, bb_array>)
+		{
+			return std::count_if(arg2.begin(), arg2.end(), [&arg1](uint16_t i)
+								 { return arg1.test(i); });
+		}
+		else if constexpr (std::is_same_v<T1, bb_bset> && std::is_same_v<T2, bb_bset>)
+		{
+			return arg1.andCount(arg2);
+		}
+		else if constexpr (std::is_same_v<T1, bb_run> && std::is_same_v<T2, bb_array>)
+		{
+			return and_count_run_array(arg1, arg2);
+		}
+		else if constexpr (std::is_same_v<T1, bb_array> && std::is_same_v<T2, bb_run>)
+		{
+			return and_count_run_array(arg2, arg1);
+		}
+		else if constexpr (std::is_same_v<T1, bb_run> && std::is_same_v<T2, bb_bset>)
+		{
+			return and_count_run_bset(arg1, arg2);
+		}
+		else if constexpr (std::is_same_v<T1, bb_bset> && std::is_same_v<T2, bb_run>)
+		{
+			return and_count_run_bset(arg2, arg1);
+		}
+		else if constexpr (std::is_same_v<T1, bb_run> && std::is_same_v<T2, bb_run>)
+		{
+			return and_count_run_run(arg1, arg2);
+		} },
+						  data, other.data);
+	}
+
+	// convertForCardinality without the copies: flips between array & bitset using sz,
+	// the buffer that is given up goes back to the pool
+	void repack(bb_pool &pool)
+	{
+		if (auto array = std::get_if<bb_array>(&data); array && sz >= Policy::array_threshold)
+		{
+			bb_bset result = pool.takeBset();
+			for (auto const &i : *array)
+			{
+				result.set(i);
+			}
+			pool.give(std::move(*array));
+			data = std::move(result);
+		}
+		else if (auto bset = std::get_if<bb_bset>(&data); bset && sz < Policy::array_threshold)
+		{
+			bb_array result = pool.takeArray(sz);
+			result.resize(sz);
+			bset->extract(result.data());
+			pool.give(std::move(*bset));
+			data = std::move(result);
+		}
+	}
+
+	// switch to whichever of array, bitset or run takes the fewest bytes
+	// returns true if the container ended up as a bb_run
+	bool runOptimize()
+	{
+		size_t card = sz;
+		size_t runs = run_count(data);
+		size_t flat = card < Policy::array_threshold ? bb_array_bytes(card) : bb_bset_bytes();
+		if (bb_run_bytes(runs) < flat)
+		{
+			if (!std::holds_alternative<bb_run>(data))
+			{
+				data = std::visit([](auto const &arg) -> bb_run
+								  {
+					using T = std::decay_t<decltype(arg)>;
+					if constexpr (std::is_same_v<T, bb_array>)
+					{
+						return convert_array_to_run(arg);
+					}
+					else if constexpr (std::is_same_v<T, bb_bset>)
+					{
+						return convert_bset_to_run(arg);
+					}
+					else
+					{
+						return arg;
+					} },
+								  data);
+			}
+			return true;
+		}
+		if (std::holds_alternative<bb_run>(data))
+		{
+			auto const &run = std::get<bb_run>(data);
+			if (card < Policy::array_threshold)
+			{
+				data = convert_run_to_array(run);
+			}
+			else
+			{
+				data = convert_run_to_bset(run);
+			}
+		}
+		return false;
+	}
+	// serialized size of the encoding runOptimize() would pick
+	size_t optimizedBytes() const
+	{
+		size_t flat = sz < Policy::array_threshold ? bb_array_bytes(sz) : bb_bset_bytes();
+		return std::min(flat, bb_run_bytes(run_count(data)));
+	}
+	// heap bytes behind data, reserved counts spare vector capacity too
+	size_t usedBytes() const
+	{
+		return heapBytes(false);
+	}
+	size_t reservedBytes() const
+	{
+		return heapBytes(true);
+	}
+	void shrinkToFit()
+	{
+		std::visit([](auto &arg)
+				   {
+			using T = std::decay_t<decltype(arg)>;
+			if constexpr (!std::is_same_v<T, bb_bset>)
+			{
+				arg.shrink_to_fit();
+			} },
+				   data);
+	}
+
+private:
+	size_t heapBytes(bool reserved) const
+	{
+		return std::visit([reserved](auto const &arg) -> size_t
+						  {
+			using T = std::decay_t<decltype(arg)>;
+			if constexpr (std::is_same_v<T, bb_bset>)
+			{
+				return bb_bset_bytes();
+			}
+			else
+			{
+				return (reserved ? arg.capacity() : arg.size()) * sizeof(typename T::value_type);
+			} },
+						  data);
+	}
+};
+
+using BBData = BasicBBData<>;
+
+// copy-on-write handle to a bucket: copying a bitmap copies pointers, and a bucket that is shared
+// with another copy is cloned the first time it's written through mut()
+template <typename Policy = bb_default_policy>
+class bb_basic_cow
+{
+	using BBData = BasicBBData<Policy>;
+
+public:
+	// empty slot, only there to be assigned over or written through mut()
+	bb_basic_cow() = default;
+	explicit bb_basic_cow(BBData data) : ptr(std::make_shared<BBData>(std::move(data))){};
+
+	BBData const &operator*() const { return *ptr; }
+	BBData const *operator->() const { return ptr.get(); }
+	BBData const *get() const { return ptr.get(); }
+	// true if no other bitmap holds this bucket, so it's safe to write or cannibalize
+	bool unique() const
+	{
+		if (ptr.use_count() != 1)
+		{
+			return false;
+		}
+		// pairs with the release in another copy dropping its reference, so whatever it read
+		// from the bucket happens-before we write to it
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return true;
+	}
+	BBData &mut()
+	{
+		if (!ptr)
+		{
+			ptr = std::make_shared<BBData>();
+		}
+		else if (!unique())
+		{
+			ptr = std::make_shared<BBData>(*ptr);
+		}
+		return *ptr;
+	}
+
+private:
+	std::shared_ptr<BBData> ptr;
+};
+
+using bb_cow = bb_basic_cow<>;
+
+// runs fn(i) for every i in [0, n) on up to threads threads, slices are handed out dynamically
+// because buckets differ wildly in cost; the first exception thrown by a worker is rethrown
+template <typename F>
+static void bb_parallel_for(size_t n, size_t threads, F &&fn)
+{
+	threads = std::min(threads, n / BB_PARALLEL_GRAIN);
+	if (threads <= 1)
+	{
+		for (size_t i = 0; i < n; i++)
+		{
+			fn(i);
+		}
+		return;
+	}
+	std::atomic<size_t> next{0};
+	std::exception_ptr error;
+	std::atomic<bool> failed{false};
+	auto worker = [&]
+	{
+		try
+		{
+			for (size_t begin; !failed && (begin = next.fetch_add(BB_PARALLEL_GRAIN)) < n;)
+			{
+				for (size_t i = begin; i < std::min(begin + BB_PARALLEL_GRAIN, n); i++)
+				{
+					fn(i);
+				}
+			}
+		}
+		catch (...)
+		{
+			if (!failed.exchange(true))
+			{
+				error = std::current_exception();
+			}
+		}
+	};
+	{
+		std::vector<std::jthread> pool;
+		for (size_t t = 1; t < threads; t++)
+		{
+			pool.emplace_back(worker);
+		}
+		worker();
+	}
+	if (error)
+	{
+		std::rethrow_exception(error);
+	}
+}
+
+// ors a container into a bitset accumulator, the accumulator's cardinality is left for the caller
+inline void bb_or_into(bb_bset &acc, bb_variant const &data)
+{
+	std::visit([&acc](auto const &arg)
+			   {
+		using T = std::decay_t<decltype(arg)>;
+		if constexpr (std::is_same_v<T, bb_array>)
+		{
+			for (auto const &i : arg)
+			{
+				acc.set(i);
+			}
+		}
+		else if constexpr (std::is_same_v<T, bb_bset>)
+		{
+			acc |= arg;
+		}
+		else if constexpr (std::is_same_v<T, bb_run>)
+		{
+			for (auto const &r : arg)
+			{
+				acc.setRange(r.start, r.last);
+			}
+		} },
+			   data);
+}
+
+// roaring portable serialization format, https://github.com/RoaringBitmap/RoaringFormatSpec
+// arrays hold up to BB_PORTABLE_ARRAY_MAX values there, bitsets anything above that
+#define BB_SERIAL_COOKIE_NO_RUN 12346
+#define BB_SERIAL_COOKIE 12347
+#define BB_NO_OFFSET_THRESHOLD 4
+#define BB_PORTABLE_ARRAY_MAX 4096
+
+static_assert(std::endian::native == std::endian::little, "the portable format is little-endian");
+
+// the format makes no alignment promises, so every read & write goes through memcpy
+template <typename T>
+static auto bb_load(std::byte const *src) -> T
+{
+	T result;
+	std::memcpy(&result, src, sizeof(T));
+	return result;
+}
+
+template <typename T>
+static void bb_store(std::byte *dst, T value)
+{
+	std::memcpy(dst, &value, sizeof(T));
+}
+
+static auto bb_portable_header_bytes(size_t containers, bool runs) -> size_t
+{
+	size_t result = runs ? 4 + (containers + 7) / 8 : 8;
+	result += 4 * containers;
+	if (!runs || containers >= BB_NO_OFFSET_THRESHOLD)
+	{
+		result += 4 * containers;
+	}
+	return result;
+}
+
+template <typename Policy>
+static auto bb_portable_bytes(BasicBBData<Policy> const &bucket) -> size_t
+{
+	if (auto run = std::get_if<bb_run>(&bucket.data))
+	{
+		return bb_run_bytes(run->size());
+	}
+	return bucket.sz <= BB_PORTABLE_ARRAY_MAX ? bb_array_bytes(bucket.sz) : bb_bset_bytes();
+}
+
+// writes one container body, returns the number of bytes written
+template <typename Policy>
+static auto bb_write_portable(BasicBBData<Policy> const &bucket, std::byte *out) -> size_t
+{
+	bb_variant const &data = bucket.data;
+	if (auto run = std::get_if<bb_run>(&data))
+	{
+		bb_store<uint16_t>(out, run->size());
+		for (size_t i = 0; i < run->size(); i++)
+		{
+			bb_store<uint16_t>(out + 2 + 4 * i, (*run)[i].start);
+			bb_store<uint16_t>(out + 4 + 4 * i, (*run)[i].last - (*run)[i].start);
+		}
+		return bb_run_bytes(run->size());
+	}
+	if (auto array = std::get_if<bb_array>(&data); array && array->size() <= BB_PORTABLE_ARRAY_MAX)
+	{
+		std::memcpy(out, array->data(), bb_array_bytes(array->size()));
+		return bb_array_bytes(array->size());
+	}
+	if (auto bset = std::get_if<bb_bset>(&data))
+	{
+		if (bucket.sz <= BB_PORTABLE_ARRAY_MAX)
+		{
+			bb_array array = convert_bset_to_array(*bset);
+			std::memcpy(out, array.data(), bb_array_bytes(array.size()));
+			return bb_array_bytes(array.size());
+		}
+		// the in-memory words already are the portable layout
+		std::memcpy(out, bset->data(), bb_bset_bytes());
+		return bb_bset_bytes();
+	}
+	bb_bset bset = convert_array_to_bset(std::get<bb_array>(data));
+	std::memcpy(out, bset.data(), bb_bset_bytes());
+	return bb_bset_bytes();
+}
+
+// parsed & validated header of a portable buffer, containers are only pointed at, never copied
+class bb_portable_view
+{
+public:
+	explicit bb_portable_view(std::span<std::byte const> buf) : buf(buf)
+	{
+		need(4);
+		uint32_t cookie = bb_load<uint32_t>(buf.data());
+		size_t pos;
+		if ((cookie & 0xFFFF) == BB_SERIAL_COOKIE)
+		{
+			n = (cookie >> 16) + 1;
+			pos = 4 + (n + 7) / 8;
+			need(pos);
+			run_flags = buf.data() + 4;
+		}
+		else if (cookie == BB_SERIAL_COOKIE_NO_RUN)
+		{
+			need(8);
+			n = bb_load<uint32_t>(buf.data() + 4);
+			pos = 8;
+			if (n > BB_BUCKET_SZ)
+			{
+				throw std::runtime_error("BarkingBitmap: too many containers");
+			}
+		}
+		else
+		{
+			throw std::runtime_error("BarkingBitmap: not a portable roaring buffer");
+		}
+		need(pos + 4 * n);
+		descriptive = buf.data() + pos;
+		pos += 4 * n;
+		if (!run_flags || n >= BB_NO_OFFSET_THRESHOLD)
+		{
+			need(pos + 4 * n);
+			offset_header = buf.data() + pos;
+			pos += 4 * n;
+		}
+		else
+		{
+			// short run-format buffers have no offset header, containers just follow each other
+			for (size_t i = 0; i < n; i++)
+			{
+				small_offsets[i] = pos;
+				need(pos + 2);
+				pos += containerBytes(i);
+			}
+		}
+		total = pos;
+		for (size_t i = 0; i < n; i++)
+		{
+			if (i > 0 && key(i) <= key(i - 1))
+			{
+				throw std::runtime_error("BarkingBitmap: container keys are not sorted");
+			}
+			size_t offset = this->offset(i);
+			need(offset + 2);
+			need(offset + containerBytes(i));
+			total = std::max(total, offset + containerBytes(i));
+			checkContainer(i);
+		}
+	}
+
+	size_t size() const { return n; }
+	uint16_t key(size_t i) const { return bb_load<uint16_t>(descriptive + 4 * i); }
+	size_t cardinality(size_t i) const { return bb_load<uint16_t>(descriptive + 4 * i + 2) + size_t(1); }
+	bool isRun(size_t i) const { return run_flags && (std::to_integer<uint8_t>(run_flags[i / 8]) >> (i % 8)) & 1; }
+	std::byte const *container(size_t i) const { return buf.data() + offset(i); }
+	// the part of the buffer actually covered by the serialized bitmap
+	std::span<std::byte const> bytes() const { return buf.first(total); }
+
+	size_t containerBytes(size_t i) const
+	{
+		if (isRun(i))
+		{
+			return bb_run_bytes(bb_load<uint16_t>(container(i)));
+		}
+		return cardinality(i) <= BB_PORTABLE_ARRAY_MAX ? bb_array_bytes(cardinality(i)) : bb_bset_bytes();
+	}
+
+private:
+	void need(size_t bytes) const
+	{
+		if (bytes > buf.size())
+		{
+			throw std::runtime_error("BarkingBitmap: truncated buffer");
+		}
+	}
+	// the contents have to match the header: arrays strictly increasing, bitsets holding exactly the
+	// header cardinality, and runs inside the container, sorted, not overlapping and adding up to the
+	// cardinality. the header cardinality is at least 1, so this also rules out empty containers
+	void checkContainer(size_t i) const
+	{
+		std::byte const *src = container(i);
+		if (isRun(i))
+		{
+			checkRuns(src, cardinality(i));
+		}
+		else if (cardinality(i) <= BB_PORTABLE_ARRAY_MAX)
+		{
+			for (size_t k = 1; k < cardinality(i); k++)
+			{
+				if (bb_load<uint16_t>(src + 2 * k) <= bb_load<uint16_t>(src + 2 * (k - 1)))
+				{
+					throw std::runtime_error("BarkingBitmap: array container is not strictly increasing");
+				}
+			}
+		}
+		else
+		{
+			size_t card = 0;
+			for (size_t w = 0; w < bb_bset_bytes() / 8; w++)
+			{
+				card += std::popcount(bb_load<uint64_t>(src + 8 * w));
+			}
+			if (card != cardinality(i))
+			{
+				throw std::runtime_error("BarkingBitmap: bitset doesn't match the cardinality");
+			}
+		}
+	}
+	static void checkRuns(std::byte const *src, size_t expected)
+	{
+		size_t runs = bb_load<uint16_t>(src);
+		size_t card = 0;
+		size_t next = 0; // smallest start the next run may have
+		for (size_t r = 0; r < runs; r++)
+		{
+			size_t start = bb_load<uint16_t>(src + 2 + 4 * r);
+			size_t end = start + bb_load<uint16_t>(src + 4 + 4 * r);
+			if (end > 0xFFFF)
+			{
+				throw std::runtime_error("BarkingBitmap: run past the end of its container");
+			}
+			if (start < next)
+			{
+				throw std::runtime_error("BarkingBitmap: runs are not sorted");
+			}
+			card += end - start + 1;
+			next = end + 1;
+		}
+		if (card != expected)
+		{
+			throw std::runtime_error("BarkingBitmap: run lengths don't match the cardinality");
+		}
+	}
+	size_t offset(size_t i) const
+	{
+		return offset_header ? bb_load<uint32_t>(offset_header + 4 * i) : small_offsets[i];
+	}
+
+	std::span<std::byte const> buf;
+	size_t n = 0;
+	size_t total = 0;
+	std::byte const *run_flags = nullptr;
+	std::byte const *descriptive = nullptr;
+	std::byte const *offset_header = nullptr;
+	std::array<size_t, BB_NO_OFFSET_THRESHOLD> small_offsets{};
+};
+
+// copies container i of a portable buffer onto the heap, as an array or bitset by threshold
+static auto bb_read_portable(bb_portable_view const &view, size_t i, size_t threshold = BB_ARRAY_THRESHOLD) -> bb_variant
+{
+	std::byte const *src = view.container(i);
+	size_t card = view.cardinality(i);
+	if (view.isRun(i))
+	{
+		bb_run run(bb_load<uint16_t>(src));
+		for (size_t r = 0; r < run.size(); r++)
+		{
+			uint16_t start = bb_load<uint16_t>(src + 2 + 4 * r);
+			run[r] = {start, static_cast<uint16_t>(start + bb_load<uint16_t>(src + 4 + 4 * r))};
+		}
+		return run;
+	}
+	if (card <= BB_PORTABLE_ARRAY_MAX)
+	{
+		bb_array array(card);
+		std::memcpy(array.data(), src, bb_array_bytes(card));
+		if (card >= threshold)
+		{
+			return convert_array_to_bset(array);
+		}
+		return array;
+	}
+	bb_bset bset;
+	std::memcpy(bset.data(), src, bb_bset_bytes());
+	if (card < threshold)
+	{
+		return convert_bset_to_array(bset);
+	}
+	return bset;
+}
+
+// per container type part of bb_stats
+struct bb_container_stats
+{
+	size_t containers = 0;
+	uint64_t values = 0;
+	size_t bytes_used = 0;
+	size_t bytes_reserved = 0;
+};
+
+enum bb_suggestion
+{
+	bb_suggest_nothing,
+	bb_suggest_run_optimize, // runOptimize() would save at least an eighth of the container bytes
+	bb_suggest_shrink_to_fit // more than a quarter of the reserved bytes is spare capacity or pooled buffers
+};
+
+// what stats() reports, bytes are heap + object bytes this bitmap keeps alive (shared buckets count in full)
+struct bb_stats
+{
+	bb_container_stats arrays;
+	bb_container_stats bitsets;
+	bb_container_stats runs;
+	// buckets also held by another copy of the bitmap
+	size_t shared_containers = 0;
+	// sorted keys and bucket handles
+	size_t index_bytes_used = 0;
+	size_t index_bytes_reserved = 0;
+	size_t pool_bytes = 0;
+	size_t bytes_used = 0;
+	size_t bytes_reserved = 0;
+	size_t serialized_bytes = 0;
+	// serialized_bytes after runOptimize()
+	size_t optimized_bytes = 0;
+	bb_suggestion suggestion = bb_suggest_nothing;
+};
+
+class ConcurrentBarkingBitmap;
+
+// only non-empty buckets are stored, keyed by the high 16 bits and kept sorted by key
+// const members never write to the bitmap, so any number of threads can read a shared one
+// (contains, cardinality, ...) as long as nobody modifies it; rank & select are the exception,
+// they lazily build an index unless buildRankIndex() was called after the last change
+template <typename Policy = bb_default_policy>
+class BasicBarkingBitmap
+{
+	// builds snapshots straight out of shared buckets
+	friend class ConcurrentBarkingBitmap;
+
+	template <typename T>
+	using allocator = typename Policy::template allocator<T>;
+
+public:
+	using BBData = BasicBBData<Policy>;
+	using bb_cow = bb_basic_cow<Policy>;
+	using BarkingBitmap = BasicBarkingBitmap;
+
+	BasicBarkingBitmap() = default;
+	~BasicBarkingBitmap() = default;
+
+	// forward iterator over the values in ascending order, invalidated by any mutation
+	class const_iterator
+	{
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = uint32_t;
+		using difference_type = std::ptrdiff_t;
+		using pointer = uint32_t const *;
+		using reference = uint32_t;
+
+		const_iterator() = default;
+
+		uint32_t operator*() const
+		{
+			return static_cast<uint32_t>(owner->bb_keys[bucket]) << 16 | value;
+		}
+		const_iterator &operator++()
+		{
+			if (!owner->bb_data[bucket]->advance(cursor, value))
+			{
+				bucket++;
+				nextBucket(0);
+			}
+			return *this;
+		}
+		const_iterator operator++(int)
+		{
+			const_iterator result = *this;
+			++*this;
+			return result;
+		}
+		bool operator==(const_iterator const &other) const
+		{
+			return bucket == other.bucket && value == other.value;
+		}
+		// skip ahead to the first value >= target, never moves backwards
+		void advanceIfNeeded(uint32_t target)
+		{
+			if (bucket == owner->bb_keys.size() || target <= **this)
+			{
+				return;
+			}
+			uint16_t key = target >> 16;
+			if (owner->bb_keys[bucket] == key)
+			{
+				if (owner->bb_data[bucket]->seek(cursor, value, target & 0xFFFF))
+				{
+					return;
+				}
+				bucket++;
+			}
+			else
+			{
+				bucket = std::lower_bound(owner->bb_keys.begin() + bucket, owner->bb_keys.end(), key) - owner->bb_keys.begin();
+			}
+			nextBucket(bucket < owner->bb_keys.size() && owner->bb_keys[bucket] == key ? target & 0xFFFF : 0);
+		}
+
+	private:
+		friend class BasicBarkingBitmap;
+		const_iterator(BarkingBitmap const *owner, size_t bucket) : owner(owner), bucket(bucket) {}
+
+		// settle on the first value >= low in bucket, or on the first value of a later one
+		void nextBucket(uint32_t low)
+		{
+			for (; bucket < owner->bb_keys.size(); bucket++, low = 0)
+			{
+				cursor = 0;
+				value = 0;
+				if (owner->bb_data[bucket]->seek(cursor, value, low))
+				{
+					return;
+				}
+			}
+			cursor = 0;
+			value = 0;
+		}
+
+		BarkingBitmap const *owner = nullptr;
+		size_t bucket = 0;
+		size_t cursor = 0;
+		uint32_t value = 0;
+	};
+
+	void add(uint32_t value)
+	{
+		bb_rank.clear();
+		uint16_t key = value >> 16;
+		auto itr = std::lower_bound(bb_keys.begin(), bb_keys.end(), key);
+		size_t pos = itr - bb_keys.begin();
+		if (itr == bb_keys.end() || *itr != key)
+		{
+			bb_keys.insert(itr, key);
+			bb_data.insert(bb_data.begin() + pos, bb_cow());
+		}
+		bb_data[pos].mut().add(value & 0xFFFF);
+	}
+	void remove(uint32_t value)
+	{
+		bb_rank.clear();
+		auto pos = find(value >> 16);
+		if (pos == npos)
+		{
+			return;
+		}
+		if (!bb_data[pos]->contains(value & 0xFFFF))
+		{
+			return; // don't clone a shared bucket for nothing
+		}
+		bb_data[pos].mut().remove(value & 0xFFFF);
+		if (bb_data[pos]->empty())
+		{
+			pool.recycle(std::move(bb_data[pos].mut().data));
+			eraseBucket(pos);
+		}
+	}
+	bool contains(uint32_t value) const
+	{
+		auto pos = find(value >> 16);
+		return pos != npos && bb_data[pos]->contains(value & 0xFFFF);
+	}
+	// bulk add, values are grouped by bucket and merged in one go per bucket
+	void addMany(std::span<uint32_t const> values)
+	{
+		bb_rank.clear();
+		if (std::is_sorted(values.begin(), values.end()))
+		{
+			addSorted(values);
+			return;
+		}
+		std::vector<uint32_t> scratch;
+		scratch.reserve(std::min<size_t>(values.size(), BB_BATCH_CHUNK));
+		for (size_t i = 0; i < values.size(); i += BB_BATCH_CHUNK)
+		{
+			auto chunk = values.subspan(i, std::min<size_t>(BB_BATCH_CHUNK, values.size() - i));
+			scratch.assign(chunk.begin(), chunk.end());
+			std::sort(scratch.begin(), scratch.end());
+			addSorted(scratch);
+		}
+	}
+	// adds every value in [lo, hi]
+	void addRange(uint32_t lo, uint32_t hi)
+	{
+		if (lo > hi)
+		{
+			return;
+		}
+		bb_rank.clear();
+		std::vector<uint16_t> fresh_keys;
+		std::vector<bb_cow> fresh_data;
+		size_t pos = 0;
+		for (uint32_t key = lo >> 16; key <= hi >> 16; key++)
+		{
+			uint16_t first = key == lo >> 16 ? lo & 0xFFFF : 0;
+			uint16_t last = key == hi >> 16 ? hi & 0xFFFF : 0xFFFF;
+			BBData range(convertForCardinality(bb_run{{first, last}}, Policy::array_threshold));
+			pos = std::lower_bound(bb_keys.begin() + pos, bb_keys.end(), key) - bb_keys.begin();
+			if (pos < bb_keys.size() && bb_keys[pos] == key)
+			{
+				bb_data[pos].mut().unite(range);
+			}
+			else
+			{
+				fresh_keys.push_back(key);
+				fresh_data.emplace_back(std::move(range));
+			}
+		}
+		splice(fresh_keys, fresh_data);
+	}
+	// out[i] = contains(values[i]), out has to be at least as long as values
+	void containsMany(std::span<uint32_t const> values, std::span<bool> out) const
+	{
+		if (out.size() < values.size())
+		{
+			throw std::length_error("BarkingBitmap: containsMany output too small");
+		}
+		for (size_t i = 0; i < values.size();)
+		{
+			// consecutive values in the same bucket share one lookup
+			uint16_t key = values[i] >> 16;
+			size_t j = i + 1;
+			while (j < values.size() && values[j] >> 16 == key)
+			{
+				j++;
+			}
+			auto pos = find(key);
+			if (pos == npos)
+			{
+				std::fill(out.begin() + i, out.begin() + j, false);
+			}
+			else
+			{
+				bb_data[pos]->containsMany(values.data() + i, j - i, out.data() + i);
+			}
+			i = j;
+		}
+	}
+	bool empty() const
+	{
+		return bb_keys.empty();
+	}
+	void clear()
+	{
+		for (auto &i : bb_data)
+		{
+			if (i.unique())
+			{
+				pool.recycle(std::move(i.mut().data));
+			}
+		}
+		bb_keys.clear();
+		bb_data.clear();
+		bb_rank.clear();
+	}
+	// total number of values, O(#buckets)
+	uint64_t cardinality() const
+	{
+		uint64_t result = 0;
+		for (auto const &i : bb_data)
+		{
+			result += i->sz;
+		}
+		return result;
+	}
+	std::optional<uint32_t> minimum() const
+	{
+		if (bb_keys.empty())
+		{
+			return std::nullopt;
+		}
+		return static_cast<uint32_t>(bb_keys.front()) << 16 | bb_data.front()->minimum();
+	}
+	std::optional<uint32_t> maximum() const
+	{
+		if (bb_keys.empty())
+		{
+			return std::nullopt;
+		}
+		return static_cast<uint32_t>(bb_keys.back()) << 16 | bb_data.back()->maximum();
+	}
+	// number of values <= value
+	uint64_t rank(uint32_t value) const
+	{
+		auto const &prefix = rankIndex();
+		uint16_t key = value >> 16;
+		size_t pos = std::lower_bound(bb_keys.begin(), bb_keys.end(), key) - bb_keys.begin();
+		uint64_t result = prefix[pos];
+		if (pos < bb_keys.size() && bb_keys[pos] == key)
+		{
+			result += bb_data[pos]->rank(value & 0xFFFF);
+		}
+		return result;
+	}
+	// the i-th smallest value (from 0), nullopt if there are not that many
+	std::optional<uint32_t> select(uint64_t i) const
+	{
+		auto const &prefix = rankIndex();
+		if (i >= prefix.back())
+		{
+			return std::nullopt;
+		}
+		// last bucket whose prefix is <= i
+		size_t pos = std::upper_bound(prefix.begin(), prefix.end(), i) - prefix.begin() - 1;
+		return static_cast<uint32_t>(bb_keys[pos]) << 16 | bb_data[pos]->select(i - prefix[pos]);
+	}
+	const_iterator begin() const
+	{
+		const_iterator result(this, 0);
+		result.nextBucket(0);
+		return result;
+	}
+	const_iterator end() const
+	{
+		return const_iterator(this, bb_keys.size());
+	}
+	// iterator at the first value >= value
+	const_iterator seek(uint32_t value) const
+	{
+		uint16_t key = value >> 16;
+		size_t pos = std::lower_bound(bb_keys.begin(), bb_keys.end(), key) - bb_keys.begin();
+		const_iterator result(this, pos);
+		result.nextBucket(pos < bb_keys.size() && bb_keys[pos] == key ? value & 0xFFFF : 0);
+		return result;
+	}
+	// calls f on every value in ascending order, if f returns bool then false stops the walk
+	template <class F>
+	void forEach(F &&f) const
+	{
+		auto step = [&f](uint32_t value) -> bool
+		{
+			if constexpr (std::is_same_v<std::invoke_result_t<F &, uint32_t>, bool>)
+			{
+				return f(value);
+			}
+			else
+			{
+				f(value);
+				return true;
+			}
+		};
+		for (size_t i = 0; i < bb_keys.size(); i++)
+		{
+			if (!bb_data[i]->forEach(static_cast<uint32_t>(bb_keys[i]) << 16, step))
+			{
+				return;
+			}
+		}
+	}
+	// writes up to limit values to out in ascending order, skipping the first offset of them
+	// returns how many were written
+	size_t toUint32Array(uint32_t *out, size_t offset, size_t limit) const
+	{
+		size_t written = 0;
+		for (size_t i = 0; i < bb_keys.size() && written < limit; i++)
+		{
+			// whole buckets are skipped by cardinality without decoding them
+			if (offset >= bb_data[i]->sz)
+			{
+				offset -= bb_data[i]->sz;
+				continue;
+			}
+			written += bb_data[i]->decode(static_cast<uint32_t>(bb_keys[i]) << 16, offset, limit - written, out + written);
+			offset = 0;
+		}
+		return written;
+	}
+	void intersect(BarkingBitmap const &other)
+	{
+		bb_rank.clear();
+		// only keys present on both sides survive, compact them to the front as we go
+		size_t out = 0;
+		size_t j = 0;
+		for (size_t i = 0; i < bb_keys.size(); i++)
+		{
+			while (j < other.bb_keys.size() && other.bb_keys[j] < bb_keys[i])
+			{
+				j++;
+			}
+			if (j == other.bb_keys.size())
+			{
+				break;
+			}
+			if (other.bb_keys[j] != bb_keys[i])
+			{
+				continue;
+			}
+			if (bb_data[i].get() != other.bb_data[j].get())
+			{
+				bb_data[i].mut().intersect(*other.bb_data[j], pool);
+			}
+			if (!bb_data[i]->empty())
+			{
+				// no self-move, a moved-onto-itself vector ends up empty
+				if (out != i)
+				{
+					bb_keys[out] = bb_keys[i];
+					bb_data[out] = std::move(bb_data[i]);
+				}
+				out++;
+			}
+		}
+		// whatever was dropped feeds the pool for the next operation
+		for (size_t i = out; i < bb_data.size(); i++)
+		{
+			if (bb_data[i].unique())
+			{
+				pool.recycle(std::move(bb_data[i].mut().data));
+			}
+		}
+		bb_keys.resize(out);
+		bb_data.resize(out);
+	}
+	void unite(BarkingBitmap const &other)
+	{
+		bb_rank.clear();
+		// shared keys are united in place, buckets new to this bitmap are shared with other & spliced in
+		std::vector<uint16_t> fresh_keys;
+		std::vector<bb_cow> fresh_data;
+		size_t i = 0;
+		for (size_t j = 0; j < other.bb_keys.size(); j++)
+		{
+			while (i < bb_keys.size() && bb_keys[i] < other.bb_keys[j])
+			{
+				i++;
+			}
+			if (i < bb_keys.size() && bb_keys[i] == other.bb_keys[j])
+			{
+				if (bb_data[i].get() != other.bb_data[j].get())
+				{
+					bb_data[i].mut().unite(*other.bb_data[j], pool);
+				}
+			}
+			else
+			{
+				fresh_keys.push_back(other.bb_keys[j]);
+				fresh_data.push_back(other.bb_data[j]);
+			}
+		}
+		splice(fresh_keys, fresh_data);
+	}
+	// removes every value that is in other (andnot)
+	void difference(BarkingBitmap const &other)
+	{
+		bb_rank.clear();
+		size_t j = 0;
+		for (size_t i = 0; i < bb_keys.size(); i++)
+		{
+			while (j < other.bb_keys.size() && other.bb_keys[j] < bb_keys[i])
+			{
+				j++;
+			}
+			if (j == other.bb_keys.size())
+			{
+				break;
+			}
+			if (other.bb_keys[j] != bb_keys[i])
+			{
+				continue;
+			}
+			if (bb_data[i].get() == other.bb_data[j].get())
+			{
+				bb_data[i] = bb_cow(); // x - x, nothing left
+			}
+			else
+			{
+				bb_data[i].mut().difference(*other.bb_data[j], pool);
+			}
+		}
+		dropEmpty();
+	}
+	// keeps the values that are in exactly one of the two bitmaps
+	void symmetricDifference(BarkingBitmap const &other)
+	{
+		bb_rank.clear();
+		std::vector<uint16_t> fresh_keys;
+		std::vector<bb_cow> fresh_data;
+		size_t i = 0;
+		for (size_t j = 0; j < other.bb_keys.size(); j++)
+		{
+			while (i < bb_keys.size() && bb_keys[i] < other.bb_keys[j])
+			{
+				i++;
+			}
+			if (i == bb_keys.size() || bb_keys[i] != other.bb_keys[j])
+			{
+				fresh_keys.push_back(other.bb_keys[j]);
+				fresh_data.push_back(other.bb_data[j]);
+			}
+			else if (bb_data[i].get() == other.bb_data[j].get())
+			{
+				bb_data[i] = bb_cow();
+			}
+			else
+			{
+				bb_data[i].mut().symmetricDifference(*other.bb_data[j], pool);
+			}
+		}
+		dropEmpty();
+		splice(fresh_keys, fresh_data);
+	}
+	// toggles every value in [lo, hi]
+	void flip(uint32_t lo, uint32_t hi)
+	{
+		if (lo > hi)
+		{
+			return;
+		}
+		bb_rank.clear();
+		std::vector<uint16_t> fresh_keys;
+		std::vector<bb_cow> fresh_data;
+		size_t pos = 0;
+		for (uint32_t key = lo >> 16; key <= hi >> 16; key++)
+		{
+			uint16_t first = key == lo >> 16 ? lo & 0xFFFF : 0;
+			uint16_t last = key == hi >> 16 ? hi & 0xFFFF : 0xFFFF;
+			pos = std::lower_bound(bb_keys.begin() + pos, bb_keys.end(), key) - bb_keys.begin();
+			if (pos < bb_keys.size() && bb_keys[pos] == key)
+			{
+				bb_data[pos].mut().flip(first, last, pool);
+			}
+			else
+			{
+				// nothing to toggle off, the whole range is new
+				fresh_keys.push_back(key);
+				fresh_data.emplace_back(BBData(convertForCardinality(bb_run{{first, last}}, Policy::array_threshold)));
+			}
+		}
+		dropEmpty();
+		splice(fresh_keys, fresh_data);
+	}
+	// count-only versions of the set operations, no result containers are built
+	uint64_t andCardinality(BarkingBitmap const &other) const
+	{
+		uint64_t result = 0;
+		for (size_t i = 0, j = 0; i < bb_keys.size() && j < other.bb_keys.size();)
+		{
+			if (bb_keys[i] < other.bb_keys[j])
+			{
+				i++;
+			}
+			else if (other.bb_keys[j] < bb_keys[i])
+			{
+				j++;
+			}
+			else
+			{
+				result += bb_data[i].get() == other.bb_data[j].get() ? bb_data[i]->sz : bb_data[i]->andCardinality(*other.bb_data[j]);
+				i++;
+				j++;
+			}
+		}
+		return result;
+	}
+	uint64_t orCardinality(BarkingBitmap const &other) const
+	{
+		return cardinality() + other.cardinality() - andCardinality(other);
+	}
+	// |this & other| / |this | other|, 0 when both are empty
+	double jaccard(BarkingBitmap const &other) const
+	{
+		uint64_t both = andCardinality(other);
+		uint64_t either = cardinality() + other.cardinality() - both;
+		return either == 0 ? 0.0 : static_cast<double>(both) / either;
+	}
+	// size of the portable roaring serialization
+	size_t serializedSize() const
+	{
+		size_t result = bb_portable_header_bytes(bb_keys.size(), hasRuns());
+		for (auto const &i : bb_data)
+		{
+			result += bb_portable_bytes(*i);
+		}
+		return result;
+	}
+	// writes the portable roaring serialization into out, returns the number of bytes used
+	size_t serialize(std::span<std::byte> out) const
+	{
+		size_t total = serializedSize();
+		if (out.size() < total)
+		{
+			throw std::length_error("BarkingBitmap: serialization buffer too small");
+		}
+		bool runs = hasRuns();
+		size_t n = bb_keys.size();
+		std::byte *p = out.data();
+		size_t pos;
+		if (runs)
+		{
+			bb_store<uint32_t>(p, BB_SERIAL_COOKIE | static_cast<uint32_t>(n - 1) << 16);
+			pos = 4 + (n + 7) / 8;
+			std::memset(p + 4, 0, (n + 7) / 8);
+			for (size_t i = 0; i < n; i++)
+			{
+				if (std::holds_alternative<bb_run>(bb_data[i]->data))
+				{
+					p[4 + i / 8] |= std::byte(1 << (i % 8));
+				}
+			}
+		}
+		else
+		{
+			bb_store<uint32_t>(p, BB_SERIAL_COOKIE_NO_RUN);
+			bb_store<uint32_t>(p + 4, n);
+			pos = 8;
+		}
+		std::byte *descriptive = p + pos;
+		pos += 4 * n;
+		std::byte *offsets = nullptr;
+		if (!runs || n >= BB_NO_OFFSET_THRESHOLD)
+		{
+			offsets = p + pos;
+			pos += 4 * n;
+		}
+		for (size_t i = 0; i < n; i++)
+		{
+			bb_store<uint16_t>(descriptive + 4 * i, bb_keys[i]);
+			bb_store<uint16_t>(descriptive + 4 * i + 2, bb_data[i]->sz - 1);
+			if (offsets)
+			{
+				bb_store<uint32_t>(offsets + 4 * i, pos);
+			}
+			pos += bb_write_portable(*bb_data[i], p + pos);
+		}
+		return pos;
+	}
+	std::vector<std::byte> serialize() const
+	{
+		std::vector<std::byte> result(serializedSize());
+		serialize(result);
+		return result;
+	}
+	// copies a portable roaring buffer into heap containers, throws std::runtime_error if it is malformed
+	static BarkingBitmap deserialize(std::span<std::byte const> buf)
 	{
-		if (bset.test(i))
+		bb_portable_view view(buf);
+		BarkingBitmap result;
+		result.bb_keys.reserve(view.size());
+		result.bb_data.reserve(view.size());
+		for (size_t i = 0; i < view.size(); i++)
 		{
-			result.push_back(i);
+			result.bb_keys.push_back(view.key(i));
+			result.bb_data.emplace_back(BBData(bb_read_portable(view, i, Policy::array_threshold)));
 		}
+		return result;
 	}
-	return result;
-}
-
-static auto convert_array_to_bset(bb_array const &array) -> bb_bset
-{
-	bb_bset result;
-	for (auto const &i : array)
+	// union of many bitmaps in one pass per key: a heap walks the key lists, buckets that share a key
+	// are or-ed into one lazy bitset and only counted & converted once at the end
+	static BarkingBitmap fastUnion(std::span<BarkingBitmap const *const> bitmaps)
 	{
-		result.set(i);
+		BarkingBitmap result;
+		// (key, bitmap, bucket) of the next unvisited bucket of every bitmap
+		using cursor = std::tuple<uint16_t, size_t, size_t>;
+		std::priority_queue<cursor, std::vector<cursor>, std::greater<cursor>> heap;
+		for (size_t b = 0; b < bitmaps.size(); b++)
+		{
+			if (!bitmaps[b]->bb_keys.empty())
+			{
+				heap.emplace(bitmaps[b]->bb_keys[0], b, 0);
+			}
+		}
+		std::vector<bb_cow const *> group;
+		while (!heap.empty())
+		{
+			uint16_t key = std::get<0>(heap.top());
+			group.clear();
+			while (!heap.empty() && std::get<0>(heap.top()) == key)
+			{
+				auto [k, b, pos] = heap.top();
+				heap.pop();
+				group.push_back(&bitmaps[b]->bb_data[pos]);
+				if (pos + 1 < bitmaps[b]->bb_keys.size())
+				{
+					heap.emplace(bitmaps[b]->bb_keys[pos + 1], b, pos + 1);
+				}
+			}
+			result.bb_keys.push_back(key);
+			result.bb_data.push_back(uniteGroup(group));
+		}
+		return result;
 	}
-	return result;
-}
-
-// is this the best semantic for this?
-static auto convertForCardinality(bb_variant const &data) -> bb_variant
-{
-	return std::visit([](auto &&arg) -> bb_variant
-					  {
-		using T = std::decay_t<decltype(arg)>;
-		if constexpr (std::is_same_v<T, bb_array>)
+	// intersection of many bitmaps, smallest bitmap first and smallest bucket first per key,
+	// stopping as soon as a key (or the whole result) is known to be empty
+	static BarkingBitmap fastIntersect(std::span<BarkingBitmap const *const> bitmaps)
+	{
+		BarkingBitmap result;
+		if (bitmaps.empty())
+		{
+			return result;
+		}
+		std::vector<BarkingBitmap const *> order(bitmaps.begin(), bitmaps.end());
+		for (auto b : order)
 		{
-			if(arg.size() >= BB_ARRAY_THRESHOLD)
+			if (b->empty())
 			{
-				return convert_array_to_bset(arg);
+				return result;
 			}
-			return arg;
 		}
-		else if constexpr (std::is_same_v<T, bb_bset>)
+		std::sort(order.begin(), order.end(), [](BarkingBitmap const *a, BarkingBitmap const *b)
+				  { return a->bb_keys.size() < b->bb_keys.size(); });
+		// keys only increase, so each bitmap keeps a cursor instead of searching from scratch
+		std::vector<size_t> cursors(order.size(), 0);
+		std::vector<BBData const *> group;
+		BarkingBitmap const &smallest = *order[0];
+		for (size_t i = 0; i < smallest.bb_keys.size(); i++)
 		{
-			if(arg.count() < BB_ARRAY_THRESHOLD)
+			uint16_t key = smallest.bb_keys[i];
+			group.assign(1, smallest.bb_data[i].get());
+			bool everywhere = true;
+			for (size_t b = 1; b < order.size() && everywhere; b++)
 			{
-				return convert_bset_to_array(arg);
+				auto const &keys = order[b]->bb_keys;
+				cursors[b] = std::lower_bound(keys.begin() + cursors[b], keys.end(), key) - keys.begin();
+				if (cursors[b] == keys.size())
+				{
+					// this bitmap has nothing left, neither can the result
+					return result;
+				}
+				everywhere = keys[cursors[b]] == key;
+				group.push_back(order[b]->bb_data[cursors[b]].get());
 			}
-			return arg;
-		} },
-					  data);
-}
-
-class BBData
-{
-public:
-	BBData() : sz(0), data(bb_array()){};
-	bb_variant data;
-	size_t sz;
-	void add(const uint16_t value)
+			if (!everywhere)
+			{
+				continue;
+			}
+			std::sort(group.begin(), group.end(), [](BBData const *a, BBData const *b)
+					  { return a->sz < b->sz; });
+			BBData bucket = *group[0];
+			for (size_t g = 1; g < group.size() && !bucket.empty(); g++)
+			{
+				bucket.intersect(*group[g]);
+			}
+			if (!bucket.empty())
+			{
+				result.bb_keys.push_back(key);
+				result.bb_data.emplace_back(std::move(bucket));
+			}
+		}
+		return result;
+	}
+	// same as intersect, the buckets present on both sides are intersected on up to threads threads
+	void parallelIntersect(BarkingBitmap const &other, size_t threads = std::thread::hardware_concurrency())
 	{
-		std::visit([value, this](auto &&arg)
-				   {
-			using T = std::decay_t<decltype(arg)>;
-			if constexpr (std::is_same_v<T, bb_array>)
+		// a bitmap intersected with itself is unchanged, and the compaction below would move buckets other still reads
+		if (&other == this)
+		{
+			return;
+		}
+		bb_rank.clear();
+		std::vector<std::pair<size_t, size_t>> pairs;
+		for (size_t i = 0, j = 0; i < bb_keys.size() && j < other.bb_keys.size();)
+		{
+			if (bb_keys[i] < other.bb_keys[j])
 			{
-				arg.push_back(value);
-				
+				i++;
 			}
-			else if constexpr (std::is_same_v<T, bb_bset>)
+			else if (other.bb_keys[j] < bb_keys[i])
 			{
-				arg.set(value);
-			} },
-				   data);
+				j++;
+			}
+			else
+			{
+				pairs.emplace_back(i++, j++);
+			}
+		}
+		bb_parallel_for(pairs.size(), threads, [&](size_t p)
+						{
+			auto [i, j] = pairs[p];
+			if (bb_data[i].get() != other.bb_data[j].get())
+			{
+				bb_data[i].mut().intersect(*other.bb_data[j]);
+			} });
+		size_t out = 0;
+		for (auto [i, j] : pairs)
+		{
+			if (!bb_data[i]->empty())
+			{
+				if (out != i)
+				{
+					bb_keys[out] = bb_keys[i];
+					bb_data[out] = std::move(bb_data[i]);
+				}
+				out++;
+			}
+		}
+		bb_keys.resize(out);
+		bb_data.resize(out);
 	}
-	void clear()
+	// same as unite, the key lists are merged up front and the buckets filled in on up to threads threads
+	void parallelUnite(BarkingBitmap const &other, size_t threads = std::thread::hardware_concurrency())
 	{
-		data = bb_array();
+		// a bitmap united with itself is unchanged, and the buckets are moved out of this while other is read
+		if (&other == this)
+		{
+			return;
+		}
+		bb_rank.clear();
+		static constexpr size_t none = static_cast<size_t>(-1);
+		// for every output bucket: where it comes from on each side
+		std::vector<std::pair<size_t, size_t>> plan;
+		std::vector<uint16_t> keys;
+		plan.reserve(bb_keys.size() + other.bb_keys.size());
+		keys.reserve(bb_keys.size() + other.bb_keys.size());
+		for (size_t i = 0, j = 0; i < bb_keys.size() || j < other.bb_keys.size();)
+		{
+			if (j == other.bb_keys.size() || (i < bb_keys.size() && bb_keys[i] < other.bb_keys[j]))
+			{
+				keys.push_back(bb_keys[i]);
+				plan.emplace_back(i++, none);
+			}
+			else if (i == bb_keys.size() || other.bb_keys[j] < bb_keys[i])
+			{
+				keys.push_back(other.bb_keys[j]);
+				plan.emplace_back(none, j++);
+			}
+			else
+			{
+				keys.push_back(bb_keys[i]);
+				plan.emplace_back(i++, j++);
+			}
+		}
+		std::vector<bb_cow> data(plan.size());
+		bb_parallel_for(plan.size(), threads, [&](size_t p)
+						{
+			auto [i, j] = plan[p];
+			if (i == none)
+			{
+				data[p] = other.bb_data[j];
+				return;
+			}
+			data[p] = std::move(bb_data[i]);
+			if (j != none && data[p].get() != other.bb_data[j].get())
+			{
+				data[p].mut().unite(*other.bb_data[j]);
+			} });
+		bb_keys.swap(keys);
+		bb_data.swap(data);
 	}
-	void remove(uint16_t value)
+	// builds the rank/select index now, so that later rank & select calls are pure reads too
+	void buildRankIndex() const
 	{
-		std::visit([this, value](auto &&arg)
-				   {
-			using T = std::decay_t<decltype(arg)>;
-			if constexpr (std::is_same_v<T, bb_array>)
+		rankIndex();
+	}
+	// re-encode every bucket with its smallest container, returns true if any bucket became a run
+	bool runOptimize()
+	{
+		bool result = false;
+		for (auto &i : bb_data)
+		{
+			if (i.unique())
 			{
-				arg.erase(std::remove(arg.begin(), arg.end(), value), arg.end());
+				result |= i.mut().runOptimize();
+				continue;
 			}
-			else if constexpr (std::is_same_v<T, bb_bset>)
+			// a shared bucket is only replaced if it actually changes
+			BBData optimized = *i;
+			if (optimized.runOptimize())
 			{
-				arg.reset(value);
-			} },
-				   data);
+				i = bb_cow(std::move(optimized));
+				result = true;
+			}
+		}
+		return result;
 	}
-	bool contains(uint16_t value) const
+	// same as stats().bytes_reserved, but only reads the bucket headers
+	size_t sizeInBytes() const
 	{
-		return std::visit([value](auto &&arg) -> bool
-						  {
-        using T = std::decay_t<decltype(arg)>;
-        if constexpr (std::is_same_v<T, bb_array>)
-        {
-            return std::binary_search(arg.begin(), arg.end(), value);
-        }
-        else if constexpr (std::is_same_v<T, bb_bset>)
-        {
-            return arg.test(value);
-        }
-        else
-        {
-			//should *not* reach here
-            return false; // or handle other types appropriately
-        } },
-						  data);
-		;
+		size_t result = sizeof(*this) + indexBytes(true) + pool.bytes();
+		for (auto const &i : bb_data)
+		{
+			result += sizeof(BBData) + i->reservedBytes();
+		}
+		return result;
 	}
-	void intersect(const BBData &other)
+	// container mix, memory and how far the encoding is from the best one, walks every bucket
+	bb_stats stats() const
 	{
-		data = std::visit([](auto const &arg1, auto const &arg2) -> bb_variant
-						  {
-		using T1 = std::decay_t<decltype(arg1)>;
-		using T2 = std::decay_t<decltype(arg2)>;
+		bb_stats result;
+		size_t header = bb_portable_header_bytes(bb_keys.size(), hasRuns());
+		result.serialized_bytes = header;
+		size_t optimized = 0, used = 0, reserved = 0;
+		for (auto const &i : bb_data)
+		{
+			bb_container_stats &kind = std::holds_alternative<bb_array>(i->data)  ? result.arrays
+									   : std::holds_alternative<bb_bset>(i->data) ? result.bitsets
+																				  : result.runs;
+			kind.containers++;
+			kind.values += i->sz;
+			kind.bytes_used += i->usedBytes();
+			kind.bytes_reserved += i->reservedBytes();
+			used += sizeof(BBData) + i->usedBytes();
+			reserved += sizeof(BBData) + i->reservedBytes();
+			result.shared_containers += !i.unique();
+			result.serialized_bytes += bb_portable_bytes(*i);
+			optimized += i->optimizedBytes();
+		}
+		// the run flags may come or go with runOptimize(), assume they stay
+		result.optimized_bytes = optimized + bb_portable_header_bytes(bb_keys.size(), true);
+		result.index_bytes_used = indexBytes(false);
+		result.index_bytes_reserved = indexBytes(true);
+		result.pool_bytes = pool.bytes();
+		result.bytes_used = sizeof(*this) + result.index_bytes_used + used;
+		result.bytes_reserved = sizeof(*this) + result.index_bytes_reserved + reserved + result.pool_bytes;
+		size_t payload = result.serialized_bytes - header;
+		if (optimized < payload - payload / 8)
+		{
+			result.suggestion = bb_suggest_run_optimize;
+		}
+		else if (result.bytes_reserved - result.bytes_used > result.bytes_reserved / 4)
+		{
+			result.suggestion = bb_suggest_shrink_to_fit;
+		}
+		return result;
+	}
+	// drops spare capacity in the index and in unshared buckets, and empties the pool
+	void shrinkToFit()
+	{
+		for (auto &i : bb_data)
+		{
+			if (i.unique())
+			{
+				i.mut().shrinkToFit();
+			}
+		}
+		bb_keys.shrink_to_fit();
+		bb_data.shrink_to_fit();
+		bb_rank.clear();
+		bb_rank.shrink_to_fit();
+		pool.release();
+	}
 
-		if constexpr (std::is_same_v<T1, bb_array> && std::is_same_v<T2, bb_array>)
+private:
+	static constexpr size_t npos = static_cast<size_t>(-1);
+
+	// index of the bucket holding key, or npos
+	size_t find(uint16_t key) const
+	{
+		auto itr = std::lower_bound(bb_keys.begin(), bb_keys.end(), key);
+		if (itr == bb_keys.end() || *itr != key)
 		{
-			bb_array result;
-			std::set_intersection(arg1.begin(), arg1.end(), arg2.begin(), arg2.end(), std::back_inserter(result));
-			return result; // skip redundant check
+			return npos;
 		}
-		else if constexpr (std::is_same_v<T1, bb_array> && std::is_same_v<T2, bb_bset>)
+		return itr - bb_keys.begin();
+	}
+	void addSorted(std::span<uint32_t const> values)
+	{
+		std::vector<uint16_t> lows;
+		std::vector<uint16_t> fresh_keys;
+		std::vector<bb_cow> fresh_data;
+		size_t pos = 0;
+		for (size_t i = 0; i < values.size();)
 		{
-			bb_array result;
-			for (auto const &i : arg1)
+			uint16_t key = values[i] >> 16;
+			lows.clear();
+			for (; i < values.size() && values[i] >> 16 == key; i++)
 			{
-				if (arg2.test(i))
+				uint16_t low = values[i] & 0xFFFF;
+				if (lows.empty() || lows.back() != low)
 				{
-					result.push_back(i);
+					lows.push_back(low);
 				}
 			}
-			return result; // skip redundant check
+			// keys only increase, so the search can start where the last one ended
+			pos = std::lower_bound(bb_keys.begin() + pos, bb_keys.end(), key) - bb_keys.begin();
+			if (pos < bb_keys.size() && bb_keys[pos] == key)
+			{
+				bb_data[pos].mut().addMany(lows.data(), lows.size());
+			}
+			else
+			{
+				fresh_keys.push_back(key);
+				fresh_data.emplace_back().mut().addMany(lows.data(), lows.size());
+			}
 		}
-		else if constexpr (std::is_same_v<T1, bb_bset> && std::is_same_v<T2, bb_array>)
+		splice(fresh_keys, fresh_data);
+	}
+	// merges sorted buckets whose keys are not present yet, back to front so nothing is shifted twice
+	void splice(std::vector<uint16_t> &keys, std::vector<bb_cow> &data)
+	{
+		if (keys.empty())
 		{
-			// handle intersection for bb_bset vs bb_array
-			bb_array result;
-			result.reserve(BB_ARRAY_THRESHOLD);
-			for (auto const &i : arg2)
+			return;
+		}
+		ptrdiff_t i = bb_keys.size() - 1;
+		ptrdiff_t f = keys.size() - 1;
+		ptrdiff_t w = bb_keys.size() + keys.size() - 1;
+		bb_keys.resize(bb_keys.size() + keys.size());
+		bb_data.resize(bb_data.size() + data.size());
+		for (; f >= 0; w--)
+		{
+			if (i >= 0 && bb_keys[i] > keys[f])
 			{
-				if (arg1.test(i))
+				bb_keys[w] = bb_keys[i];
+				bb_data[w] = std::move(bb_data[i--]);
+			}
+			else
+			{
+				bb_keys[w] = keys[f];
+				bb_data[w] = std::move(data[f--]);
+			}
+		}
+	}
+	// compacts away buckets a set operation emptied or reset to an empty handle
+	void dropEmpty()
+	{
+		size_t out = 0;
+		for (size_t i = 0; i < bb_keys.size(); i++)
+		{
+			if (!bb_data[i].get() || bb_data[i]->empty())
+			{
+				if (bb_data[i].get() && bb_data[i].unique())
 				{
-					result.push_back(i);
+					pool.recycle(std::move(bb_data[i].mut().data));
 				}
+				continue;
 			}
-			return result; // skip redundant check
+			if (out != i)
+			{
+				bb_keys[out] = bb_keys[i];
+				bb_data[out] = std::move(bb_data[i]);
+			}
+			out++;
 		}
-		else if constexpr (std::is_same_v<T1, bb_bset> && std::is_same_v<T2, bb_bset>)
-		{
-			// handle intersection for bb_bset vs bb_bset
-			// optimistically assume that overall size will be more than BB_ARRAY_THRESHOLD
-			bb_bset result;
-			result = arg1 & arg2;
-			return convertForCardinality(result);
-		} },
-						  data, other.data);
+		bb_keys.resize(out);
+		bb_data.resize(out);
 	}
-
-	void unite(BBData const &other)
+	void eraseBucket(size_t pos)
 	{
-		data = std::visit([](auto const &arg1, auto const &arg2) -> bb_variant
-						  {
-		using T1 = std::decay_t<decltype(arg1)>;
-		using T2 = std::decay_t<decltype(arg2)>;
+		bb_keys.erase(bb_keys.begin() + pos);
+		bb_data.erase(bb_data.begin() + pos);
+	}
 
-		if constexpr (std::is_same_v<T1, bb_array> && std::is_same_v<T2, bb_array>)
+	static bb_cow uniteGroup(std::vector<bb_cow const *> const &group)
+	{
+		if (group.size() == 1)
 		{
-			//optimistically assume that overall size will be more than BB_ARRAY_THRESHOLD, therefore bitset
-			bb_bset result;
-			for(auto const &i : arg1) result.set(i);
-			for(auto const &i : arg2) result.set(i);
-			return convertForCardinality(result);
+			// a key only one bitmap has, the result can share its bucket
+			return *group[0];
 		}
-		else if constexpr (std::is_same_v<T1, bb_array> && std::is_same_v<T2, bb_bset>)
+		size_t total = 0;
+		bool dense = false;
+		for (auto d : group)
 		{
-			//lower-bounded by bset, which is guaranteed to be above threshold
-			bb_bset result = arg2;
-			for(auto const &i : arg1) result.set(i);
-			return result; // skip redundant check
+			total += (*d)->sz;
+			dense |= std::holds_alternative<bb_bset>((*d)->data);
 		}
-		else if constexpr (std::is_same_v<T1, bb_bset> && std::is_same_v<T2, bb_array>)
+		if (!dense && total < Policy::array_threshold)
 		{
-			bb_bset result = arg1;
-			for(auto const &i : arg2) result.set(i);
-			return result; //skip redundant check
+			// small enough that plain merges stay cheap
+			BBData result = **group[0];
+			for (size_t g = 1; g < group.size(); g++)
+			{
+				result.unite(**group[g]);
+			}
+			return bb_cow(std::move(result));
 		}
-		else if constexpr (std::is_same_v<T1, bb_bset> && std::is_same_v<T2, bb_bset>)
+		bb_bset acc;
+		for (auto d : group)
 		{
-			bb_bset result = arg1 | arg2;
-			return result; //skip redundant check
-		} },
-						  data, other.data);
+			bb_or_into(acc, (*d)->data);
+		}
+		return bb_cow(BBData(convertForCardinality(acc, Policy::array_threshold)));
+	}
+	// prefix sums of the bucket cardinalities, rebuilt on the first rank/select after a change
+	std::vector<uint64_t> const &rankIndex() const
+	{
+		if (bb_rank.size() != bb_keys.size() + 1)
+		{
+			bb_rank.resize(bb_keys.size() + 1);
+			bb_rank[0] = 0;
+			for (size_t i = 0; i < bb_data.size(); i++)
+			{
+				bb_rank[i + 1] = bb_rank[i] + bb_data[i]->sz;
+			}
+		}
+		return bb_rank;
+	}
+	size_t indexBytes(bool reserved) const
+	{
+		if (reserved)
+		{
+			return bb_keys.capacity() * sizeof(uint16_t) + bb_data.capacity() * sizeof(bb_cow) + bb_rank.capacity() * sizeof(uint64_t);
+		}
+		return bb_keys.size() * sizeof(uint16_t) + bb_data.size() * sizeof(bb_cow) + bb_rank.size() * sizeof(uint64_t);
+	}
+	bool hasRuns() const
+	{
+		return std::any_of(bb_data.begin(), bb_data.end(), [](bb_cow const &i)
+						   { return std::holds_alternative<bb_run>(i->data); });
 	}
+
+	std::vector<uint16_t, allocator<uint16_t>> bb_keys;
+	std::vector<bb_cow, allocator<bb_cow>> bb_data;
+	// empty whenever it is stale
+	mutable std::vector<uint64_t> bb_rank;
+	// spare buffers for intersect/unite, not part of the value (copies get an empty pool)
+	bb_pool pool;
 };
 
-class BarkingBitmap
+using BarkingBitmap = BasicBarkingBitmap<>;
+
+// read-only bitmap straight over a portable buffer (e.g. an mmap'd file), nothing is copied
+// the buffer has to outlive the view
+class FrozenBarkingBitmap
 {
 public:
-	BarkingBitmap() = default;
-	~BarkingBitmap() = default;
+	explicit FrozenBarkingBitmap(std::span<std::byte const> buf) : view(buf){};
 
-	void add(uint32_t value)
+	bool contains(uint32_t value) const
+	{
+		size_t lo = 0, hi = view.size();
+		uint16_t key = value >> 16;
+		while (lo < hi)
+		{
+			size_t mid = (lo + hi) / 2;
+			if (view.key(mid) < key)
+			{
+				lo = mid + 1;
+			}
+			else
+			{
+				hi = mid;
+			}
+		}
+		if (lo == view.size() || view.key(lo) != key)
+		{
+			return false;
+		}
+		return containerContains(lo, value & 0xFFFF);
+	}
+	// sum of the header cardinalities, no container is touched
+	size_t cardinality() const
 	{
-		bb_data[value >> 16].add(value & 0xFFFF);
+		size_t result = 0;
+		for (size_t i = 0; i < view.size(); i++)
+		{
+			result += view.cardinality(i);
+		}
+		return result;
 	}
-	void remove(uint32_t value)
+	bool empty() const
 	{
-		bb_data[value >> 16].remove(value & 0xFFFF);
+		return view.size() == 0;
 	}
-	bool contains(uint32_t value) const
+	// number of bytes of the buffer the bitmap occupies
+	size_t serializedSize() const
 	{
-		return bb_data[value >> 16].contains(value & 0xFFFF);
+		return view.bytes().size();
 	}
-	void clear()
+	// heap copy that can be modified
+	BarkingBitmap thaw() const
 	{
-		for (auto &i : bb_data)
-		{
-			i.clear();
-		}
+		return BarkingBitmap::deserialize(view.bytes());
 	}
-	void intersect(BarkingBitmap const &other)
+
+private:
+	bool containerContains(size_t i, uint16_t value) const
 	{
-		for (size_t i = 0; i < BB_BUCKET_SZ; i++)
+		std::byte const *src = view.container(i);
+		if (view.isRun(i))
 		{
-			bb_data[i].intersect(other.bb_data[i]);
+			// last run starting at or before value
+			size_t lo = 0, hi = bb_load<uint16_t>(src);
+			while (lo < hi)
+			{
+				size_t mid = (lo + hi) / 2;
+				if (bb_load<uint16_t>(src + 2 + 4 * mid) <= value)
+				{
+					lo = mid + 1;
+				}
+				else
+				{
+					hi = mid;
+				}
+			}
+			if (lo == 0)
+			{
+				return false;
+			}
+			uint16_t start = bb_load<uint16_t>(src + 2 + 4 * (lo - 1));
+			return value - start <= bb_load<uint16_t>(src + 4 + 4 * (lo - 1));
 		}
-	}
-	void unite(BarkingBitmap const &other)
-	{
-		for (size_t i = 0; i < BB_BUCKET_SZ; i++)
+		if (view.cardinality(i) <= BB_PORTABLE_ARRAY_MAX)
 		{
-			bb_data[i].unite(other.bb_data[i]);
+			size_t lo = 0, hi = view.cardinality(i);
+			while (lo < hi)
+			{
+				size_t mid = (lo + hi) / 2;
+				if (bb_load<uint16_t>(src + 2 * mid) < value)
+				{
+					lo = mid + 1;
+				}
+				else
+				{
+					hi = mid;
+				}
+			}
+			return lo < view.cardinality(i) && bb_load<uint16_t>(src + 2 * lo) == value;
 		}
+		return (bb_load<uint64_t>(src + 8 * (value / 64)) >> (value % 64)) & 1;
 	}
 
-private:
-	std::array<BBData, BB_BUCKET_SZ> bb_data;
+	bb_portable_view view;
 };
 
 #endif // BARKING_BITMAP_HPP
@@ -0,0 +1,445 @@
+//64-bit barking_bitmap: the high 32 bits pick a BarkingBitmap, the low 32 bits go into it
+//same idea as the buckets one level down, only occupied high keys cost anything
+#ifndef BARKING_BITMAP64_HPP
+#define BARKING_BITMAP64_HPP
+
+#include "barking_bitmap.hpp"
+
+class BarkingBitmap64
+{
+public:
+	BarkingBitmap64() = default;
+	~BarkingBitmap64() = default;
+
+	// forward iterator over the values in ascending order, invalidated by any mutation
+	class const_iterator
+	{
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = uint64_t;
+		using difference_type = std::ptrdiff_t;
+		using pointer = uint64_t const *;
+		using reference = uint64_t;
+
+		const_iterator() = default;
+
+		uint64_t operator*() const
+		{
+			return static_cast<uint64_t>(owner->bb_keys[map]) << 32 | *inner;
+		}
+		const_iterator &operator++()
+		{
+			if (++inner == owner->bb_maps[map].end())
+			{
+				map++;
+				settle();
+			}
+			return *this;
+		}
+		const_iterator operator++(int)
+		{
+			const_iterator result = *this;
+			++*this;
+			return result;
+		}
+		bool operator==(const_iterator const &other) const
+		{
+			return map == other.map && (map == owner->bb_keys.size() || inner == other.inner);
+		}
+		// skip ahead to the first value >= target, never moves backwards
+		void advanceIfNeeded(uint64_t target)
+		{
+			if (map == owner->bb_keys.size() || target <= **this)
+			{
+				return;
+			}
+			uint32_t key = target >> 32;
+			if (owner->bb_keys[map] == key)
+			{
+				inner.advanceIfNeeded(static_cast<uint32_t>(target));
+				if (inner != owner->bb_maps[map].end())
+				{
+					return;
+				}
+				map++;
+			}
+			else
+			{
+				map = std::lower_bound(owner->bb_keys.begin() + map, owner->bb_keys.end(), key) - owner->bb_keys.begin();
+				if (map < owner->bb_keys.size() && owner->bb_keys[map] == key)
+				{
+					inner = owner->bb_maps[map].seek(static_cast<uint32_t>(target));
+					if (inner != owner->bb_maps[map].end())
+					{
+						return;
+					}
+					map++;
+				}
+			}
+			settle();
+		}
+
+	private:
+		friend class BarkingBitmap64;
+		const_iterator(BarkingBitmap64 const *owner, size_t map) : owner(owner), map(map) {}
+
+		// start of the bitmap at map, maps are never empty so there is nothing to skip
+		void settle()
+		{
+			inner = map < owner->bb_keys.size() ? owner->bb_maps[map].begin() : BarkingBitmap::const_iterator();
+		}
+
+		BarkingBitmap64 const *owner = nullptr;
+		size_t map = 0;
+		BarkingBitmap::const_iterator inner;
+	};
+
+	// high keys are a sorted vector, a value with a high key not seen before shifts every later map
+	// over, O(number of high keys). fine for few or increasing high keys, bulk loads of sparse random
+	// ids should go through addMany, which sorts and merges all new high keys in one pass
+	void add(uint64_t value)
+	{
+		uint32_t key = value >> 32;
+		size_t pos = std::lower_bound(bb_keys.begin(), bb_keys.end(), key) - bb_keys.begin();
+		if (pos == bb_keys.size() || bb_keys[pos] != key)
+		{
+			bb_keys.insert(bb_keys.begin() + pos, key);
+			bb_maps.emplace(bb_maps.begin() + pos);
+		}
+		bb_maps[pos].add(static_cast<uint32_t>(value));
+	}
+	void remove(uint64_t value)
+	{
+		auto pos = find(value >> 32);
+		if (pos == npos)
+		{
+			return;
+		}
+		bb_maps[pos].remove(static_cast<uint32_t>(value));
+		if (bb_maps[pos].empty())
+		{
+			bb_keys.erase(bb_keys.begin() + pos);
+			bb_maps.erase(bb_maps.begin() + pos);
+		}
+	}
+	bool contains(uint64_t value) const
+	{
+		auto pos = find(value >> 32);
+		return pos != npos && bb_maps[pos].contains(static_cast<uint32_t>(value));
+	}
+	// values can come in any order, sorted input skips the sort
+	void addMany(std::span<uint64_t const> values)
+	{
+		if (std::is_sorted(values.begin(), values.end()))
+		{
+			addSorted(values);
+			return;
+		}
+		std::vector<uint64_t> scratch;
+		scratch.reserve(std::min<size_t>(values.size(), BB_BATCH_CHUNK));
+		for (size_t i = 0; i < values.size(); i += BB_BATCH_CHUNK)
+		{
+			auto chunk = values.subspan(i, std::min<size_t>(BB_BATCH_CHUNK, values.size() - i));
+			scratch.assign(chunk.begin(), chunk.end());
+			std::sort(scratch.begin(), scratch.end());
+			addSorted(scratch);
+		}
+	}
+	// adds every value in [lo, hi], the new high keys are merged in one pass like addMany
+	void addRange(uint64_t lo, uint64_t hi)
+	{
+		if (lo > hi)
+		{
+			return;
+		}
+		std::vector<uint32_t> fresh_keys;
+		std::vector<BarkingBitmap> fresh_maps;
+		size_t pos = 0;
+		for (uint64_t key = lo >> 32; key <= hi >> 32; key++)
+		{
+			uint32_t first = key == lo >> 32 ? static_cast<uint32_t>(lo) : 0;
+			uint32_t last = key == hi >> 32 ? static_cast<uint32_t>(hi) : 0xFFFFFFFF;
+			pos = std::lower_bound(bb_keys.begin() + pos, bb_keys.end(), key) - bb_keys.begin();
+			if (pos < bb_keys.size() && bb_keys[pos] == key)
+			{
+				bb_maps[pos].addRange(first, last);
+			}
+			else
+			{
+				fresh_keys.push_back(key);
+				fresh_maps.emplace_back().addRange(first, last);
+			}
+		}
+		splice(fresh_keys, fresh_maps);
+	}
+	// out[i] = contains(values[i]), out has to be at least as long as values
+	void containsMany(std::span<uint64_t const> values, std::span<bool> out) const
+	{
+		if (out.size() < values.size())
+		{
+			throw std::length_error("BarkingBitmap64: containsMany output too small");
+		}
+		std::vector<uint32_t> lows;
+		for (size_t i = 0; i < values.size();)
+		{
+			// consecutive values under the same high key share one lookup
+			uint32_t key = values[i] >> 32;
+			size_t j = i + 1;
+			while (j < values.size() && values[j] >> 32 == key)
+			{
+				j++;
+			}
+			auto pos = find(key);
+			if (pos == npos)
+			{
+				std::fill(out.begin() + i, out.begin() + j, false);
+			}
+			else
+			{
+				lows.clear();
+				for (size_t k = i; k < j; k++)
+				{
+					lows.push_back(static_cast<uint32_t>(values[k]));
+				}
+				bb_maps[pos].containsMany(lows, out.subspan(i, j - i));
+			}
+			i = j;
+		}
+	}
+	bool empty() const
+	{
+		return bb_keys.empty();
+	}
+	void clear()
+	{
+		bb_keys.clear();
+		bb_maps.clear();
+	}
+	uint64_t cardinality() const
+	{
+		uint64_t result = 0;
+		for (auto const &i : bb_maps)
+		{
+			result += i.cardinality();
+		}
+		return result;
+	}
+	std::optional<uint64_t> minimum() const
+	{
+		if (bb_keys.empty())
+		{
+			return std::nullopt;
+		}
+		return static_cast<uint64_t>(bb_keys.front()) << 32 | *bb_maps.front().minimum();
+	}
+	std::optional<uint64_t> maximum() const
+	{
+		if (bb_keys.empty())
+		{
+			return std::nullopt;
+		}
+		return static_cast<uint64_t>(bb_keys.back()) << 32 | *bb_maps.back().maximum();
+	}
+	void intersect(BarkingBitmap64 const &other)
+	{
+		size_t out = 0;
+		size_t j = 0;
+		for (size_t i = 0; i < bb_keys.size(); i++)
+		{
+			while (j < other.bb_keys.size() && other.bb_keys[j] < bb_keys[i])
+			{
+				j++;
+			}
+			if (j == other.bb_keys.size())
+			{
+				break;
+			}
+			if (other.bb_keys[j] != bb_keys[i])
+			{
+				continue;
+			}
+			bb_maps[i].intersect(other.bb_maps[j]);
+			if (!bb_maps[i].empty())
+			{
+				if (out != i)
+				{
+					bb_keys[out] = bb_keys[i];
+					bb_maps[out] = std::move(bb_maps[i]);
+				}
+				out++;
+			}
+		}
+		bb_keys.resize(out);
+		bb_maps.resize(out);
+	}
+	void unite(BarkingBitmap64 const &other)
+	{
+		std::vector<uint32_t> fresh_keys;
+		std::vector<BarkingBitmap> fresh_maps;
+		size_t i = 0;
+		for (size_t j = 0; j < other.bb_keys.size(); j++)
+		{
+			while (i < bb_keys.size() && bb_keys[i] < other.bb_keys[j])
+			{
+				i++;
+			}
+			if (i < bb_keys.size() && bb_keys[i] == other.bb_keys[j])
+			{
+				bb_maps[i].unite(other.bb_maps[j]);
+			}
+			else
+			{
+				fresh_keys.push_back(other.bb_keys[j]);
+				fresh_maps.push_back(other.bb_maps[j]);
+			}
+		}
+		splice(fresh_keys, fresh_maps);
+	}
+	bool runOptimize()
+	{
+		bool changed = false;
+		for (auto &i : bb_maps)
+		{
+			changed |= i.runOptimize();
+		}
+		return changed;
+	}
+
+	const_iterator begin() const
+	{
+		const_iterator result(this, 0);
+		result.settle();
+		return result;
+	}
+	const_iterator end() const
+	{
+		return const_iterator(this, bb_keys.size());
+	}
+	// iterator at the first value >= value
+	const_iterator seek(uint64_t value) const
+	{
+		const_iterator result = begin();
+		result.advanceIfNeeded(value);
+		return result;
+	}
+	// calls f on every value in ascending order, if f returns bool then false stops the walk
+	template <class F>
+	void forEach(F &&f) const
+	{
+		bool stopped = false;
+		for (size_t i = 0; i < bb_keys.size() && !stopped; i++)
+		{
+			uint64_t high = static_cast<uint64_t>(bb_keys[i]) << 32;
+			bb_maps[i].forEach([&f, &stopped, high](uint32_t value) -> bool
+							   {
+				if constexpr (std::is_same_v<std::invoke_result_t<F &, uint64_t>, bool>)
+				{
+					stopped = !f(high | value);
+				}
+				else
+				{
+					f(high | value);
+				}
+				return !stopped; });
+		}
+	}
+	// writes up to limit values to out in ascending order, skipping the first offset of them
+	// returns how many were written
+	size_t toUint64Array(uint64_t *out, size_t offset, size_t limit) const
+	{
+		std::vector<uint32_t> page;
+		size_t written = 0;
+		for (size_t i = 0; i < bb_keys.size() && written < limit; i++)
+		{
+			uint64_t card = bb_maps[i].cardinality();
+			if (offset >= card)
+			{
+				offset -= card;
+				continue;
+			}
+			// decode the low halves into a bounded page, then widen them
+			uint64_t high = static_cast<uint64_t>(bb_keys[i]) << 32;
+			page.resize(std::min<uint64_t>(card - offset, std::min<size_t>(limit - written, BB_BATCH_CHUNK)));
+			while (written < limit && offset < card)
+			{
+				size_t n = bb_maps[i].toUint32Array(page.data(), offset, std::min(page.size(), limit - written));
+				for (size_t k = 0; k < n; k++)
+				{
+					out[written++] = high | page[k];
+				}
+				offset += n;
+			}
+			offset = 0;
+		}
+		return written;
+	}
+
+private:
+	static constexpr size_t npos = static_cast<size_t>(-1);
+
+	size_t find(uint32_t key) const
+	{
+		auto itr = std::lower_bound(bb_keys.begin(), bb_keys.end(), key);
+		return itr != bb_keys.end() && *itr == key ? itr - bb_keys.begin() : npos;
+	}
+	void addSorted(std::span<uint64_t const> values)
+	{
+		std::vector<uint32_t> lows;
+		std::vector<uint32_t> fresh_keys;
+		std::vector<BarkingBitmap> fresh_maps;
+		size_t pos = 0;
+		for (size_t i = 0; i < values.size();)
+		{
+			uint32_t key = values[i] >> 32;
+			lows.clear();
+			for (; i < values.size() && values[i] >> 32 == key; i++)
+			{
+				lows.push_back(static_cast<uint32_t>(values[i]));
+			}
+			// lows are sorted, so the 32-bit addMany takes its sorted path
+			pos = std::lower_bound(bb_keys.begin() + pos, bb_keys.end(), key) - bb_keys.begin();
+			if (pos < bb_keys.size() && bb_keys[pos] == key)
+			{
+				bb_maps[pos].addMany(lows);
+			}
+			else
+			{
+				fresh_keys.push_back(key);
+				fresh_maps.emplace_back().addMany(lows);
+			}
+		}
+		splice(fresh_keys, fresh_maps);
+	}
+	// merges sorted maps whose keys are not present yet, back to front so nothing is shifted twice
+	void splice(std::vector<uint32_t> &keys, std::vector<BarkingBitmap> &maps)
+	{
+		if (keys.empty())
+		{
+			return;
+		}
+		ptrdiff_t i = bb_keys.size() - 1;
+		ptrdiff_t f = keys.size() - 1;
+		ptrdiff_t w = bb_keys.size() + keys.size() - 1;
+		bb_keys.resize(bb_keys.size() + keys.size());
+		bb_maps.resize(bb_maps.size() + maps.size());
+		for (; f >= 0; w--)
+		{
+			if (i >= 0 && bb_keys[i] > keys[f])
+			{
+				bb_keys[w] = bb_keys[i];
+				bb_maps[w] = std::move(bb_maps[i--]);
+			}
+			else
+			{
+				bb_keys[w] = keys[f];
+				bb_maps[w] = std::move(maps[f--]);
+			}
+		}
+	}
+
+	// sorted high 32 bits of every value, and the bitmap holding their low 32 bits
+	std::vector<uint32_t> bb_keys;
+	std::vector<BarkingBitmap> bb_maps;
+};
+
+#endif
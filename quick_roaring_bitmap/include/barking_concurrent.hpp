@@ -0,0 +1,314 @@
+//concurrent barking_bitmap: readers never block, writers lock one stripe of buckets and swap in a
+//modified copy of the bucket (rcu style), the old copy is freed once no reader can still see it
+#ifndef BARKING_CONCURRENT_HPP
+#define BARKING_CONCURRENT_HPP
+
+#include <mutex>
+#include <functional>
+
+#include "barking_bitmap.hpp"
+
+// writer locks and reader counters are both split this many ways
+#define BB_CONCURRENT_STRIPES 64
+// replaced buckets a writer stripe holds on to before it waits out the readers and frees them
+#define BB_RETIRE_BATCH 64
+
+class ConcurrentBarkingBitmap
+{
+public:
+	ConcurrentBarkingBitmap() = default;
+	ConcurrentBarkingBitmap(ConcurrentBarkingBitmap const &) = delete;
+	ConcurrentBarkingBitmap &operator=(ConcurrentBarkingBitmap const &) = delete;
+	// no reader or writer may still be running
+	~ConcurrentBarkingBitmap()
+	{
+		for (auto &p : pages)
+		{
+			if (auto page = p.load(std::memory_order_relaxed))
+			{
+				for (auto &slot : page->slots)
+				{
+					delete slot.load(std::memory_order_relaxed);
+				}
+				delete page;
+			}
+		}
+		for (auto &stripe : writers)
+		{
+			for (auto old : stripe.retired)
+			{
+				delete old;
+			}
+		}
+	}
+
+	void add(uint32_t value)
+	{
+		uint16_t key = value >> 16;
+		auto &stripe = writers[key % BB_CONCURRENT_STRIPES];
+		std::lock_guard lock(stripe.lock);
+		auto &slot = slotFor(key);
+		auto old = slot.load(std::memory_order_relaxed); // only ever stored under this lock
+		if (old && (*old)->contains(value & 0xFFFF))
+		{
+			return;
+		}
+		auto fresh = old ? std::make_unique<bb_cow>(*old) : std::make_unique<bb_cow>();
+		fresh->mut().add(value & 0xFFFF);
+		publish(stripe, slot, old, std::move(fresh));
+	}
+	void remove(uint32_t value)
+	{
+		uint16_t key = value >> 16;
+		auto &stripe = writers[key % BB_CONCURRENT_STRIPES];
+		std::lock_guard lock(stripe.lock);
+		auto &slot = slotFor(key);
+		auto old = slot.load(std::memory_order_relaxed);
+		if (!old || !(*old)->contains(value & 0xFFFF))
+		{
+			return;
+		}
+		auto fresh = std::make_unique<bb_cow>(*old);
+		fresh->mut().remove(value & 0xFFFF);
+		publish(stripe, slot, old, std::move(fresh));
+	}
+	// grouped like BarkingBitmap::addMany, then one swap per bucket
+	void addMany(std::span<uint32_t const> values)
+	{
+		BarkingBitmap batch;
+		batch.addMany(values);
+		unite(batch);
+	}
+	// merges other in bucket by bucket, a bucket we don't have yet is shared with other, not copied
+	void unite(BarkingBitmap const &other)
+	{
+		for (size_t i = 0; i < other.bb_keys.size(); i++)
+		{
+			uint16_t key = other.bb_keys[i];
+			auto &stripe = writers[key % BB_CONCURRENT_STRIPES];
+			std::lock_guard lock(stripe.lock);
+			auto &slot = slotFor(key);
+			auto old = slot.load(std::memory_order_relaxed);
+			if (!old)
+			{
+				publish(stripe, slot, old, std::make_unique<bb_cow>(other.bb_data[i]));
+				continue;
+			}
+			auto fresh = std::make_unique<bb_cow>(*old);
+			fresh->mut().unite(*other.bb_data[i]);
+			publish(stripe, slot, old, std::move(fresh));
+		}
+	}
+
+	// wait-free: two atomic loads and a counter bump, no locks and no retries
+	bool contains(uint32_t value) const
+	{
+		read_guard guard(*this);
+		auto bucket = load(value >> 16);
+		return bucket && (*bucket)->contains(value & 0xFFFF);
+	}
+	// out[i] = contains(values[i]), out has to be at least as long as values
+	void containsMany(std::span<uint32_t const> values, std::span<bool> out) const
+	{
+		if (out.size() < values.size())
+		{
+			throw std::length_error("BarkingBitmap: containsMany output too small");
+		}
+		read_guard guard(*this);
+		for (size_t i = 0; i < values.size();)
+		{
+			uint16_t key = values[i] >> 16;
+			size_t j = i + 1;
+			while (j < values.size() && values[j] >> 16 == key)
+			{
+				j++;
+			}
+			if (auto bucket = load(key))
+			{
+				(*bucket)->containsMany(values.data() + i, j - i, out.data() + i);
+			}
+			else
+			{
+				std::fill(out.begin() + i, out.begin() + j, false);
+			}
+			i = j;
+		}
+	}
+	// exact once writers are quiet, otherwise somewhere between the counts before and after
+	size_t cardinality() const
+	{
+		return total.load(std::memory_order_relaxed);
+	}
+	bool empty() const
+	{
+		return cardinality() == 0;
+	}
+	// plain bitmap sharing every bucket (copy-on-write), for intersect/unite/iteration on the query side.
+	// each bucket is as of some point during the call, writers to other buckets aren't held off
+	BarkingBitmap snapshot() const
+	{
+		BarkingBitmap result;
+		read_guard guard(*this);
+		for (size_t hi = 0; hi < pages.size(); hi++)
+		{
+			auto page = pages[hi].load();
+			if (!page)
+			{
+				continue;
+			}
+			for (size_t lo = 0; lo < page->slots.size(); lo++)
+			{
+				if (auto bucket = page->slots[lo].load())
+				{
+					result.bb_keys.push_back(static_cast<uint16_t>(hi << 8 | lo));
+					result.bb_data.push_back(*bucket);
+				}
+			}
+		}
+		return result;
+	}
+	// frees every replaced bucket now instead of in batches, waits for readers that might still see them
+	void reclaim()
+	{
+		for (auto &stripe : writers)
+		{
+			std::lock_guard lock(stripe.lock);
+			drain(stripe);
+		}
+	}
+
+private:
+	struct slot_page
+	{
+		std::array<std::atomic<bb_cow const *>, 256> slots{};
+	};
+	struct alignas(64) writer_stripe
+	{
+		std::mutex lock;
+		std::vector<bb_cow const *> retired;
+	};
+	// readers that entered while the epoch was even count in active[0], odd in active[1]
+	struct alignas(64) reader_stripe
+	{
+		std::atomic<size_t> active[2]{};
+	};
+
+	class read_guard
+	{
+	public:
+		explicit read_guard(ConcurrentBarkingBitmap const &owner)
+			: counter(owner.readers[stripeOfThread()].active[owner.epoch.load() & 1])
+		{
+			counter.fetch_add(1);
+		}
+		read_guard(read_guard const &) = delete;
+		read_guard &operator=(read_guard const &) = delete;
+		~read_guard()
+		{
+			counter.fetch_sub(1, std::memory_order_release);
+		}
+
+	private:
+		std::atomic<size_t> &counter;
+	};
+
+	static size_t stripeOfThread()
+	{
+		static thread_local size_t stripe = std::hash<std::thread::id>{}(std::this_thread::get_id()) % BB_CONCURRENT_STRIPES;
+		return stripe;
+	}
+
+	bb_cow const *load(uint16_t key) const
+	{
+		auto page = pages[key >> 8].load();
+		return page ? page->slots[key & 0xFF].load() : nullptr;
+	}
+	// pages are only ever added, racing writers from different stripes settle it with a cas
+	std::atomic<bb_cow const *> &slotFor(uint16_t key)
+	{
+		auto &p = pages[key >> 8];
+		auto page = p.load();
+		if (!page)
+		{
+			auto fresh = new slot_page();
+			if (p.compare_exchange_strong(page, fresh))
+			{
+				page = fresh;
+			}
+			else
+			{
+				delete fresh;
+			}
+		}
+		return page->slots[key & 0xFF];
+	}
+	// swaps fresh in for old (either may be null or empty), old is retired rather than freed
+	void publish(writer_stripe &stripe, std::atomic<bb_cow const *> &slot, bb_cow const *old, std::unique_ptr<bb_cow> fresh)
+	{
+		if (fresh && (*fresh)->empty())
+		{
+			fresh.reset();
+		}
+		size_t before = old ? (*old)->sz : 0;
+		size_t after = fresh ? (*fresh)->sz : 0;
+		if (after > before)
+		{
+			total.fetch_add(after - before, std::memory_order_relaxed);
+		}
+		else
+		{
+			total.fetch_sub(before - after, std::memory_order_relaxed);
+		}
+		// seq_cst: a reader that bumps its counter after synchronize() looked at it must load this store
+		slot.store(fresh.release());
+		if (old)
+		{
+			stripe.retired.push_back(old);
+			if (stripe.retired.size() >= BB_RETIRE_BATCH)
+			{
+				drain(stripe);
+			}
+		}
+	}
+	void drain(writer_stripe &stripe)
+	{
+		if (stripe.retired.empty())
+		{
+			return;
+		}
+		synchronize();
+		for (auto old : stripe.retired)
+		{
+			delete old;
+		}
+		stripe.retired.clear();
+	}
+	// waits until every reader that could have loaded a now unpublished bucket is gone. the epoch
+	// is flipped twice, a reader that read the epoch just before the first flip but bumped its
+	// counter after we drained that side is caught by the second
+	void synchronize()
+	{
+		std::lock_guard lock(sync_lock);
+		for (int phase = 0; phase < 2; phase++)
+		{
+			size_t side = epoch.fetch_add(1) & 1;
+			for (auto &r : readers)
+			{
+				while (r.active[side].load() != 0)
+				{
+					std::this_thread::yield();
+				}
+			}
+		}
+	}
+
+	// key >> 8 picks the page, key & 0xFF the slot, pages are allocated the first time a key lands in them
+	std::array<std::atomic<slot_page *>, 256> pages{};
+	std::array<writer_stripe, BB_CONCURRENT_STRIPES> writers;
+	mutable std::array<reader_stripe, BB_CONCURRENT_STRIPES> readers;
+	std::atomic<size_t> epoch{0};
+	std::mutex sync_lock;
+	std::atomic<size_t> total{0};
+};
+
+#endif
@@ -0,0 +1,573 @@
+//container kernels for barking_bitmap, picked at runtime depending on what the cpu supports
+//every simd kernel has a scalar twin that is also the fallback on other architectures
+#ifndef BARKING_SIMD_HPP
+#define BARKING_SIMD_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define BB_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+// array kernels may store up to this many elements past the count they return,
+// so output buffers need that much slack on top of the result's upper bound
+#define BB_SIMD_SLACK 8
+// above this size ratio intersections gallop through the larger array instead of merging
+#define BB_GALLOP_RATIO 64
+
+// sorted, unique uint16_t arrays in, sorted unique array out, returns the output count
+using bb_array_kernel = size_t (*)(uint16_t const *, size_t, uint16_t const *, size_t, uint16_t *);
+// same inputs, only the size of the result
+using bb_array_count_kernel = size_t (*)(uint16_t const *, size_t, uint16_t const *, size_t);
+// word kernels for the 1024 x 64 bit bitset containers
+using bb_words_kernel = void (*)(uint64_t *, uint64_t const *, size_t);
+using bb_popcount_kernel = size_t (*)(uint64_t const *, size_t);
+
+static auto bb_scalar_intersect(uint16_t const *a, size_t na, uint16_t const *b, size_t nb, uint16_t *out) -> size_t
+{
+	size_t i = 0, j = 0, count = 0;
+	while (i < na && j < nb)
+	{
+		if (a[i] < b[j])
+		{
+			i++;
+		}
+		else if (b[j] < a[i])
+		{
+			j++;
+		}
+		else
+		{
+			out[count++] = a[i];
+			i++;
+			j++;
+		}
+	}
+	return count;
+}
+
+static auto bb_scalar_intersect_count(uint16_t const *a, size_t na, uint16_t const *b, size_t nb) -> size_t
+{
+	size_t i = 0, j = 0, count = 0;
+	while (i < na && j < nb)
+	{
+		// branchless: both sides step past whatever is smaller, or both on a match
+		uint16_t x = a[i];
+		uint16_t y = b[j];
+		count += x == y;
+		i += x <= y;
+		j += y <= x;
+	}
+	return count;
+}
+
+// appends the union of a and b to out, skipping anything equal to the value already at out[count - 1]
+static auto bb_scalar_union_append(uint16_t const *a, size_t na, uint16_t const *b, size_t nb, uint16_t *out, size_t count) -> size_t
+{
+	size_t i = 0, j = 0;
+	while (i < na || j < nb)
+	{
+		uint16_t next;
+		if (j == nb || (i < na && a[i] < b[j]))
+		{
+			next = a[i++];
+		}
+		else if (i == na || b[j] < a[i])
+		{
+			next = b[j++];
+		}
+		else
+		{
+			next = a[i++];
+			j++;
+		}
+		if (count == 0 || out[count - 1] != next)
+		{
+			out[count++] = next;
+		}
+	}
+	return count;
+}
+
+static auto bb_scalar_union(uint16_t const *a, size_t na, uint16_t const *b, size_t nb, uint16_t *out) -> size_t
+{
+	return bb_scalar_union_append(a, na, b, nb, out, 0);
+}
+
+// values of a that are not in b
+static auto bb_scalar_difference(uint16_t const *a, size_t na, uint16_t const *b, size_t nb, uint16_t *out) -> size_t
+{
+	size_t i = 0, j = 0, count = 0;
+	while (i < na)
+	{
+		while (j < nb && b[j] < a[i])
+		{
+			j++;
+		}
+		if (j == nb || b[j] != a[i])
+		{
+			out[count++] = a[i];
+		}
+		i++;
+	}
+	return count;
+}
+
+// intersection for a much smaller than b: exponential then binary search through b for every value of a
+static auto bb_galloping_intersect(uint16_t const *a, size_t na, uint16_t const *b, size_t nb, uint16_t *out) -> size_t
+{
+	size_t count = 0;
+	size_t lo = 0;
+	for (size_t i = 0; i < na && lo < nb; i++)
+	{
+		uint16_t value = a[i];
+		if (b[lo] < value)
+		{
+			size_t step = 1;
+			size_t hi = lo + 1;
+			while (hi < nb && b[hi] < value)
+			{
+				lo = hi;
+				step <<= 1;
+				hi = lo + step;
+			}
+			hi = std::min(hi, nb);
+			lo = std::lower_bound(b + lo, b + hi, value) - b;
+			if (lo == nb)
+			{
+				break;
+			}
+		}
+		if (b[lo] == value)
+		{
+			out[count++] = value;
+			lo++;
+		}
+	}
+	return count;
+}
+
+static void bb_scalar_and_words(uint64_t *dst, uint64_t const *src, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+	{
+		dst[i] &= src[i];
+	}
+}
+
+static void bb_scalar_or_words(uint64_t *dst, uint64_t const *src, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+	{
+		dst[i] |= src[i];
+	}
+}
+
+static auto bb_scalar_popcount_words(uint64_t const *words, size_t n) -> size_t
+{
+	size_t result = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		result += __builtin_popcountll(words[i]);
+	}
+	return result;
+}
+
+// galloping_intersect without the output
+static auto bb_galloping_intersect_count(uint16_t const *a, size_t na, uint16_t const *b, size_t nb) -> size_t
+{
+	size_t count = 0;
+	size_t lo = 0;
+	for (size_t i = 0; i < na && lo < nb; i++)
+	{
+		uint16_t value = a[i];
+		if (b[lo] < value)
+		{
+			size_t step = 1;
+			size_t hi = lo + 1;
+			while (hi < nb && b[hi] < value)
+			{
+				lo = hi;
+				step <<= 1;
+				hi = lo + step;
+			}
+			hi = std::min(hi, nb);
+			lo = std::lower_bound(b + lo, b + hi, value) - b;
+			if (lo == nb)
+			{
+				break;
+			}
+		}
+		if (b[lo] == value)
+		{
+			count++;
+			lo++;
+		}
+	}
+	return count;
+}
+
+#ifdef BB_SIMD_X86
+
+// for every 8 bit lane mask, the pshufb control that packs the selected uint16_t lanes to the front
+static constexpr auto bb_shuffle_table = []
+{
+	std::array<std::array<uint8_t, 16>, 256> table{};
+	for (size_t mask = 0; mask < 256; mask++)
+	{
+		size_t out = 0;
+		for (uint8_t lane = 0; lane < 8; lane++)
+		{
+			if (mask & (1u << lane))
+			{
+				table[mask][out++] = 2 * lane;
+				table[mask][out++] = 2 * lane + 1;
+			}
+		}
+		while (out < 16)
+		{
+			table[mask][out++] = 0x80;
+		}
+	}
+	return table;
+}();
+
+// writes the lanes of v selected by mask to out, always storing a full vector
+__attribute__((target("ssse3"))) static inline auto bb_store_compact(__m128i v, unsigned mask, uint16_t *out) -> size_t
+{
+	__m128i shuffle = _mm_loadu_si128(reinterpret_cast<__m128i const *>(bb_shuffle_table[mask].data()));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_shuffle_epi8(v, shuffle));
+	return __builtin_popcount(mask);
+}
+
+// bit k set when lane k of va equals any lane of vb
+__attribute__((target("sse4.2"))) static inline auto bb_match_mask(__m128i va, __m128i vb) -> unsigned
+{
+	constexpr int mode = _SIDD_UWORD_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK;
+	return _mm_cvtsi128_si32(_mm_cmpestrm(vb, 8, va, 8, mode));
+}
+
+// block-wise all-pairs compare, advancing whichever block has the smaller maximum (Schlegel et al.)
+__attribute__((target("sse4.2"))) static auto bb_sse_intersect(uint16_t const *a, size_t na, uint16_t const *b, size_t nb, uint16_t *out) -> size_t
+{
+	size_t i = 0, j = 0, count = 0;
+	while (i + 8 <= na && j + 8 <= nb)
+	{
+		__m128i va = _mm_loadu_si128(reinterpret_cast<__m128i const *>(a + i));
+		__m128i vb = _mm_loadu_si128(reinterpret_cast<__m128i const *>(b + j));
+		count += bb_store_compact(va, bb_match_mask(va, vb), out + count);
+		uint16_t amax = a[i + 7];
+		uint16_t bmax = b[j + 7];
+		if (amax <= bmax)
+		{
+			i += 8;
+		}
+		if (bmax <= amax)
+		{
+			j += 8;
+		}
+	}
+	return count + bb_scalar_intersect(a + i, na - i, b + j, nb - j, out + count);
+}
+
+// sse_intersect that only popcounts the match masks
+__attribute__((target("sse4.2,popcnt"))) static auto bb_sse_intersect_count(uint16_t const *a, size_t na, uint16_t const *b, size_t nb) -> size_t
+{
+	size_t i = 0, j = 0, count = 0;
+	while (i + 8 <= na && j + 8 <= nb)
+	{
+		__m128i va = _mm_loadu_si128(reinterpret_cast<__m128i const *>(a + i));
+		__m128i vb = _mm_loadu_si128(reinterpret_cast<__m128i const *>(b + j));
+		count += __builtin_popcount(bb_match_mask(va, vb));
+		uint16_t amax = a[i + 7];
+		uint16_t bmax = b[j + 7];
+		if (amax <= bmax)
+		{
+			i += 8;
+		}
+		if (bmax <= amax)
+		{
+			j += 8;
+		}
+	}
+	return count + bb_scalar_intersect_count(a + i, na - i, b + j, nb - j);
+}
+
+__attribute__((target("sse4.2"))) static auto bb_sse_difference(uint16_t const *a, size_t na, uint16_t const *b, size_t nb, uint16_t *out) -> size_t
+{
+	size_t i = 0, j = 0, count = 0;
+	// lanes of the current a block matched by any b block seen so far
+	unsigned matched = 0;
+	while (i + 8 <= na && j + 8 <= nb)
+	{
+		__m128i va = _mm_loadu_si128(reinterpret_cast<__m128i const *>(a + i));
+		__m128i vb = _mm_loadu_si128(reinterpret_cast<__m128i const *>(b + j));
+		matched |= bb_match_mask(va, vb);
+		uint16_t amax = a[i + 7];
+		uint16_t bmax = b[j + 7];
+		if (amax <= bmax)
+		{
+			count += bb_store_compact(va, ~matched & 0xFF, out + count);
+			matched = 0;
+			i += 8;
+		}
+		if (bmax <= amax)
+		{
+			j += 8;
+		}
+	}
+	// b values before j are all below a[i + 8], so only the current block needs the mask
+	for (size_t k = i; k < std::min(i + 8, na); k++)
+	{
+		if (!(matched & (1u << (k - i))) && !std::binary_search(b + j, b + nb, a[k]))
+		{
+			out[count++] = a[k];
+		}
+	}
+	if (i + 8 < na)
+	{
+		count += bb_scalar_difference(a + i + 8, na - i - 8, b + j, nb - j, out + count);
+	}
+	return count;
+}
+
+// 8 lane bitonic sort step: compare lanes distance apart, min to the lower lane
+#define BB_BITONIC_STEP(v, swapped, blend) \
+	do \
+	{ \
+		__m128i step_min = _mm_min_epu16(v, swapped); \
+		__m128i step_max = _mm_max_epu16(v, swapped); \
+		v = _mm_blend_epi16(step_min, step_max, blend); \
+	} while (0)
+
+// merges two sorted 8 lane vectors, lo gets the 8 smallest values and hi the rest, both sorted
+__attribute__((target("sse4.1,ssse3"))) static inline void bb_bitonic_merge(__m128i a, __m128i b, __m128i &lo, __m128i &hi)
+{
+	__m128i reverse = _mm_setr_epi8(14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+	b = _mm_shuffle_epi8(b, reverse);
+	lo = _mm_min_epu16(a, b);
+	hi = _mm_max_epu16(a, b);
+	// both halves are bitonic now, finish them with half cleaners at distance 4, 2 and 1
+	BB_BITONIC_STEP(lo, _mm_alignr_epi8(lo, lo, 8), 0xF0);
+	BB_BITONIC_STEP(hi, _mm_alignr_epi8(hi, hi, 8), 0xF0);
+	BB_BITONIC_STEP(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 3, 0, 1)), 0xCC);
+	BB_BITONIC_STEP(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(2, 3, 0, 1)), 0xCC);
+	BB_BITONIC_STEP(lo, _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1)), 0xAA);
+	BB_BITONIC_STEP(hi, _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1)), 0xAA);
+}
+
+#undef BB_BITONIC_STEP
+
+// stores the lanes of v that differ from their predecessor, lane 0 is compared against the last lane of prev
+__attribute__((target("sse4.1,ssse3"))) static inline auto bb_store_unique(__m128i prev, __m128i v, uint16_t *out) -> size_t
+{
+	__m128i shifted = _mm_alignr_epi8(v, prev, 14);
+	__m128i dup = _mm_cmpeq_epi16(v, shifted);
+	unsigned mask = _mm_movemask_epi8(_mm_packs_epi16(dup, _mm_setzero_si128()));
+	return bb_store_compact(v, ~mask & 0xFF, out);
+}
+
+// streams 8 values at a time through the merge network, taking the next block from the array with the smaller head
+__attribute__((target("sse4.2"))) static auto bb_sse_union(uint16_t const *a, size_t na, uint16_t const *b, size_t nb, uint16_t *out) -> size_t
+{
+	if (na < 8 || nb < 8)
+	{
+		return bb_scalar_union(a, na, b, nb, out);
+	}
+	__m128i lo, hi;
+	bb_bitonic_merge(_mm_loadu_si128(reinterpret_cast<__m128i const *>(a)), _mm_loadu_si128(reinterpret_cast<__m128i const *>(b)), lo, hi);
+	size_t i = 8, j = 8;
+	// any value that differs from the first output works as the initial predecessor
+	__m128i prev = _mm_set1_epi16(static_cast<int16_t>(_mm_extract_epi16(lo, 0) - 1));
+	size_t count = bb_store_unique(prev, lo, out);
+	prev = lo;
+	while (i + 8 <= na && j + 8 <= nb)
+	{
+		__m128i next;
+		if (a[i] <= b[j])
+		{
+			next = _mm_loadu_si128(reinterpret_cast<__m128i const *>(a + i));
+			i += 8;
+		}
+		else
+		{
+			next = _mm_loadu_si128(reinterpret_cast<__m128i const *>(b + j));
+			j += 8;
+		}
+		bb_bitonic_merge(next, hi, lo, hi);
+		count += bb_store_unique(prev, lo, out + count);
+		prev = lo;
+	}
+	// hi plus whatever is left on both sides is still sorted relative to everything written so far
+	std::array<uint16_t, 8> pending;
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(pending.data()), hi);
+	std::array<uint16_t, 24> tail;
+	size_t ntail;
+	if (na - i < 8)
+	{
+		ntail = bb_scalar_union(pending.data(), pending.size(), a + i, na - i, tail.data());
+		return bb_scalar_union_append(tail.data(), ntail, b + j, nb - j, out, count);
+	}
+	ntail = bb_scalar_union(pending.data(), pending.size(), b + j, nb - j, tail.data());
+	return bb_scalar_union_append(tail.data(), ntail, a + i, na - i, out, count);
+}
+
+__attribute__((target("avx2"))) static void bb_avx2_and_words(uint64_t *dst, uint64_t const *src, size_t n)
+{
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m256i d = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(dst + i));
+		__m256i s = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(src + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_and_si256(d, s));
+	}
+	bb_scalar_and_words(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void bb_avx2_or_words(uint64_t *dst, uint64_t const *src, size_t n)
+{
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m256i d = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(dst + i));
+		__m256i s = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(src + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_or_si256(d, s));
+	}
+	bb_scalar_or_words(dst + i, src + i, n - i);
+}
+
+// nibble lookup popcount (Mula), byte counts are summed into 64 bit lanes with sad
+__attribute__((target("avx2"))) static auto bb_avx2_popcount_words(uint64_t const *words, size_t n) -> size_t
+{
+	__m256i const lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+											0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	__m256i const low = _mm256_set1_epi8(0x0F);
+	__m256i total = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(words + i));
+		__m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low));
+		__m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+		total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+	}
+	size_t result = _mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1) +
+					_mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3);
+	return result + bb_scalar_popcount_words(words + i, n - i);
+}
+
+__attribute__((target("popcnt"))) static auto bb_popcnt_popcount_words(uint64_t const *words, size_t n) -> size_t
+{
+	size_t result = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		result += __builtin_popcountll(words[i]);
+	}
+	return result;
+}
+
+#endif // BB_SIMD_X86
+
+struct bb_kernels
+{
+	bb_array_kernel intersect = bb_scalar_intersect;
+	bb_array_kernel unite = bb_scalar_union;
+	bb_array_kernel difference = bb_scalar_difference;
+	bb_array_count_kernel intersect_count = bb_scalar_intersect_count;
+	bb_words_kernel and_words = bb_scalar_and_words;
+	bb_words_kernel or_words = bb_scalar_or_words;
+	bb_popcount_kernel popcount_words = bb_scalar_popcount_words;
+};
+
+// resolved once, on first use
+static auto bb_simd_kernels() -> bb_kernels const &
+{
+	static bb_kernels const kernels = []
+	{
+		bb_kernels result;
+#ifdef BB_SIMD_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("sse4.2"))
+		{
+			result.intersect = bb_sse_intersect;
+			result.unite = bb_sse_union;
+			result.difference = bb_sse_difference;
+		}
+		if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt"))
+		{
+			result.intersect_count = bb_sse_intersect_count;
+		}
+		if (__builtin_cpu_supports("popcnt"))
+		{
+			result.popcount_words = bb_popcnt_popcount_words;
+		}
+		if (__builtin_cpu_supports("avx2"))
+		{
+			result.and_words = bb_avx2_and_words;
+			result.or_words = bb_avx2_or_words;
+			result.popcount_words = bb_avx2_popcount_words;
+		}
+#endif
+		return result;
+	}();
+	return kernels;
+}
+
+// entry points used by the containers
+static auto bb_intersect_u16(uint16_t const *a, size_t na, uint16_t const *b, size_t nb, uint16_t *out) -> size_t
+{
+	if (na * BB_GALLOP_RATIO < nb)
+	{
+		return bb_galloping_intersect(a, na, b, nb, out);
+	}
+	if (nb * BB_GALLOP_RATIO < na)
+	{
+		return bb_galloping_intersect(b, nb, a, na, out);
+	}
+	return bb_simd_kernels().intersect(a, na, b, nb, out);
+}
+
+inline auto bb_intersect_count_u16(uint16_t const *a, size_t na, uint16_t const *b, size_t nb) -> size_t
+{
+	if (na * BB_GALLOP_RATIO < nb)
+	{
+		return bb_galloping_intersect_count(a, na, b, nb);
+	}
+	if (nb * BB_GALLOP_RATIO < na)
+	{
+		return bb_galloping_intersect_count(b, nb, a, na);
+	}
+	return bb_simd_kernels().intersect_count(a, na, b, nb);
+}
+
+static auto bb_union_u16(uint16_t const *a, size_t na, uint16_t const *b, size_t nb, uint16_t *out) -> size_t
+{
+	return bb_simd_kernels().unite(a, na, b, nb, out);
+}
+
+inline auto bb_difference_u16(uint16_t const *a, size_t na, uint16_t const *b, size_t nb, uint16_t *out) -> size_t
+{
+	return bb_simd_kernels().difference(a, na, b, nb, out);
+}
+
+static void bb_and_words(uint64_t *dst, uint64_t const *src, size_t n)
+{
+	bb_simd_kernels().and_words(dst, src, n);
+}
+
+static void bb_or_words(uint64_t *dst, uint64_t const *src, size_t n)
+{
+	bb_simd_kernels().or_words(dst, src, n);
+}
+
+static auto bb_popcount_words(uint64_t const *words, size_t n) -> size_t
+{
+	return bb_simd_kernels().popcount_words(words, n);
+}
+
+#endif // BARKING_SIMD_HPP
@@ -0,0 +1,283 @@
+//streaming barking_bitmap writer: values come in increasing order and every finished container is
+//encoded and pushed out right away, so only the open container is ever held in memory
+#ifndef BARKING_STREAM_HPP
+#define BARKING_STREAM_HPP
+
+#include <cstdio>
+#include <ostream>
+
+#include "barking_bitmap.hpp"
+
+// encoded containers are gathered up to this many bytes before they go to the spill file
+#define BB_STREAM_BUFFER (1 << 20)
+
+// the portable header lists every container before the first body, and its size depends on how many
+// containers there are and whether any is a run. so bodies go to a spill file (std::tmpfile) as they
+// are finished, and finish() writes the header followed by the spilled bodies to out. memory stays at
+// one open container, one write buffer and 12 bytes of header bookkeeping per container
+class BarkingBitmapWriter
+{
+public:
+	explicit BarkingBitmapWriter(std::ostream &out) : out(out){};
+	BarkingBitmapWriter(BarkingBitmapWriter const &) = delete;
+	BarkingBitmapWriter &operator=(BarkingBitmapWriter const &) = delete;
+	BarkingBitmapWriter(BarkingBitmapWriter &&) = default;
+	~BarkingBitmapWriter() = default;
+
+	// append mode: picks up where a previously written bitmap left off. every container but the last is
+	// copied through as encoded bytes, the last one is reopened so values can still be added to it
+	static BarkingBitmapWriter resume(std::span<std::byte const> prior, std::ostream &out)
+	{
+		bb_portable_view view(prior);
+		BarkingBitmapWriter result(out);
+		if (view.size() == 0)
+		{
+			return result;
+		}
+		for (size_t i = 0; i + 1 < view.size(); i++)
+		{
+			size_t bytes = view.containerBytes(i);
+			result.entries.push_back({view.key(i), static_cast<uint16_t>(view.cardinality(i) - 1), static_cast<uint32_t>(bytes), view.isRun(i)});
+			result.emit(view.container(i), bytes);
+		}
+		size_t last = view.size() - 1;
+		result.open = BBData(bb_read_portable(view, last));
+		result.open_key = view.key(last);
+		result.has_open = true;
+		result.next = (static_cast<uint64_t>(result.open_key) << 16 | result.open.maximum()) + 1;
+		return result;
+	}
+
+	// values below the last one added throw, repeating the last one is fine
+	void add(uint32_t value)
+	{
+		check(value);
+		uint16_t key = value >> 16;
+		if (!has_open || key != open_key)
+		{
+			startContainer(key);
+		}
+		pending.push_back(value & 0xFFFF);
+		if (pending.size() >= BB_ARRAY_THRESHOLD)
+		{
+			settle();
+		}
+		next = uint64_t(value) + 1;
+	}
+	// sorted values, same rules as add
+	void addMany(std::span<uint32_t const> values)
+	{
+		for (auto v : values)
+		{
+			add(v);
+		}
+	}
+	// adds every value in [lo, hi], full containers in between are written as single runs
+	void addRange(uint32_t lo, uint32_t hi)
+	{
+		if (lo > hi)
+		{
+			return;
+		}
+		check(lo);
+		for (uint32_t key = lo >> 16; key <= hi >> 16; key++)
+		{
+			uint16_t first = key == lo >> 16 ? lo & 0xFFFF : 0;
+			uint16_t last = key == hi >> 16 ? hi & 0xFFFF : 0xFFFF;
+			if (!has_open || key != open_key)
+			{
+				startContainer(key);
+			}
+			settle();
+			open.unite(BBData(bb_run{{first, last}}));
+		}
+		next = uint64_t(hi) + 1;
+	}
+
+	// writes the whole bitmap to out and returns the number of bytes written, the writer is done after
+	size_t finish()
+	{
+		if (finished)
+		{
+			throw std::runtime_error("BarkingBitmap: writer already finished");
+		}
+		closeContainer();
+		finished = true;
+		bool runs = std::any_of(entries.begin(), entries.end(), [](entry const &e)
+								{ return e.run; });
+		size_t n = entries.size();
+		std::vector<std::byte> header(bb_portable_header_bytes(n, runs));
+		std::byte *p = header.data();
+		size_t pos;
+		if (runs)
+		{
+			bb_store<uint32_t>(p, BB_SERIAL_COOKIE | static_cast<uint32_t>(n - 1) << 16);
+			pos = 4 + (n + 7) / 8;
+			for (size_t i = 0; i < n; i++)
+			{
+				if (entries[i].run)
+				{
+					p[4 + i / 8] |= std::byte(1 << (i % 8));
+				}
+			}
+		}
+		else
+		{
+			bb_store<uint32_t>(p, BB_SERIAL_COOKIE_NO_RUN);
+			bb_store<uint32_t>(p + 4, n);
+			pos = 8;
+		}
+		std::byte *descriptive = p + pos;
+		std::byte *offsets = !runs || n >= BB_NO_OFFSET_THRESHOLD ? descriptive + 4 * n : nullptr;
+		size_t offset = header.size();
+		for (size_t i = 0; i < n; i++)
+		{
+			bb_store<uint16_t>(descriptive + 4 * i, entries[i].key);
+			bb_store<uint16_t>(descriptive + 4 * i + 2, entries[i].card);
+			if (offsets)
+			{
+				bb_store<uint32_t>(offsets + 4 * i, offset);
+			}
+			offset += entries[i].bytes;
+		}
+		write(header.data(), header.size());
+		if (spill)
+		{
+			std::rewind(spill.get());
+			std::vector<std::byte> block(BB_STREAM_BUFFER);
+			while (size_t got = std::fread(block.data(), 1, block.size(), spill.get()))
+			{
+				write(block.data(), got);
+			}
+			if (std::ferror(spill.get()))
+			{
+				throw std::runtime_error("BarkingBitmap: reading the spill file failed");
+			}
+			spill.reset();
+		}
+		write(buffered.data(), buffered.size());
+		buffered = {};
+		return offset;
+	}
+
+private:
+	// one line of the header, kept until finish()
+	struct entry
+	{
+		uint16_t key;
+		uint16_t card; // cardinality - 1, like the format
+		uint32_t bytes;
+		bool run;
+	};
+
+	void check(uint32_t value)
+	{
+		if (finished)
+		{
+			throw std::runtime_error("BarkingBitmap: writer already finished");
+		}
+		if (value + uint64_t(1) < next)
+		{
+			throw std::runtime_error("BarkingBitmap: values must be added in increasing order");
+		}
+	}
+	void startContainer(uint16_t key)
+	{
+		closeContainer();
+		open = BBData();
+		open_key = key;
+		has_open = true;
+	}
+	// merges the values collected since the last merge into the open container
+	void settle()
+	{
+		if (pending.empty())
+		{
+			return;
+		}
+		// the last value may repeat
+		pending.erase(std::unique(pending.begin(), pending.end()), pending.end());
+		if (!open.empty() && pending.front() == open.maximum())
+		{
+			pending.erase(pending.begin());
+		}
+		open.addMany(pending.data(), pending.size());
+		pending.clear();
+	}
+	void closeContainer()
+	{
+		if (!has_open)
+		{
+			return;
+		}
+		settle();
+		has_open = false;
+		if (open.empty())
+		{
+			return;
+		}
+		bool run = open.runOptimize();
+		size_t bytes = bb_portable_bytes(open);
+		entries.push_back({open_key, static_cast<uint16_t>(open.sz - 1), static_cast<uint32_t>(bytes), run});
+		if (buffered.size() + bytes > BB_STREAM_BUFFER)
+		{
+			spillBuffered();
+		}
+		size_t at = buffered.size();
+		buffered.resize(at + bytes);
+		bb_write_portable(open, buffered.data() + at);
+		open = BBData();
+	}
+	// queues already encoded container bytes
+	void emit(std::byte const *src, size_t bytes)
+	{
+		if (buffered.size() + bytes > BB_STREAM_BUFFER)
+		{
+			spillBuffered();
+		}
+		buffered.insert(buffered.end(), src, src + bytes);
+	}
+	void spillBuffered()
+	{
+		if (!spill)
+		{
+			spill.reset(std::tmpfile());
+			if (!spill)
+			{
+				throw std::runtime_error("BarkingBitmap: could not create a spill file");
+			}
+		}
+		if (std::fwrite(buffered.data(), 1, buffered.size(), spill.get()) != buffered.size())
+		{
+			throw std::runtime_error("BarkingBitmap: writing the spill file failed");
+		}
+		buffered.clear();
+	}
+	void write(std::byte const *src, size_t bytes)
+	{
+		out.write(reinterpret_cast<char const *>(src), bytes);
+		if (!out)
+		{
+			throw std::runtime_error("BarkingBitmap: writing the output failed");
+		}
+	}
+
+	struct file_closer
+	{
+		void operator()(std::FILE *f) const { std::fclose(f); }
+	};
+
+	std::ostream &out;
+	std::vector<entry> entries;
+	std::vector<std::byte> buffered;
+	std::unique_ptr<std::FILE, file_closer> spill;
+	BBData open;
+	std::vector<uint16_t> pending;
+	uint16_t open_key = 0;
+	bool has_open = false;
+	bool finished = false;
+	// smallest value that may still be added (one past the last), 64-bit so UINT32_MAX fits
+	uint64_t next = 0;
+};
+
+#endif
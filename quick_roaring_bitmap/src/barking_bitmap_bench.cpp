@@ -0,0 +1,545 @@
+#include "barking_bitmap.hpp"
+#include <benchmark/benchmark.h>
+#include <cmath>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <random>
+#include <set>
+#include <unordered_set>
+#ifdef BB_BENCH_CROARING
+#include <roaring/memory.h>
+#include <roaring/roaring.h>
+#endif
+
+// live bytes handed out by operator new, every block carries its size in front so delete can subtract it
+static std::atomic<int64_t> live_bytes{0};
+static constexpr size_t header = alignof(std::max_align_t);
+
+void *operator new(size_t size)
+{
+	auto block = static_cast<std::byte *>(std::malloc(size + header));
+	if (!block)
+	{
+		throw std::bad_alloc();
+	}
+	std::memcpy(block, &size, sizeof(size));
+	live_bytes += size;
+	return block + header;
+}
+void operator delete(void *ptr) noexcept
+{
+	if (!ptr)
+	{
+		return;
+	}
+	auto block = static_cast<std::byte *>(ptr) - header;
+	size_t size;
+	std::memcpy(&size, block, sizeof(size));
+	live_bytes -= size;
+	std::free(block);
+}
+void operator delete(void *ptr, size_t) noexcept { operator delete(ptr); }
+// over-aligned blocks (bitset words) get a header as wide as their alignment
+void *operator new(size_t size, std::align_val_t align)
+{
+	size_t a = static_cast<size_t>(align);
+	auto block = static_cast<std::byte *>(std::aligned_alloc(a, (size + 2 * a - 1) / a * a));
+	if (!block)
+	{
+		throw std::bad_alloc();
+	}
+	std::memcpy(block, &size, sizeof(size));
+	live_bytes += size;
+	return block + a;
+}
+void operator delete(void *ptr, std::align_val_t align) noexcept
+{
+	if (!ptr)
+	{
+		return;
+	}
+	auto block = static_cast<std::byte *>(ptr) - static_cast<size_t>(align);
+	size_t size;
+	std::memcpy(&size, block, sizeof(size));
+	live_bytes -= size;
+	std::free(block);
+}
+void operator delete(void *ptr, size_t, std::align_val_t align) noexcept { operator delete(ptr, align); }
+
+#ifdef BB_BENCH_CROARING
+// CRoaring allocates through malloc, its memory hooks send that into live_bytes too. every block
+// carries its size and its distance from the start of the real allocation in front, aligned_free
+// isn't told the alignment
+namespace croaring_hooks
+{
+	static constexpr size_t prefix = 2 * sizeof(size_t);
+	static_assert(prefix <= header);
+
+	static void *track(std::byte *block, size_t offset, size_t size)
+	{
+		if (!block)
+		{
+			return nullptr;
+		}
+		std::byte *ptr = block + offset;
+		std::memcpy(ptr - prefix, &offset, sizeof(size_t));
+		std::memcpy(ptr - sizeof(size_t), &size, sizeof(size_t));
+		live_bytes += size;
+		return ptr;
+	}
+	static auto untrack(void *ptr) -> std::pair<std::byte *, size_t>
+	{
+		auto p = static_cast<std::byte *>(ptr);
+		size_t offset, size;
+		std::memcpy(&offset, p - prefix, sizeof(size_t));
+		std::memcpy(&size, p - sizeof(size_t), sizeof(size_t));
+		live_bytes -= size;
+		return {p - offset, size};
+	}
+
+	static void *allocate(size_t size)
+	{
+		return track(static_cast<std::byte *>(std::malloc(size + header)), header, size);
+	}
+	static void *reallocate(void *ptr, size_t size)
+	{
+		if (!ptr)
+		{
+			return allocate(size);
+		}
+		auto [block, old] = untrack(ptr);
+		auto grown = static_cast<std::byte *>(std::realloc(block, size + header));
+		if (!grown)
+		{
+			live_bytes += old; // the old block is still there
+			return nullptr;
+		}
+		return track(grown, header, size);
+	}
+	static void *allocateZeroed(size_t count, size_t size)
+	{
+		void *ptr = allocate(count * size);
+		if (ptr)
+		{
+			std::memset(ptr, 0, count * size);
+		}
+		return ptr;
+	}
+	static void release(void *ptr)
+	{
+		if (ptr)
+		{
+			std::free(untrack(ptr).first);
+		}
+	}
+	static void *allocateAligned(size_t alignment, size_t size)
+	{
+		size_t offset = std::max(alignment, header);
+		return track(static_cast<std::byte *>(std::aligned_alloc(alignment, (size + offset + alignment - 1) / alignment * alignment)), offset, size);
+	}
+
+	// installed before main, ahead of every CRoaring allocation
+	static bool const installed = []
+	{
+		roaring_memory_t hooks{allocate, reallocate, allocateZeroed, release, allocateAligned, release};
+		roaring_init_memory_hook(hooks);
+		return true;
+	}();
+}
+#endif
+
+enum distribution
+{
+	uniform,   // anywhere in the 32-bit space
+	clustered, // tight clumps around a few hundred centres
+	runs,      // long stretches of consecutive values with gaps in between
+	zipf,      // power law, dense near zero and thinning out towards the top
+};
+
+// n distinct values, sorted
+static auto make_values(int dist, size_t n, uint64_t seed) -> std::vector<uint32_t>
+{
+	std::mt19937_64 rng(seed);
+	std::set<uint32_t> values;
+	std::vector<uint32_t> centres(256);
+	for (auto &c : centres)
+	{
+		c = rng();
+	}
+	std::geometric_distribution<uint32_t> spread(1.0 / 4096);
+	std::uniform_real_distribution<double> unit(0.0, 1.0);
+	while (values.size() < n)
+	{
+		switch (dist)
+		{
+		case uniform:
+			values.insert(rng());
+			break;
+		case clustered:
+			values.insert(centres[rng() % centres.size()] + spread(rng));
+			break;
+		case runs:
+		{
+			uint32_t start = rng();
+			uint32_t len = 1 + rng() % 2000;
+			for (uint32_t i = 0; i < len && values.size() < n; i++)
+			{
+				values.insert(start + i);
+			}
+			break;
+		}
+		case zipf:
+		{
+			// pareto with alpha = 0.1, clamped to the 32-bit space. a heavier tail than that and
+			// the million-value sets need billions of draws to find enough distinct values
+			double x = std::pow(1.0 - unit(rng), -10.0);
+			values.insert(static_cast<uint32_t>(std::min(x, 4294967295.0)));
+			break;
+		}
+		}
+	}
+	return std::vector<uint32_t>(values.begin(), values.end());
+}
+
+// generating the big sets dwarfs the benchmarks themselves, so every set is built once
+static auto dataset(int dist, size_t n, uint64_t seed) -> std::vector<uint32_t> const &
+{
+	static std::map<std::tuple<int, size_t, uint64_t>, std::vector<uint32_t>> cache;
+	auto key = std::make_tuple(dist, n, seed);
+	auto itr = cache.find(key);
+	if (itr == cache.end())
+	{
+		itr = cache.emplace(key, make_values(dist, n, seed)).first;
+	}
+	return itr->second;
+}
+
+// values in a random order, so nothing gets the sorted fast path for free
+static auto shuffled(std::vector<uint32_t> values) -> std::vector<uint32_t>
+{
+	std::shuffle(values.begin(), values.end(), std::mt19937_64(7));
+	return values;
+}
+
+// half of the probes are members, the other half random values
+static auto probes(std::vector<uint32_t> const &values) -> std::vector<uint32_t>
+{
+	std::mt19937_64 rng(11);
+	std::vector<uint32_t> result(1 << 16);
+	for (auto &p : result)
+	{
+		p = rng() % 2 ? values[rng() % values.size()] : static_cast<uint32_t>(rng());
+	}
+	return result;
+}
+
+// one adapter per implementation, all with the same shape so every benchmark is a template
+struct barking
+{
+	static constexpr char const *name = "BarkingBitmap";
+	BarkingBitmap s;
+	void add(uint32_t v) { s.add(v); }
+	bool contains(uint32_t v) const { return s.contains(v); }
+	static size_t intersect(barking const &a, barking const &b)
+	{
+		BarkingBitmap result = a.s;
+		result.intersect(b.s);
+		return result.cardinality();
+	}
+	static size_t unite(barking const &a, barking const &b)
+	{
+		BarkingBitmap result = a.s;
+		result.unite(b.s);
+		return result.cardinality();
+	}
+	uint64_t sum() const
+	{
+		uint64_t result = 0;
+		s.forEach([&result](uint32_t v)
+				  { result += v; });
+		return result;
+	}
+	size_t serialize(std::vector<std::byte> &out) const
+	{
+		out.resize(s.serializedSize());
+		return s.serialize(out);
+	}
+	static barking deserialize(std::vector<std::byte> const &in) { return barking{BarkingBitmap::deserialize(in)}; }
+	void optimize() { s.runOptimize(); }
+};
+
+struct ordered_set
+{
+	static constexpr char const *name = "std::set";
+	std::set<uint32_t> s;
+	void add(uint32_t v) { s.insert(v); }
+	bool contains(uint32_t v) const { return s.count(v); }
+	static size_t intersect(ordered_set const &a, ordered_set const &b)
+	{
+		std::set<uint32_t> result;
+		std::set_intersection(a.s.begin(), a.s.end(), b.s.begin(), b.s.end(), std::inserter(result, result.end()));
+		return result.size();
+	}
+	static size_t unite(ordered_set const &a, ordered_set const &b)
+	{
+		std::set<uint32_t> result;
+		std::set_union(a.s.begin(), a.s.end(), b.s.begin(), b.s.end(), std::inserter(result, result.end()));
+		return result.size();
+	}
+	uint64_t sum() const
+	{
+		uint64_t result = 0;
+		for (auto const &v : s)
+		{
+			result += v;
+		}
+		return result;
+	}
+	void optimize() {}
+};
+
+struct hash_set
+{
+	static constexpr char const *name = "std::unordered_set";
+	std::unordered_set<uint32_t> s;
+	void add(uint32_t v) { s.insert(v); }
+	bool contains(uint32_t v) const { return s.count(v); }
+	static size_t intersect(hash_set const &a, hash_set const &b)
+	{
+		std::unordered_set<uint32_t> result;
+		for (auto const &v : a.s)
+		{
+			if (b.s.count(v))
+			{
+				result.insert(v);
+			}
+		}
+		return result.size();
+	}
+	static size_t unite(hash_set const &a, hash_set const &b)
+	{
+		std::unordered_set<uint32_t> result = a.s;
+		result.insert(b.s.begin(), b.s.end());
+		return result.size();
+	}
+	// unordered, only here to show the cost of walking the nodes
+	uint64_t sum() const
+	{
+		uint64_t result = 0;
+		for (auto const &v : s)
+		{
+			result += v;
+		}
+		return result;
+	}
+	void optimize() {}
+};
+
+#ifdef BB_BENCH_CROARING
+struct croaring
+{
+	static constexpr char const *name = "CRoaring";
+	roaring_bitmap_t *s = roaring_bitmap_create();
+	croaring() = default;
+	croaring(croaring const &) = delete;
+	croaring(croaring &&other) noexcept : s(std::exchange(other.s, nullptr)) {}
+	~croaring()
+	{
+		if (s)
+		{
+			roaring_bitmap_free(s);
+		}
+	}
+	void add(uint32_t v) { roaring_bitmap_add(s, v); }
+	bool contains(uint32_t v) const { return roaring_bitmap_contains(s, v); }
+	static size_t intersect(croaring const &a, croaring const &b)
+	{
+		roaring_bitmap_t *result = roaring_bitmap_and(a.s, b.s);
+		size_t card = roaring_bitmap_get_cardinality(result);
+		roaring_bitmap_free(result);
+		return card;
+	}
+	static size_t unite(croaring const &a, croaring const &b)
+	{
+		roaring_bitmap_t *result = roaring_bitmap_or(a.s, b.s);
+		size_t card = roaring_bitmap_get_cardinality(result);
+		roaring_bitmap_free(result);
+		return card;
+	}
+	uint64_t sum() const
+	{
+		uint64_t result = 0;
+		roaring_iterate(s, [](uint32_t v, void *acc)
+						{ *static_cast<uint64_t *>(acc) += v; return true; },
+						&result);
+		return result;
+	}
+	size_t serialize(std::vector<std::byte> &out) const
+	{
+		out.resize(roaring_bitmap_portable_size_in_bytes(s));
+		return roaring_bitmap_portable_serialize(s, reinterpret_cast<char *>(out.data()));
+	}
+	static croaring deserialize(std::vector<std::byte> const &in)
+	{
+		croaring result;
+		roaring_bitmap_free(result.s);
+		result.s = roaring_bitmap_portable_deserialize_safe(reinterpret_cast<char const *>(in.data()), in.size());
+		return result;
+	}
+	void optimize() { roaring_bitmap_run_optimize(s); }
+};
+#endif
+
+template <class S>
+static auto build(std::vector<uint32_t> const &values) -> S
+{
+	S result;
+	for (auto const &v : values)
+	{
+		result.add(v);
+	}
+	result.optimize();
+	return result;
+}
+
+template <class S>
+static void label(benchmark::State &state)
+{
+	static char const *names[] = {"uniform", "clustered", "runs", "zipf"};
+	state.SetLabel(std::string(S::name) + "/" + names[state.range(0)]);
+}
+
+// every benchmark takes {distribution, number of values}
+template <class S>
+static void BM_add(benchmark::State &state)
+{
+	auto values = shuffled(dataset(state.range(0), state.range(1), 1));
+	for (auto _ : state)
+	{
+		S s;
+		for (auto const &v : values)
+		{
+			s.add(v);
+		}
+		benchmark::DoNotOptimize(s);
+	}
+	state.SetItemsProcessed(state.iterations() * values.size());
+	label<S>(state);
+}
+
+template <class S>
+static void BM_contains(benchmark::State &state)
+{
+	auto const &values = dataset(state.range(0), state.range(1), 1);
+	S s = build<S>(values);
+	auto queries = probes(values);
+	for (auto _ : state)
+	{
+		size_t hits = 0;
+		for (auto const &q : queries)
+		{
+			hits += s.contains(q);
+		}
+		benchmark::DoNotOptimize(hits);
+	}
+	state.SetItemsProcessed(state.iterations() * queries.size());
+	label<S>(state);
+}
+
+template <class S>
+static void BM_intersect(benchmark::State &state)
+{
+	S a = build<S>(dataset(state.range(0), state.range(1), 1));
+	S b = build<S>(dataset(state.range(0), state.range(1), 2));
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(S::intersect(a, b));
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(1) * 2);
+	label<S>(state);
+}
+
+template <class S>
+static void BM_unite(benchmark::State &state)
+{
+	S a = build<S>(dataset(state.range(0), state.range(1), 1));
+	S b = build<S>(dataset(state.range(0), state.range(1), 2));
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(S::unite(a, b));
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(1) * 2);
+	label<S>(state);
+}
+
+template <class S>
+static void BM_iterate(benchmark::State &state)
+{
+	S s = build<S>(dataset(state.range(0), state.range(1), 1));
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(s.sum());
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(1));
+	label<S>(state);
+}
+
+// round trip through the portable format, only the bitmaps have one
+template <class S>
+static void BM_serialize(benchmark::State &state)
+{
+	S s = build<S>(dataset(state.range(0), state.range(1), 1));
+	std::vector<std::byte> buf;
+	for (auto _ : state)
+	{
+		size_t n = s.serialize(buf);
+		benchmark::DoNotOptimize(S::deserialize(buf));
+		benchmark::DoNotOptimize(n);
+	}
+	state.counters["serialized_bytes_per_value"] = static_cast<double>(buf.size()) / state.range(1);
+	state.SetItemsProcessed(state.iterations() * state.range(1));
+	label<S>(state);
+}
+
+// heap bytes held per value once the set is built, reported as a counter rather than a time. CRoaring
+// is counted the same way, through its memory hooks
+template <class S>
+static void BM_memory(benchmark::State &state)
+{
+	auto const &values = dataset(state.range(0), state.range(1), 1);
+	double bytes = 0;
+	for (auto _ : state)
+	{
+		int64_t before = live_bytes;
+		S s = build<S>(values);
+		bytes = static_cast<double>(live_bytes - before);
+		benchmark::DoNotOptimize(s);
+	}
+	state.counters["bytes_per_value"] = bytes / values.size();
+	label<S>(state);
+}
+
+static void sizes(benchmark::internal::Benchmark *b)
+{
+	b->ArgNames({"dist", "n"})->ArgsProduct({{uniform, clustered, runs, zipf}, {1 << 16, 1 << 20}})->Unit(benchmark::kMicrosecond);
+}
+
+#define BB_BENCH_ALL(S)                               \
+	BENCHMARK_TEMPLATE(BM_add, S)->Apply(sizes);      \
+	BENCHMARK_TEMPLATE(BM_contains, S)->Apply(sizes); \
+	BENCHMARK_TEMPLATE(BM_intersect, S)->Apply(sizes); \
+	BENCHMARK_TEMPLATE(BM_unite, S)->Apply(sizes);    \
+	BENCHMARK_TEMPLATE(BM_iterate, S)->Apply(sizes);  \
+	BENCHMARK_TEMPLATE(BM_memory, S)->Apply(sizes)->Iterations(1);
+
+BB_BENCH_ALL(barking);
+BENCHMARK_TEMPLATE(BM_serialize, barking)->Apply(sizes);
+BB_BENCH_ALL(ordered_set);
+BB_BENCH_ALL(hash_set);
+#ifdef BB_BENCH_CROARING
+BB_BENCH_ALL(croaring);
+BENCHMARK_TEMPLATE(BM_serialize, croaring)->Apply(sizes);
+#endif
+
+BENCHMARK_MAIN();
@@ -1,6 +1,96 @@
 #include "barking_bitmap.hpp"
+#include "barking_bitmap64.hpp"
+#include "barking_concurrent.hpp"
+#include "barking_stream.hpp"
 #include <random>
+#include <set>
+#include <thread>
 #include <gtest/gtest.h>
+#include <new>
+#include <sstream>
+
+// counts every trip to the global allocator, so tests can check a code path stays off it
+static std::atomic<size_t> allocations{0};
+
+void *operator new(size_t size)
+{
+	allocations++;
+	if (void *result = std::malloc(size ? size : 1))
+	{
+		return result;
+	}
+	throw std::bad_alloc();
+}
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+// bitset words are over-aligned and come through here
+void *operator new(size_t size, std::align_val_t align)
+{
+	allocations++;
+	size_t a = static_cast<size_t>(align);
+	if (void *result = std::aligned_alloc(a, (size + a - 1) / a * a))
+	{
+		return result;
+	}
+	throw std::bad_alloc();
+}
+void operator delete(void *ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept { std::free(ptr); }
+
+// every value held by a single bucket, in order
+static auto bucket_values(BBData const &d) -> std::vector<uint16_t>
+{
+	std::vector<uint16_t> result;
+	for (int i = 0; i < BB_BSET_SZ; i++)
+	{
+		if (d.contains(i))
+		{
+			result.push_back(i);
+		}
+	}
+	return result;
+}
+
+// build a bucket holding values, encoded as an array, bitset or run
+static auto make_bucket(std::set<uint16_t> const &values, size_t kind) -> BBData
+{
+	bb_array array(values.begin(), values.end());
+	switch (kind)
+	{
+	case 0:
+		return BBData(array);
+	case 1:
+		return BBData(convert_array_to_bset(array));
+	default:
+		return BBData(convert_array_to_run(array));
+	}
+}
+
+// a policy that turns chunks into bitsets early and sends the index through a counting allocator
+static std::atomic<size_t> policy_allocations{0};
+
+template <typename T>
+struct counting_allocator
+{
+	using value_type = T;
+	counting_allocator() = default;
+	template <typename U>
+	counting_allocator(counting_allocator<U> const &){};
+	T *allocate(size_t n)
+	{
+		policy_allocations++;
+		return std::allocator<T>{}.allocate(n);
+	}
+	void deallocate(T *p, size_t n) { std::allocator<T>{}.deallocate(p, n); }
+	bool operator==(counting_allocator const &) const = default;
+};
+
+struct dense_policy : bb_default_policy
+{
+	static constexpr size_t array_threshold = 64;
+	template <typename T>
+	using allocator = counting_allocator<T>;
+};
 
 class BarkingBitmapTests : public testing::Test
 {
@@ -37,6 +127,1486 @@ TEST_F(BarkingBitmapTests, TestInitialization)
 	}
 }
 
+TEST_F(BarkingBitmapTests, TestRunContainerAddRemove)
+{
+	BBData d(bb_run{});
+	std::set<uint16_t> expected;
+	std::uniform_int_distribution<int> dist(0, 300);
+	for (int i = 0; i < 2000; ++i)
+	{
+		uint16_t v = dist(rng);
+		if (i % 3 == 0)
+		{
+			d.remove(v);
+			expected.erase(v);
+		}
+		else
+		{
+			d.add(v);
+			expected.insert(v);
+		}
+	}
+	ASSERT_TRUE(std::holds_alternative<bb_run>(d.data));
+	EXPECT_EQ(bucket_values(d), std::vector<uint16_t>(expected.begin(), expected.end()));
+	EXPECT_EQ(d.sz, expected.size());
+
+	d = BBData(bb_run{});
+	d.add(65535);
+	d.add(65534);
+	d.add(0);
+	EXPECT_TRUE(d.contains(65535));
+	EXPECT_TRUE(d.contains(0));
+	EXPECT_EQ(std::get<bb_run>(d.data).size(), 2);
+}
+
+TEST_F(BarkingBitmapTests, TestRunOptimize)
+{
+	for (uint32_t i = 100000; i < 400000; ++i)
+	{
+		bm.add(i);
+	}
+	bm.add(7);
+	EXPECT_TRUE(bm.runOptimize());
+	for (uint32_t i = 100000; i < 400000; ++i)
+	{
+		ASSERT_TRUE(bm.contains(i));
+	}
+	EXPECT_TRUE(bm.contains(7));
+	EXPECT_FALSE(bm.contains(99999));
+	EXPECT_FALSE(bm.contains(400000));
+
+	// a scattered bucket goes back to an array
+	BBData d(bb_run{{1, 1}, {3, 3}, {5, 5}});
+	EXPECT_FALSE(d.runOptimize());
+	EXPECT_TRUE(std::holds_alternative<bb_array>(d.data));
+}
+
+TEST_F(BarkingBitmapTests, TestContainerPairings)
+{
+	// sparse values, a dense random chunk and a few long runs
+	std::set<uint16_t> sources[3];
+	std::uniform_int_distribution<int> dist(0, 65535);
+	for (int i = 0; i < 500; ++i)
+	{
+		sources[0].insert(dist(rng));
+	}
+	for (int i = 0; i < 20000; ++i)
+	{
+		sources[1].insert(dist(rng));
+	}
+	for (int start = 1000; start < 60000; start += 7000)
+	{
+		for (int i = start; i < start + 3000; ++i)
+		{
+			sources[2].insert(i);
+		}
+	}
+	for (auto const &lhs : sources)
+	{
+		for (auto const &rhs : sources)
+		{
+			std::vector<uint16_t> both, either;
+			std::set_intersection(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), std::back_inserter(both));
+			std::set_union(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), std::back_inserter(either));
+			for (size_t k1 = 0; k1 < 3; ++k1)
+			{
+				for (size_t k2 = 0; k2 < 3; ++k2)
+				{
+					BBData a = make_bucket(lhs, k1);
+					a.intersect(make_bucket(rhs, k2));
+					EXPECT_EQ(bucket_values(a), both) << "intersect " << k1 << " " << k2;
+					EXPECT_EQ(a.sz, both.size());
+					BBData b = make_bucket(lhs, k1);
+					b.unite(make_bucket(rhs, k2));
+					EXPECT_EQ(bucket_values(b), either) << "unite " << k1 << " " << k2;
+					EXPECT_EQ(b.sz, either.size());
+				}
+			}
+		}
+	}
+}
+
+TEST_F(BarkingBitmapTests, TestSparseBuckets)
+{
+	// lots of tiny bitmaps should be cheap to keep around
+	std::vector<BarkingBitmap> many(100000);
+	for (uint32_t i = 0; i < many.size(); ++i)
+	{
+		many[i].add(i * 40000);
+	}
+	EXPECT_LE(sizeof(BarkingBitmap), 3 * sizeof(std::vector<uint64_t>) + sizeof(bb_pool));
+
+	bm.add(5);
+	bm.add(70000);
+	EXPECT_FALSE(bm.empty());
+	bm.remove(5);
+	bm.remove(70000);
+	bm.remove(123456);
+	EXPECT_TRUE(bm.empty());
+	EXPECT_FALSE(bm.contains(5));
+}
+
+TEST_F(BarkingBitmapTests, TestIntersectUnite)
+{
+	// few values per bucket spread over a handful of keys so both sides overlap partially
+	std::uniform_int_distribution<uint32_t> dist(0, 12 << 16);
+	std::set<uint32_t> a, b;
+	BarkingBitmap other;
+	for (int i = 0; i < 20000; ++i)
+	{
+		uint32_t x = dist(rng);
+		uint32_t y = dist(rng) + (4 << 16);
+		a.insert(x);
+		b.insert(y);
+		bm.add(x);
+		other.add(y);
+	}
+	std::set<uint32_t> both, either;
+	std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::inserter(both, both.end()));
+	std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::inserter(either, either.end()));
+
+	BarkingBitmap inter = bm;
+	inter.intersect(other);
+	BarkingBitmap uni = bm;
+	uni.unite(other);
+	for (uint32_t v = 0; v < (17 << 16); ++v)
+	{
+		ASSERT_EQ(inter.contains(v), both.count(v) == 1) << v;
+		ASSERT_EQ(uni.contains(v), either.count(v) == 1) << v;
+	}
+
+	BarkingBitmap disjoint;
+	disjoint.add(100u << 16);
+	inter.intersect(disjoint);
+	EXPECT_TRUE(inter.empty());
+}
+
+TEST_F(BarkingBitmapTests, TestArrayKernels)
+{
+	// random sizes straddle the 8 lane blocks and the galloping ratio
+	std::uniform_int_distribution<int> value_dist(0, 65535);
+	std::uniform_int_distribution<int> size_dist(0, 3000);
+	for (int round = 0; round < 200; ++round)
+	{
+		std::set<uint16_t> sa, sb;
+		int na = round % 10 == 0 ? 5 : size_dist(rng);
+		int nb = size_dist(rng);
+		for (int i = 0; i < na; ++i)
+		{
+			sa.insert(value_dist(rng) % (round % 2 ? 4096 : 65536));
+		}
+		for (int i = 0; i < nb; ++i)
+		{
+			sb.insert(value_dist(rng) % (round % 2 ? 4096 : 65536));
+		}
+		bb_array a(sa.begin(), sa.end()), b(sb.begin(), sb.end());
+		bb_array expected(a.size() + b.size()), actual(a.size() + b.size() + BB_SIMD_SLACK);
+
+		expected.resize(bb_scalar_intersect(a.data(), a.size(), b.data(), b.size(), expected.data()));
+		actual.resize(bb_intersect_u16(a.data(), a.size(), b.data(), b.size(), actual.data()));
+		EXPECT_EQ(actual, expected) << "intersect " << round;
+		actual.resize(a.size() + b.size() + BB_SIMD_SLACK);
+		actual.resize(bb_galloping_intersect(a.data(), a.size(), b.data(), b.size(), actual.data()));
+		EXPECT_EQ(actual, expected) << "galloping " << round;
+		EXPECT_EQ(bb_intersect_count_u16(a.data(), a.size(), b.data(), b.size()), expected.size()) << "count " << round;
+		EXPECT_EQ(bb_scalar_intersect_count(a.data(), a.size(), b.data(), b.size()), expected.size()) << "count " << round;
+		EXPECT_EQ(bb_galloping_intersect_count(a.data(), a.size(), b.data(), b.size()), expected.size()) << "count " << round;
+
+		expected.resize(a.size() + b.size());
+		expected.resize(bb_scalar_union(a.data(), a.size(), b.data(), b.size(), expected.data()));
+		actual.resize(a.size() + b.size() + BB_SIMD_SLACK);
+		actual.resize(bb_union_u16(a.data(), a.size(), b.data(), b.size(), actual.data()));
+		EXPECT_EQ(actual, expected) << "union " << round;
+
+		expected.resize(a.size() + b.size());
+		expected.resize(bb_scalar_difference(a.data(), a.size(), b.data(), b.size(), expected.data()));
+		actual.resize(a.size() + b.size() + BB_SIMD_SLACK);
+		actual.resize(bb_difference_u16(a.data(), a.size(), b.data(), b.size(), actual.data()));
+		EXPECT_EQ(actual, expected) << "difference " << round;
+	}
+}
+
+TEST_F(BarkingBitmapTests, TestWordKernels)
+{
+	std::vector<uint64_t> a(1024), b(1024);
+	for (size_t i = 0; i < a.size(); ++i)
+	{
+		a[i] = rng();
+		b[i] = rng();
+	}
+	std::vector<uint64_t> expected = a, actual = a;
+	bb_scalar_and_words(expected.data(), b.data(), b.size());
+	bb_and_words(actual.data(), b.data(), b.size());
+	EXPECT_EQ(actual, expected);
+	EXPECT_EQ(bb_popcount_words(actual.data(), actual.size()), bb_scalar_popcount_words(expected.data(), expected.size()));
+
+	expected = a;
+	actual = a;
+	bb_scalar_or_words(expected.data(), b.data(), b.size());
+	bb_or_words(actual.data(), b.data(), b.size());
+	EXPECT_EQ(actual, expected);
+	EXPECT_EQ(bb_popcount_words(actual.data(), 1023), bb_scalar_popcount_words(expected.data(), 1023));
+}
+
+TEST_F(BarkingBitmapTests, TestSerializationRoundTrip)
+{
+	// one bucket of each kind: sparse array, dense bitset, runs
+	std::set<uint32_t> expected;
+	std::uniform_int_distribution<uint32_t> dist(0, 65535);
+	for (int i = 0; i < 300; ++i)
+	{
+		expected.insert(dist(rng));
+	}
+	for (int i = 0; i < 30000; ++i)
+	{
+		expected.insert((3u << 16) + dist(rng));
+	}
+	for (uint32_t i = (9u << 16) + 17; i < (11u << 16) + 5; ++i)
+	{
+		expected.insert(i);
+	}
+	for (uint32_t v : expected)
+	{
+		bm.add(v);
+	}
+
+	for (bool runs : {false, true})
+	{
+		if (runs)
+		{
+			ASSERT_TRUE(bm.runOptimize());
+		}
+		std::vector<std::byte> bytes = bm.serialize();
+		EXPECT_EQ(bytes.size(), bm.serializedSize());
+		uint32_t cookie;
+		std::memcpy(&cookie, bytes.data(), 4);
+		EXPECT_EQ(cookie & 0xFFFF, runs ? BB_SERIAL_COOKIE : BB_SERIAL_COOKIE_NO_RUN);
+
+		// shift the frozen view by one byte so nothing in it is aligned
+		std::vector<std::byte> shifted(bytes.size() + 1);
+		std::memcpy(shifted.data() + 1, bytes.data(), bytes.size());
+		FrozenBarkingBitmap frozen(std::span<std::byte const>(shifted).subspan(1));
+		BarkingBitmap thawed = BarkingBitmap::deserialize(bytes);
+		EXPECT_EQ(frozen.cardinality(), expected.size());
+		EXPECT_EQ(frozen.serializedSize(), bytes.size());
+		for (uint32_t v = 0; v < (12u << 16); ++v)
+		{
+			bool want = expected.count(v) == 1;
+			ASSERT_EQ(frozen.contains(v), want) << v;
+			ASSERT_EQ(thawed.contains(v), want) << v;
+		}
+		EXPECT_EQ(frozen.thaw().serialize(), bytes);
+	}
+
+	BarkingBitmap empty;
+	EXPECT_TRUE(BarkingBitmap::deserialize(empty.serialize()).empty());
+	EXPECT_TRUE(FrozenBarkingBitmap(empty.serialize()).empty());
+}
+
+TEST_F(BarkingBitmapTests, TestSerializationSpecBuffers)
+{
+	auto bytes = [](std::initializer_list<int> values)
+	{
+		std::vector<std::byte> result;
+		for (int v : values)
+		{
+			result.push_back(std::byte(v));
+		}
+		return result;
+	};
+	// no runs: cookie 12346, 1 container, key 0 holding {1, 2, 3} at offset 16
+	auto array_buf = bytes({0x3A, 0x30, 0, 0, 1, 0, 0, 0, 0, 0, 2, 0, 16, 0, 0, 0, 1, 0, 2, 0, 3, 0});
+	BarkingBitmap array_bm = BarkingBitmap::deserialize(array_buf);
+	EXPECT_TRUE(array_bm.contains(1) && array_bm.contains(2) && array_bm.contains(3));
+	EXPECT_FALSE(array_bm.contains(4));
+	EXPECT_EQ(array_bm.serialize(), array_buf);
+
+	// runs: cookie 12347 with 1 container, run flags, key 1 holding 10 values from 5, no offset header
+	auto run_buf = bytes({0x3B, 0x30, 0, 0, 1, 1, 0, 9, 0, 1, 0, 5, 0, 9, 0});
+	FrozenBarkingBitmap frozen(run_buf);
+	EXPECT_EQ(frozen.cardinality(), 10);
+	EXPECT_FALSE(frozen.contains(65536 + 4));
+	EXPECT_TRUE(frozen.contains(65536 + 5));
+	EXPECT_TRUE(frozen.contains(65536 + 14));
+	EXPECT_FALSE(frozen.contains(65536 + 15));
+	EXPECT_EQ(frozen.thaw().serialize(), run_buf);
+
+	EXPECT_THROW(FrozenBarkingBitmap(bytes({0x3A, 0x30, 0})), std::runtime_error);
+	EXPECT_THROW(FrozenBarkingBitmap(bytes({1, 2, 3, 4, 5, 6, 7, 8})), std::runtime_error);
+	array_buf.pop_back();
+	EXPECT_THROW(BarkingBitmap::deserialize(array_buf), std::runtime_error);
+
+	// containers whose contents disagree with the header are rejected by every reader
+	auto rejected = [](std::vector<std::byte> const &buf)
+	{
+		EXPECT_THROW(BarkingBitmap::deserialize(buf), std::runtime_error);
+		EXPECT_THROW(FrozenBarkingBitmap{buf}, std::runtime_error);
+		std::ostringstream out;
+		EXPECT_THROW(BarkingBitmapWriter::resume(buf, out), std::runtime_error);
+	};
+	// runs: past 65535, overlapping, out of order, and lengths that don't add up to the cardinality
+	rejected(bytes({0x3B, 0x30, 0, 0, 1, 1, 0, 9, 0, 1, 0, 0xFA, 0xFF, 9, 0}));
+	rejected(bytes({0x3B, 0x30, 0, 0, 1, 1, 0, 19, 0, 2, 0, 5, 0, 9, 0, 10, 0, 9, 0}));
+	rejected(bytes({0x3B, 0x30, 0, 0, 1, 1, 0, 19, 0, 2, 0, 20, 0, 9, 0, 5, 0, 9, 0}));
+	rejected(bytes({0x3B, 0x30, 0, 0, 1, 1, 0, 10, 0, 1, 0, 5, 0, 9, 0}));
+	// arrays: out of order, and a duplicate
+	rejected(bytes({0x3A, 0x30, 0, 0, 1, 0, 0, 0, 0, 0, 2, 0, 16, 0, 0, 0, 3, 0, 1, 0, 2, 0}));
+	rejected(bytes({0x3A, 0x30, 0, 0, 1, 0, 0, 0, 0, 0, 2, 0, 16, 0, 0, 0, 1, 0, 1, 0, 2, 0}));
+	// bitsets: claiming 5000 values but holding none, or only 4097
+	auto bset_buf = bytes({0x3A, 0x30, 0, 0, 1, 0, 0, 0, 0, 0, 0x87, 0x13, 16, 0, 0, 0});
+	bset_buf.resize(bset_buf.size() + 8192);
+	rejected(bset_buf);
+	std::fill(bset_buf.begin() + 16, bset_buf.begin() + 16 + 512, std::byte(0xFF));
+	bset_buf[16 + 512] = std::byte(1);
+	rejected(bset_buf);
+	// the same bitset holding exactly 5000 is fine
+	std::fill(bset_buf.begin() + 16 + 512, bset_buf.begin() + 16 + 625, std::byte(0xFF));
+	EXPECT_EQ(BarkingBitmap::deserialize(bset_buf).cardinality(), 5000);
+}
+
+TEST_F(BarkingBitmapTests, TestAddMany)
+{
+	std::set<uint32_t> expected;
+	std::uniform_int_distribution<uint32_t> dist(0, 20u << 16);
+	std::vector<uint32_t> batch;
+	for (int i = 0; i < 200000; ++i)
+	{
+		batch.push_back(dist(rng));
+	}
+	// unsorted & duplicated into an empty bitmap, then sorted on top of existing buckets
+	bm.addMany(batch);
+	expected.insert(batch.begin(), batch.end());
+	batch.clear();
+	for (uint32_t i = 0; i < 30000; ++i)
+	{
+		batch.push_back(i * 37);
+	}
+	bm.addMany(batch);
+	expected.insert(batch.begin(), batch.end());
+	bm.addMany({});
+
+	for (uint32_t v = 0; v < (21u << 16); ++v)
+	{
+		ASSERT_EQ(bm.contains(v), expected.count(v) == 1) << v;
+	}
+
+	// arrays stay sorted and switch over at the threshold
+	BBData d;
+	std::vector<uint16_t> lows;
+	for (uint16_t i = 0; i < BB_ARRAY_THRESHOLD - 1; ++i)
+	{
+		lows.push_back(i * 2);
+	}
+	d.addMany(lows.data(), lows.size());
+	ASSERT_TRUE(std::holds_alternative<bb_array>(d.data));
+	EXPECT_TRUE(std::is_sorted(std::get<bb_array>(d.data).begin(), std::get<bb_array>(d.data).end()));
+	uint16_t more[] = {1, 3};
+	d.addMany(more, 2);
+	EXPECT_TRUE(std::holds_alternative<bb_bset>(d.data));
+	EXPECT_TRUE(d.contains(3) && d.contains(2 * (BB_ARRAY_THRESHOLD - 2)));
+}
+
+TEST_F(BarkingBitmapTests, TestAddRange)
+{
+	bm.add(5);
+	bm.add(3u << 16);
+	bm.addRange(70000, 300000);
+	bm.addRange(10, 9);
+	bm.addRange(0xFFFFFFF0u, 0xFFFFFFFFu);
+	for (uint32_t v = 0; v < 400000; ++v)
+	{
+		bool want = v == 5 || (v >= 70000 && v <= 300000);
+		ASSERT_EQ(bm.contains(v), want) << v;
+	}
+	EXPECT_TRUE(bm.contains(0xFFFFFFFFu));
+	EXPECT_TRUE(bm.contains(0xFFFFFFF0u));
+	EXPECT_FALSE(bm.contains(0xFFFFFFEFu));
+}
+
+TEST_F(BarkingBitmapTests, TestContainsMany)
+{
+	bm.addRange(1000, 200000);
+	bm.add(1u << 30);
+	std::vector<uint32_t> probes;
+	std::uniform_int_distribution<uint32_t> dist(0, 300000);
+	for (int i = 0; i < 5000; ++i)
+	{
+		probes.push_back(dist(rng));
+	}
+	probes.push_back(1u << 30);
+	std::unique_ptr<bool[]> out(new bool[probes.size()]);
+	bm.containsMany(probes, std::span<bool>(out.get(), probes.size()));
+	for (size_t i = 0; i < probes.size(); ++i)
+	{
+		EXPECT_EQ(out[i], bm.contains(probes[i])) << probes[i];
+	}
+	EXPECT_THROW(bm.containsMany(probes, std::span<bool>(out.get(), 1)), std::length_error);
+}
+
+TEST_F(BarkingBitmapTests, TestCardinality)
+{
+	std::set<uint32_t> expected;
+	std::uniform_int_distribution<uint32_t> dist(0, 6u << 16);
+	for (int i = 0; i < 50000; ++i)
+	{
+		uint32_t v = dist(rng);
+		if (i % 4 == 0)
+		{
+			bm.remove(v);
+			expected.erase(v);
+		}
+		else
+		{
+			bm.add(v);
+			expected.insert(v);
+		}
+		ASSERT_EQ(bm.cardinality(), expected.size());
+	}
+	bm.addRange(1u << 20, (1u << 20) + 99999);
+	bm.runOptimize();
+	EXPECT_EQ(bm.cardinality(), expected.size() + 100000);
+	EXPECT_FALSE(BarkingBitmap().minimum().has_value());
+	EXPECT_FALSE(BarkingBitmap().select(0).has_value());
+}
+
+TEST_F(BarkingBitmapTests, TestRankSelect)
+{
+	// arrays, a bitset and runs
+	std::set<uint32_t> values;
+	std::uniform_int_distribution<uint32_t> dist(0, 65535);
+	for (int i = 0; i < 40000; ++i)
+	{
+		values.insert((2u << 16) + dist(rng));
+	}
+	for (int i = 0; i < 100; ++i)
+	{
+		values.insert((7u << 16) + dist(rng));
+	}
+	for (uint32_t i = (9u << 16) + 10; i < (9u << 16) + 30000; i += 3)
+	{
+		values.insert(i);
+	}
+	for (uint32_t v : values)
+	{
+		bm.add(v);
+	}
+	bm.addRange(11u << 16, (11u << 16) + 5000);
+	for (uint32_t i = (11u << 16); i <= (11u << 16) + 5000; ++i)
+	{
+		values.insert(i);
+	}
+	bm.runOptimize();
+
+	EXPECT_EQ(bm.minimum(), *values.begin());
+	EXPECT_EQ(bm.maximum(), *values.rbegin());
+	uint64_t rank = 0;
+	auto itr = values.begin();
+	for (uint32_t v = 0; v < (12u << 16); ++v)
+	{
+		if (itr != values.end() && *itr == v)
+		{
+			if (rank % 17 == 0 || v >> 16 != 2)
+			{
+				ASSERT_EQ(bm.select(rank), v);
+			}
+			rank++;
+			itr++;
+		}
+		if (v % 97 == 0 || bm.contains(v))
+		{
+			ASSERT_EQ(bm.rank(v), rank) << v;
+		}
+	}
+	EXPECT_FALSE(bm.select(rank).has_value());
+
+	// the index has to follow changes
+	bm.remove(*values.begin());
+	EXPECT_EQ(bm.select(0), *std::next(values.begin()));
+	EXPECT_EQ(bm.rank(0xFFFFFFFFu), values.size() - 1);
+}
+
+TEST_F(BarkingBitmapTests, TestFastUnionIntersect)
+{
+	// a mix of sparse, dense and run bitmaps that share a few keys
+	std::vector<BarkingBitmap> bitmaps(40);
+	std::uniform_int_distribution<uint32_t> dist(0, 8u << 16);
+	for (size_t b = 0; b < bitmaps.size(); ++b)
+	{
+		if (b % 3 == 0)
+		{
+			bitmaps[b].addRange(b * 1000, (4u << 16) + b * 1000);
+			bitmaps[b].runOptimize();
+		}
+		else
+		{
+			for (int i = 0; i < (b % 3 == 1 ? 500 : 120000); ++i)
+			{
+				bitmaps[b].add(b % 3 == 1 ? dist(rng) : dist(rng) % (2u << 16));
+			}
+		}
+	}
+	std::vector<BarkingBitmap const *> ptrs;
+	for (auto const &b : bitmaps)
+	{
+		ptrs.push_back(&b);
+	}
+	BarkingBitmap uni, inter = bitmaps[0];
+	for (auto const &b : bitmaps)
+	{
+		uni.unite(b);
+	}
+	// only the dense ones overlap enough for a non-empty intersection
+	std::vector<BarkingBitmap const *> dense;
+	for (size_t b = 2; b < bitmaps.size(); b += 3)
+	{
+		dense.push_back(&bitmaps[b]);
+		inter.intersect(bitmaps[b]);
+	}
+	dense.push_back(&bitmaps[0]);
+	BarkingBitmap fast_uni = BarkingBitmap::fastUnion(ptrs);
+	BarkingBitmap fast_inter = BarkingBitmap::fastIntersect(dense);
+	EXPECT_EQ(fast_uni.cardinality(), uni.cardinality());
+	EXPECT_EQ(fast_inter.cardinality(), inter.cardinality());
+	EXPECT_GT(fast_inter.cardinality(), 0);
+	for (uint32_t v = 0; v < (9u << 16); ++v)
+	{
+		ASSERT_EQ(fast_uni.contains(v), uni.contains(v)) << v;
+		ASSERT_EQ(fast_inter.contains(v), inter.contains(v)) << v;
+	}
+
+	BarkingBitmap empty;
+	ptrs.push_back(&empty);
+	EXPECT_TRUE(BarkingBitmap::fastIntersect(ptrs).empty());
+	EXPECT_TRUE(BarkingBitmap::fastUnion({}).empty());
+	EXPECT_TRUE(BarkingBitmap::fastIntersect({}).empty());
+}
+
+TEST_F(BarkingBitmapTests, TestParallelSetOperations)
+{
+	BarkingBitmap other;
+	std::uniform_int_distribution<uint32_t> dist(0, 600u << 16);
+	for (int i = 0; i < 300000; ++i)
+	{
+		bm.add(dist(rng));
+		other.add(dist(rng) / 2);
+	}
+	bm.addRange(5u << 16, 40u << 16);
+	other.addRange(30u << 16, 90u << 16);
+	bm.runOptimize();
+
+	for (size_t threads : {1, 4})
+	{
+		BarkingBitmap serial = bm, parallel = bm;
+		serial.intersect(other);
+		parallel.parallelIntersect(other, threads);
+		EXPECT_EQ(parallel.serialize(), serial.serialize());
+		serial = bm;
+		parallel = bm;
+		serial.unite(other);
+		parallel.parallelUnite(other, threads);
+		EXPECT_EQ(parallel.serialize(), serial.serialize());
+
+		// both sides the same bitmap
+		parallel = bm;
+		parallel.parallelUnite(parallel, threads);
+		EXPECT_EQ(parallel.serialize(), bm.serialize());
+		parallel.parallelIntersect(parallel, threads);
+		EXPECT_EQ(parallel.serialize(), bm.serialize());
+	}
+}
+
+TEST_F(BarkingBitmapTests, TestConcurrentReads)
+{
+	for (uint32_t i = 0; i < 200000; i += 3)
+	{
+		bm.add(i);
+	}
+	bm.buildRankIndex();
+	std::atomic<int> mismatches{0};
+	{
+		std::vector<std::jthread> readers;
+		for (int t = 0; t < 4; ++t)
+		{
+			readers.emplace_back([&, t]
+								 {
+				for (uint32_t i = t; i < 200000; i += 4)
+				{
+					if (bm.contains(i) != (i % 3 == 0) || bm.rank(i) != i / 3 + 1)
+					{
+						mismatches++;
+					}
+				} });
+		}
+	}
+	EXPECT_EQ(mismatches, 0);
+}
+
+TEST_F(BarkingBitmapTests, TestPooledSetOperations)
+{
+	// same keys everywhere: sparse & narrow are arrays, dense is bitsets
+	BarkingBitmap sparse, narrow, dense;
+	for (uint32_t key = 0; key < 16; key++)
+	{
+		for (uint32_t i = 0; i < 65536; i += 97)
+		{
+			sparse.add(key << 16 | i);
+		}
+		for (uint32_t i = 0; i < 65536; i += 5)
+		{
+			dense.add(key << 16 | i);
+		}
+		for (uint32_t i = 0; i < 65536; i += 1001)
+		{
+			narrow.add(key << 16 | i);
+		}
+	}
+	BarkingBitmap work = sparse;
+	size_t expected = 0;
+	size_t steady = 0;
+	for (int round = 0; round < 8; round++)
+	{
+		size_t before = allocations;
+		// array | bitset, bitset & array, array | array, array & array
+		work.unite(dense);
+		work.intersect(sparse);
+		work.unite(narrow);
+		work.intersect(sparse);
+		// the first rounds fill the pool, after that the buffers just move around
+		if (round >= 2)
+		{
+			steady += allocations - before;
+		}
+		if (round == 0)
+		{
+			expected = work.cardinality();
+		}
+		EXPECT_EQ(work.cardinality(), expected);
+	}
+	EXPECT_EQ(steady, 0u);
+	EXPECT_EQ(work.cardinality(), sparse.cardinality());
+
+	// bitset & bitset shrinking below the threshold comes back as an array
+	BarkingBitmap other;
+	for (uint32_t i = 0; i < 65536; i += 7)
+	{
+		other.add(i);
+	}
+	BarkingBitmap shrink = dense;
+	shrink.intersect(other);
+	for (uint32_t i = 0; i < 65536 * 2; i++)
+	{
+		ASSERT_EQ(shrink.contains(i), i < 65536 && i % 35 == 0) << i;
+	}
+	shrink.unite(dense);
+	EXPECT_EQ(shrink.cardinality(), dense.cardinality());
+}
+
+TEST_F(BarkingBitmapTests, TestIteration)
+{
+	// a sparse array bucket, a bitset bucket, a run bucket and a few lone values up high
+	std::set<uint32_t> expected;
+	for (int i = 0; i < 300; i++)
+	{
+		expected.insert(rng() % 65536);
+	}
+	for (int i = 0; i < 20000; i++)
+	{
+		expected.insert(3 << 16 | (rng() % 65536));
+	}
+	for (uint32_t i = (7 << 16) + 100; i < (7 << 16) + 30000; i++)
+	{
+		expected.insert(i);
+	}
+	expected.insert(0xFFFF0000);
+	expected.insert(0xFFFFFFFF);
+	for (auto const &i : expected)
+	{
+		bm.add(i);
+	}
+	bm.runOptimize();
+	std::vector<uint32_t> want(expected.begin(), expected.end());
+
+	std::vector<uint32_t> walked(bm.begin(), bm.end());
+	EXPECT_EQ(walked, want);
+
+	std::vector<uint32_t> visited;
+	bm.forEach([&visited](uint32_t v)
+			   { visited.push_back(v); });
+	EXPECT_EQ(visited, want);
+	size_t calls = 0;
+	bm.forEach([&calls](uint32_t)
+			   { return ++calls < 10; });
+	EXPECT_EQ(calls, 10u);
+
+	// seek & advanceIfNeeded against lower_bound, including targets in gaps and between buckets
+	for (int round = 0; round < 2000; round++)
+	{
+		uint32_t target = round % 2 ? rng() % (8 << 16) : rng();
+		auto want_itr = expected.lower_bound(target);
+		auto itr = bm.seek(target);
+		if (want_itr == expected.end())
+		{
+			EXPECT_TRUE(itr == bm.end());
+		}
+		else
+		{
+			ASSERT_FALSE(itr == bm.end());
+			EXPECT_EQ(*itr, *want_itr);
+		}
+	}
+	auto itr = bm.begin();
+	auto want_itr = expected.begin();
+	for (uint32_t target = 0; target < (8 << 16); target += 1 + rng() % 5000)
+	{
+		itr.advanceIfNeeded(target);
+		want_itr = expected.lower_bound(std::max(target, *want_itr));
+		ASSERT_EQ(*itr, *want_itr) << target;
+	}
+	itr.advanceIfNeeded(100);
+	EXPECT_EQ(*itr, *want_itr); // never moves backwards
+	itr.advanceIfNeeded(0xFFFFFFFF);
+	EXPECT_EQ(*itr, 0xFFFFFFFFu);
+	EXPECT_TRUE(++itr == bm.end());
+
+	// paged decode covers every value exactly once
+	std::vector<uint32_t> page(1000);
+	std::vector<uint32_t> decoded;
+	for (size_t offset = 0;; offset += page.size())
+	{
+		size_t n = bm.toUint32Array(page.data(), offset, page.size());
+		decoded.insert(decoded.end(), page.begin(), page.begin() + n);
+		if (n < page.size())
+		{
+			break;
+		}
+	}
+	EXPECT_EQ(decoded, want);
+	EXPECT_EQ(bm.toUint32Array(page.data(), want.size(), page.size()), 0u);
+	EXPECT_EQ(bm.toUint32Array(page.data(), 305, 7), 7u);
+	EXPECT_EQ(std::vector<uint32_t>(page.begin(), page.begin() + 7), std::vector<uint32_t>(want.begin() + 305, want.begin() + 312));
+
+	BarkingBitmap none;
+	EXPECT_TRUE(none.begin() == none.end());
+	EXPECT_TRUE(none.seek(5) == none.end());
+	EXPECT_EQ(none.toUint32Array(page.data(), 0, page.size()), 0u);
+}
+
+TEST_F(BarkingBitmapTests, TestBitmap64)
+{
+	// a handful of dense high keys plus values scattered over the whole 64-bit space
+	auto random_set = [this](std::set<uint64_t> &values)
+	{
+		for (int i = 0; i < 20000; i++)
+		{
+			uint64_t high = rng() % 4 == 0 ? rng() : (rng() % 3) * 0x123456789ULL;
+			values.insert((high & 0xFFFFFFFF00000000ULL) | (rng() % 200000));
+		}
+	};
+	std::set<uint64_t> a_values, b_values;
+	random_set(a_values);
+	random_set(b_values);
+	BarkingBitmap64 a, b;
+	for (auto const &i : a_values)
+	{
+		a.add(i);
+	}
+	std::vector<uint64_t> shuffled(b_values.begin(), b_values.end());
+	std::shuffle(shuffled.begin(), shuffled.end(), rng);
+	b.addMany(shuffled);
+	EXPECT_EQ(a.cardinality(), a_values.size());
+	EXPECT_EQ(b.cardinality(), b_values.size());
+	EXPECT_EQ(*a.minimum(), *a_values.begin());
+	EXPECT_EQ(*a.maximum(), *a_values.rbegin());
+
+	std::vector<uint64_t> probes;
+	for (int i = 0; i < 5000; i++)
+	{
+		probes.push_back(rng() % 2 ? *std::next(a_values.begin(), rng() % a_values.size()) : rng());
+	}
+	std::sort(probes.begin(), probes.end());
+	std::unique_ptr<bool[]> found(new bool[probes.size()]);
+	a.containsMany(probes, std::span<bool>(found.get(), probes.size()));
+	for (size_t i = 0; i < probes.size(); i++)
+	{
+		ASSERT_EQ(a.contains(probes[i]), a_values.count(probes[i]) == 1);
+		ASSERT_EQ(found[i], a_values.count(probes[i]) == 1);
+	}
+
+	std::vector<uint64_t> want(a_values.begin(), a_values.end());
+	EXPECT_EQ(std::vector<uint64_t>(a.begin(), a.end()), want);
+	std::vector<uint64_t> visited;
+	a.forEach([&visited](uint64_t v)
+			  { visited.push_back(v); });
+	EXPECT_EQ(visited, want);
+	std::vector<uint64_t> page(777);
+	std::vector<uint64_t> decoded;
+	for (size_t offset = 0;; offset += page.size())
+	{
+		size_t n = a.toUint64Array(page.data(), offset, page.size());
+		decoded.insert(decoded.end(), page.begin(), page.begin() + n);
+		if (n < page.size())
+		{
+			break;
+		}
+	}
+	EXPECT_EQ(decoded, want);
+	for (int i = 0; i < 1000; i++)
+	{
+		uint64_t target = rng() % 2 ? rng() : want[rng() % want.size()] + rng() % 3;
+		auto itr = a.seek(target);
+		auto want_itr = a_values.lower_bound(target);
+		ASSERT_EQ(itr == a.end(), want_itr == a_values.end());
+		if (want_itr != a_values.end())
+		{
+			ASSERT_EQ(*itr, *want_itr);
+		}
+	}
+
+	std::vector<uint64_t> both, either;
+	std::set_intersection(a_values.begin(), a_values.end(), b_values.begin(), b_values.end(), std::back_inserter(both));
+	std::set_union(a_values.begin(), a_values.end(), b_values.begin(), b_values.end(), std::back_inserter(either));
+	BarkingBitmap64 c = a;
+	c.intersect(b);
+	EXPECT_EQ(std::vector<uint64_t>(c.begin(), c.end()), both);
+	c = a;
+	c.unite(b);
+	EXPECT_EQ(std::vector<uint64_t>(c.begin(), c.end()), either);
+
+	// ranges crossing a high key boundary, and removal dropping a whole high key
+	BarkingBitmap64 r;
+	r.addRange(0x1FFFFFFF0ULL, 0x20000000FULL);
+	EXPECT_EQ(r.cardinality(), 32u);
+	EXPECT_TRUE(r.contains(0x1FFFFFFFFULL));
+	EXPECT_TRUE(r.contains(0x200000000ULL));
+	EXPECT_FALSE(r.contains(0x200000010ULL));
+	for (uint64_t i = 0x200000000ULL; i <= 0x20000000FULL; i++)
+	{
+		r.remove(i);
+	}
+	EXPECT_EQ(*r.maximum(), 0x1FFFFFFFFULL);
+	EXPECT_EQ(r.cardinality(), 16u);
+}
+
+TEST_F(BarkingBitmapTests, TestCopyOnWrite)
+{
+	// 64 bitset buckets and 64 array buckets
+	for (uint32_t key = 0; key < 128; key++)
+	{
+		for (uint32_t i = 0; i < 65536; i += key % 2 ? 3 : 500)
+		{
+			bm.add(key << 16 | i);
+		}
+	}
+	uint64_t card = bm.cardinality();
+
+	// a copy only copies the key & bucket handle vectors, no containers
+	size_t before = allocations;
+	BarkingBitmap snapshot = bm;
+	EXPECT_LE(allocations - before, 2u);
+	EXPECT_EQ(snapshot.cardinality(), card);
+
+	// writes to either side stay on that side
+	bm.add(1);
+	bm.remove(1 << 16 | 3);
+	bm.addRange(200 << 16, (200 << 16) + 99);
+	EXPECT_TRUE(bm.contains(1));
+	EXPECT_FALSE(snapshot.contains(1));
+	EXPECT_FALSE(bm.contains(1 << 16 | 3));
+	EXPECT_TRUE(snapshot.contains(1 << 16 | 3));
+	EXPECT_FALSE(snapshot.contains(200 << 16));
+	snapshot.remove(1 << 16);
+	EXPECT_TRUE(bm.contains(1 << 16));
+	EXPECT_FALSE(snapshot.contains(1 << 16));
+	EXPECT_EQ(snapshot.cardinality(), card - 1);
+	EXPECT_EQ(bm.cardinality(), card + 100);
+
+	// removing a value that isn't there doesn't clone anything
+	BarkingBitmap twin = snapshot;
+	before = allocations;
+	twin.remove(2);
+	EXPECT_EQ(allocations, before);
+
+	// set operations on copies leave the originals alone
+	BarkingBitmap a = snapshot;
+	a.intersect(bm);
+	a.unite(twin);
+	EXPECT_EQ(snapshot.cardinality(), card - 1);
+	BarkingBitmap u = BarkingBitmap::fastUnion(std::vector<BarkingBitmap const *>{&snapshot, &bm});
+	u.runOptimize();
+	EXPECT_EQ(u.cardinality(), card + 101);
+	EXPECT_EQ(snapshot.cardinality(), card - 1);
+
+	// a reader walks a snapshot while the writer keeps changing the live bitmap
+	BarkingBitmap frozen = bm;
+	uint64_t frozen_card = frozen.cardinality();
+	std::atomic<bool> consistent{true};
+	{
+		std::jthread reader([&]
+							{
+			for (int round = 0; round < 20; round++)
+			{
+				uint64_t seen = 0;
+				frozen.forEach([&seen](uint32_t)
+							   { seen++; });
+				if (seen != frozen_card)
+				{
+					consistent = false;
+				}
+			} });
+		for (uint32_t i = 0; i < 128 << 16; i += 4099)
+		{
+			bm.add(i + 1);
+			bm.remove(i);
+		}
+	}
+	EXPECT_TRUE(consistent);
+	EXPECT_EQ(frozen.cardinality(), frozen_card);
+}
+
+TEST_F(BarkingBitmapTests, TestDifferenceXorFlip)
+{
+	std::set<uint16_t> sources[3];
+	std::uniform_int_distribution<int> dist(0, 65535);
+	for (int i = 0; i < 500; ++i)
+	{
+		sources[0].insert(dist(rng));
+	}
+	for (int i = 0; i < 20000; ++i)
+	{
+		sources[1].insert(dist(rng));
+	}
+	for (int start = 1000; start < 60000; start += 7000)
+	{
+		for (int i = start; i < start + 3000; ++i)
+		{
+			sources[2].insert(i);
+		}
+	}
+	for (auto const &lhs : sources)
+	{
+		for (auto const &rhs : sources)
+		{
+			std::vector<uint16_t> only, odd, both;
+			std::set_difference(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), std::back_inserter(only));
+			std::set_symmetric_difference(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), std::back_inserter(odd));
+			std::set_intersection(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), std::back_inserter(both));
+			for (size_t k1 = 0; k1 < 3; ++k1)
+			{
+				for (size_t k2 = 0; k2 < 3; ++k2)
+				{
+					BBData a = make_bucket(lhs, k1);
+					a.difference(make_bucket(rhs, k2));
+					EXPECT_EQ(bucket_values(a), only) << "difference " << k1 << " " << k2;
+					EXPECT_EQ(a.sz, only.size());
+					BBData b = make_bucket(lhs, k1);
+					b.symmetricDifference(make_bucket(rhs, k2));
+					EXPECT_EQ(bucket_values(b), odd) << "xor " << k1 << " " << k2;
+					EXPECT_EQ(b.sz, odd.size());
+					EXPECT_EQ(make_bucket(lhs, k1).andCardinality(make_bucket(rhs, k2)), both.size()) << k1 << " " << k2;
+				}
+			}
+		}
+		for (size_t k = 0; k < 3; ++k)
+		{
+			BBData f = make_bucket(lhs, k);
+			f.flip(2000, 40000);
+			std::vector<uint16_t> want;
+			for (int i = 0; i < 65536; i++)
+			{
+				if ((lhs.count(i) == 1) != (i >= 2000 && i <= 40000))
+				{
+					want.push_back(i);
+				}
+			}
+			EXPECT_EQ(bucket_values(f), want) << "flip " << k;
+			EXPECT_EQ(f.sz, want.size());
+		}
+	}
+
+	// bitmap level, against std::set over partially overlapping keys
+	std::uniform_int_distribution<uint32_t> wide(0, 12 << 16);
+	std::set<uint32_t> a, b;
+	BarkingBitmap other;
+	for (int i = 0; i < 20000; ++i)
+	{
+		uint32_t x = wide(rng);
+		uint32_t y = wide(rng) + (4 << 16);
+		a.insert(x);
+		b.insert(y);
+		bm.add(x);
+		other.add(y);
+	}
+	std::vector<uint32_t> only, odd, flipped;
+	std::set_difference(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(only));
+	std::set_symmetric_difference(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(odd));
+	uint32_t lo = (3 << 16) + 12345, hi = (14 << 16) + 99;
+	std::copy_if(a.begin(), a.end(), std::back_inserter(flipped), [lo](uint32_t v)
+				 { return v < lo; });
+	for (uint32_t v = lo; v <= hi; ++v)
+	{
+		if (!a.count(v))
+		{
+			flipped.push_back(v);
+		}
+	}
+	std::copy_if(a.begin(), a.end(), std::back_inserter(flipped), [hi](uint32_t v)
+				 { return v > hi; });
+	BarkingBitmap diff = bm;
+	diff.difference(other);
+	BarkingBitmap sym = bm;
+	sym.symmetricDifference(other);
+	BarkingBitmap flip = bm;
+	flip.flip(lo, hi);
+	EXPECT_EQ(std::vector<uint32_t>(diff.begin(), diff.end()), only);
+	EXPECT_EQ(std::vector<uint32_t>(sym.begin(), sym.end()), odd);
+	EXPECT_EQ(std::vector<uint32_t>(flip.begin(), flip.end()), flipped);
+	EXPECT_EQ(sym.cardinality(), odd.size());
+	EXPECT_EQ(flip.cardinality(), flipped.size());
+
+	// flipping twice, or xor/andnot with yourself, leaves nothing behind
+	flip.flip(lo, hi);
+	EXPECT_EQ(flip.cardinality(), a.size());
+	BarkingBitmap self = bm;
+	self.symmetricDifference(bm);
+	EXPECT_TRUE(self.empty());
+	self = bm;
+	self.difference(bm);
+	EXPECT_TRUE(self.empty());
+	BarkingBitmap full;
+	full.flip(0, 0xFFFFFFFF);
+	EXPECT_EQ(full.cardinality(), 1ull << 32);
+}
+
+TEST_F(BarkingBitmapTests, TestCountOnly)
+{
+	std::uniform_int_distribution<uint32_t> wide(0, 12 << 16);
+	std::set<uint32_t> a, b;
+	BarkingBitmap other;
+	for (int i = 0; i < 50000; ++i)
+	{
+		uint32_t x = wide(rng);
+		uint32_t y = wide(rng) + (4 << 16);
+		a.insert(x);
+		b.insert(y);
+		bm.add(x);
+		other.add(y);
+	}
+	other.addRange(8 << 16, (9 << 16) + 500);
+	for (uint32_t i = 8 << 16; i <= (9 << 16) + 500; i++)
+	{
+		b.insert(i);
+	}
+	other.runOptimize();
+	std::vector<uint32_t> both, either;
+	std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(both));
+	std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(either));
+
+	// counting allocates nothing
+	size_t before = allocations;
+	EXPECT_EQ(bm.andCardinality(other), both.size());
+	EXPECT_EQ(bm.orCardinality(other), either.size());
+	EXPECT_DOUBLE_EQ(bm.jaccard(other), static_cast<double>(both.size()) / either.size());
+	EXPECT_EQ(allocations, before);
+
+	EXPECT_EQ(other.andCardinality(bm), both.size());
+	EXPECT_EQ(bm.andCardinality(bm), a.size());
+	EXPECT_DOUBLE_EQ(bm.jaccard(bm), 1.0);
+	BarkingBitmap none;
+	EXPECT_EQ(bm.andCardinality(none), 0u);
+	EXPECT_EQ(bm.orCardinality(none), a.size());
+	EXPECT_EQ(none.jaccard(none), 0.0);
+}
+
+TEST_F(BarkingBitmapTests, TestWordBitset)
+{
+	bb_bset bset;
+	std::vector<bool> reference(BB_BSET_SZ);
+	EXPECT_EQ(reinterpret_cast<uintptr_t>(bset.data()) % 64, 0u);
+	std::mt19937 gen(15);
+	std::uniform_int_distribution<uint32_t> pos(0, BB_BSET_SZ - 1);
+	for (int round = 0; round < 300; round++)
+	{
+		uint32_t lo = pos(gen), hi = pos(gen);
+		if (lo > hi)
+		{
+			std::swap(lo, hi);
+		}
+		if (round % 4 == 0)
+		{
+			// short ranges inside and across a word boundary
+			hi = std::min<uint32_t>(lo + round % 130, BB_BSET_SZ - 1);
+		}
+		switch (round % 3)
+		{
+		case 0:
+			bset.setRange(lo, hi);
+			break;
+		case 1:
+			bset.resetRange(lo, hi);
+			break;
+		default:
+			bset.flipRange(lo, hi);
+		}
+		for (uint32_t i = lo; i <= hi; i++)
+		{
+			reference[i] = round % 3 == 0 ? true : round % 3 == 1 ? false
+																  : !reference[i];
+		}
+		size_t expected = std::count(reference.begin() + lo, reference.begin() + hi + 1, true);
+		ASSERT_EQ(bset.countRange(lo, hi), expected);
+	}
+
+	std::vector<uint32_t> values;
+	for (uint32_t i = 0; i < BB_BSET_SZ; i++)
+	{
+		ASSERT_EQ(bset.test(i), reference[i]);
+		if (reference[i])
+		{
+			values.push_back(i);
+		}
+	}
+	ASSERT_EQ(bset.count(), values.size());
+	ASSERT_FALSE(values.empty());
+	EXPECT_EQ(bset.first(), values.front());
+	EXPECT_EQ(bset.last(), values.back());
+
+	std::vector<uint32_t> extracted(values.size());
+	EXPECT_EQ(bset.extract(extracted.data(), 7u << 16), values.size());
+	for (size_t i = 0; i < values.size(); i++)
+	{
+		ASSERT_EQ(extracted[i], 7u << 16 | values[i]);
+	}
+	for (size_t i = 0; i < values.size(); i += 97)
+	{
+		ASSERT_EQ(bset.select(i), values[i]);
+		ASSERT_EQ(bset.rank(values[i]), i + 1);
+	}
+	for (uint32_t p = 0; p < BB_BSET_SZ; p += 211)
+	{
+		auto it = std::lower_bound(values.begin(), values.end(), p);
+		ASSERT_EQ(bset.next(p), it == values.end() ? BB_BSET_SZ : *it);
+		size_t clear = p;
+		while (clear < BB_BSET_SZ && reference[clear])
+		{
+			clear++;
+		}
+		ASSERT_EQ(bset.nextClear(p), clear);
+	}
+	EXPECT_EQ(bset.next(BB_BSET_SZ), BB_BSET_SZ);
+
+	// full words and the word kernels
+	bb_bset full;
+	full.setRange(0, BB_BSET_SZ - 1);
+	EXPECT_EQ(full.count(), BB_BSET_SZ);
+	EXPECT_EQ(full.nextClear(0), BB_BSET_SZ);
+	EXPECT_EQ(full.andCount(bset), values.size());
+	full.andNot(bset);
+	EXPECT_EQ(full.count(), BB_BSET_SZ - values.size());
+	full |= bset;
+	EXPECT_EQ(full.count(), BB_BSET_SZ);
+	full ^= bset;
+	full &= bset;
+	EXPECT_TRUE(full.none());
+}
+
+TEST_F(BarkingBitmapTests, TestConcurrentBitmap)
+{
+	// writers own disjoint keys, readers check that nothing outside the target set ever shows up
+	ConcurrentBarkingBitmap cbm;
+	constexpr int writers = 4;
+	constexpr uint32_t keys = 16;
+	auto wanted = [](uint32_t x)
+	{ return (x & 0xFFFF) % 61 == 0 || (x >> 16) % 5 == 0; };
+	std::atomic<int> mismatches{0};
+	{
+		std::vector<std::jthread> threads;
+		for (int t = 0; t < writers; t++)
+		{
+			threads.emplace_back([&, t]
+								 {
+				for (uint32_t key = t; key < keys; key += writers)
+				{
+					if (key % 5 == 0)
+					{
+						std::vector<uint32_t> batch;
+						for (uint32_t i = 0; i < 65536; i++)
+						{
+							batch.push_back(key << 16 | i);
+						}
+						cbm.addMany(batch);
+						continue;
+					}
+					for (uint32_t i = 0; i < 65536; i += 61)
+					{
+						cbm.add(key << 16 | i);
+						cbm.add(key << 16 | (i + 1)); // added and removed again
+						cbm.remove(key << 16 | (i + 1));
+					}
+				} });
+		}
+		for (int t = 0; t < 4; t++)
+		{
+			threads.emplace_back([&, t]
+								 {
+				std::mt19937 gen(t);
+				std::uniform_int_distribution<uint32_t> dist(0, keys << 16);
+				for (int probe = 0; probe < 100000; probe++)
+				{
+					uint32_t x = dist(gen);
+					if (cbm.contains(x) && !wanted(x) && (x & 0xFFFF) % 61 != 1)
+					{
+						mismatches++;
+					}
+				}
+				// a snapshot taken mid-ingest only ever holds wanted values
+				BarkingBitmap snap = cbm.snapshot();
+				snap.forEach([&](uint32_t x)
+							 {
+					if (!wanted(x) && (x & 0xFFFF) % 61 != 1)
+					{
+						mismatches++;
+					}
+					return true; }); });
+		}
+	}
+	EXPECT_EQ(mismatches, 0);
+
+	BarkingBitmap expected;
+	for (uint32_t x = 0; x < keys << 16; x++)
+	{
+		if (wanted(x))
+		{
+			expected.add(x);
+		}
+	}
+	BarkingBitmap snap = cbm.snapshot();
+	EXPECT_EQ(snap.serialize(), expected.serialize());
+	EXPECT_EQ(cbm.cardinality(), expected.cardinality());
+
+	// a snapshot doesn't see later writes, and draining the retired buckets leaves it intact
+	cbm.remove(0);
+	cbm.add(keys << 16);
+	cbm.reclaim();
+	EXPECT_TRUE(snap.contains(0));
+	EXPECT_FALSE(snap.contains(keys << 16));
+	EXPECT_FALSE(cbm.contains(0));
+	EXPECT_TRUE(cbm.contains(keys << 16));
+
+	std::vector<uint32_t> probes = {0, 1u << 16 | 61, 1u << 16 | 62, keys << 16, 5u << 16 | 3};
+	std::unique_ptr<bool[]> out(new bool[probes.size()]);
+	cbm.containsMany(probes, std::span<bool>(out.get(), probes.size()));
+	EXPECT_FALSE(out[0]);
+	EXPECT_TRUE(out[1]);
+	EXPECT_FALSE(out[2]);
+	EXPECT_TRUE(out[3]);
+	EXPECT_TRUE(out[4]);
+}
+
+TEST_F(BarkingBitmapTests, TestStreamingWriter)
+{
+	// sparse arrays, dense bitsets (enough of them to go through the spill file), ranges and repeats
+	std::vector<uint32_t> values;
+	for (uint32_t key = 0; key < 420; key++)
+	{
+		uint32_t step = key % 3 == 0 ? 2 : 331;
+		for (uint32_t i = key % 5; i < 65536; i += step)
+		{
+			values.push_back(key << 16 | i);
+		}
+	}
+	auto feed = [&](BarkingBitmapWriter &writer, BarkingBitmap &reference, size_t from, size_t to)
+	{
+		for (size_t i = from; i < to; i++)
+		{
+			writer.add(values[i]);
+			writer.add(values[i]);
+			reference.add(values[i]);
+			if (i % 10007 == 0)
+			{
+				// a range that runs past the next few values, they are then repeats
+				writer.addRange(values[i], values[i] + 40);
+				reference.addRange(values[i], values[i] + 40);
+				while (i + 1 < to && values[i + 1] <= values[i] + 40)
+				{
+					i++;
+				}
+			}
+		}
+	};
+
+	std::ostringstream out;
+	BarkingBitmapWriter writer(out);
+	BarkingBitmap reference;
+	feed(writer, reference, 0, values.size());
+	writer.addRange(500u << 16 | 5, 503u << 16 | 9);
+	reference.addRange(500u << 16 | 5, 503u << 16 | 9);
+	writer.add(UINT32_MAX);
+	reference.add(UINT32_MAX);
+	EXPECT_THROW(writer.add(12), std::runtime_error);
+	std::string bytes = out.str();
+	EXPECT_TRUE(bytes.empty()); // nothing goes out before finish
+	size_t written = writer.finish();
+	bytes = out.str();
+	EXPECT_EQ(written, bytes.size());
+	EXPECT_THROW(writer.add(UINT32_MAX), std::runtime_error);
+
+	reference.runOptimize();
+	auto expected = reference.serialize();
+	ASSERT_EQ(bytes.size(), expected.size());
+	EXPECT_EQ(std::memcmp(bytes.data(), expected.data(), bytes.size()), 0);
+
+	// append mode: the second half on top of the finished first half gives the same bytes
+	size_t half = values.size() / 2;
+	std::ostringstream first;
+	BarkingBitmapWriter head(first);
+	BarkingBitmap unused;
+	feed(head, unused, 0, half);
+	head.finish();
+	std::string prior = first.str();
+	std::ostringstream second;
+	BarkingBitmapWriter tail = BarkingBitmapWriter::resume(std::as_bytes(std::span(prior.data(), prior.size())), second);
+	EXPECT_THROW(tail.add(values[half - 1] - 1), std::runtime_error);
+	feed(tail, unused, half, values.size());
+	tail.addRange(500u << 16 | 5, 503u << 16 | 9);
+	tail.add(UINT32_MAX);
+	tail.finish();
+	EXPECT_EQ(second.str(), bytes);
+
+	std::ostringstream none;
+	BarkingBitmapWriter empty(none);
+	empty.finish();
+	std::string nothing = none.str();
+	EXPECT_TRUE(BarkingBitmap::deserialize(std::as_bytes(std::span(nothing.data(), nothing.size()))).empty());
+}
+
+TEST_F(BarkingBitmapTests, TestPolicy)
+{
+	BasicBBData<dense_policy> bucket;
+	for (uint16_t i = 0; i < 63; i++)
+	{
+		bucket.add(i * 3);
+	}
+	EXPECT_TRUE(std::holds_alternative<bb_array>(bucket.data));
+	bucket.add(1000);
+	EXPECT_TRUE(std::holds_alternative<bb_bset>(bucket.data));
+	bucket.remove(1000);
+	EXPECT_TRUE(std::holds_alternative<bb_array>(bucket.data));
+
+	// same values under both policies: same contents, same bytes on disk
+	BasicBarkingBitmap<dense_policy> tuned, other_tuned;
+	BarkingBitmap plain, other_plain;
+	size_t before = policy_allocations;
+	std::uniform_int_distribution<uint32_t> dist(0, 40u << 16);
+	for (int i = 0; i < 20000; i++)
+	{
+		uint32_t a = dist(rng), b = dist(rng);
+		tuned.add(a);
+		plain.add(a);
+		other_tuned.add(b);
+		other_plain.add(b);
+	}
+	tuned.addRange(50u << 16, 52u << 16);
+	plain.addRange(50u << 16, 52u << 16);
+	EXPECT_GT(policy_allocations, before);
+	EXPECT_EQ(tuned.serialize(), plain.serialize());
+	EXPECT_EQ(tuned.andCardinality(other_tuned), plain.andCardinality(other_plain));
+
+	auto check = [&](auto op)
+	{
+		auto t = tuned;
+		auto p = plain;
+		op(t, other_tuned);
+		op(p, other_plain);
+		EXPECT_EQ(t.serialize(), p.serialize());
+	};
+	check([](auto &x, auto const &y)
+		  { x.intersect(y); });
+	check([](auto &x, auto const &y)
+		  { x.unite(y); });
+	check([](auto &x, auto const &y)
+		  { x.difference(y); });
+	check([](auto &x, auto const &y)
+		  { x.symmetricDifference(y); });
+
+	std::vector<BasicBarkingBitmap<dense_policy> const *> many = {&tuned, &other_tuned};
+	std::vector<BarkingBitmap const *> many_plain = {&plain, &other_plain};
+	EXPECT_EQ(BasicBarkingBitmap<dense_policy>::fastUnion(many).serialize(), BarkingBitmap::fastUnion(many_plain).serialize());
+	EXPECT_EQ(BasicBarkingBitmap<dense_policy>::fastIntersect(many).serialize(), BarkingBitmap::fastIntersect(many_plain).serialize());
+
+	auto bytes = plain.serialize();
+	auto thawed = BasicBarkingBitmap<dense_policy>::deserialize(bytes);
+	EXPECT_EQ(thawed.cardinality(), plain.cardinality());
+	EXPECT_EQ(std::vector<uint32_t>(thawed.begin(), thawed.end()), std::vector<uint32_t>(plain.begin(), plain.end()));
+}
+
+TEST_F(BarkingBitmapTests, TestStats)
+{
+	bb_stats empty = bm.stats();
+	EXPECT_EQ(empty.arrays.containers + empty.bitsets.containers + empty.runs.containers, 0u);
+	EXPECT_EQ(empty.bytes_reserved, sizeof(BarkingBitmap));
+	EXPECT_EQ(bm.sizeInBytes(), sizeof(BarkingBitmap));
+	EXPECT_EQ(empty.serialized_bytes, bm.serializedSize());
+
+	for (uint32_t i = 0; i < 100; i++)
+	{
+		bm.add(i * 7);
+	}
+	for (uint32_t i = 0; i < 65536; i += 2)
+	{
+		bm.add(1 << 16 | i);
+	}
+	bm.addRange(2 << 16, 2 << 16 | 50000);
+	bb_stats stats = bm.stats();
+	EXPECT_EQ(stats.arrays.containers, 1u);
+	EXPECT_EQ(stats.arrays.values, 100u);
+	EXPECT_EQ(stats.arrays.bytes_used, 200u);
+	EXPECT_EQ(stats.bitsets.containers, 1u);
+	EXPECT_EQ(stats.bitsets.values, 32768u);
+	EXPECT_EQ(stats.bitsets.bytes_reserved, 8192u);
+	EXPECT_EQ(stats.runs.containers, 1u);
+	EXPECT_EQ(stats.runs.values, 50001u);
+	EXPECT_EQ(stats.shared_containers, 0u);
+	EXPECT_EQ(stats.serialized_bytes, bm.serializedSize());
+	EXPECT_EQ(stats.bytes_reserved, bm.sizeInBytes());
+	EXPECT_LE(stats.bytes_used, stats.bytes_reserved);
+	EXPECT_EQ(stats.suggestion, bb_suggest_nothing);
+
+	BarkingBitmap copy = bm;
+	EXPECT_EQ(copy.stats().shared_containers, 3u);
+
+	// consecutive values one at a time end up as a bitset that should be a run
+	BarkingBitmap counter;
+	for (uint32_t i = 0; i < 10000; i++)
+	{
+		counter.add(i);
+	}
+	stats = counter.stats();
+	EXPECT_EQ(stats.bitsets.containers, 1u);
+	EXPECT_EQ(stats.suggestion, bb_suggest_run_optimize);
+	EXPECT_LT(stats.optimized_bytes, stats.serialized_bytes);
+	counter.runOptimize();
+	stats = counter.stats();
+	EXPECT_EQ(stats.runs.containers, 1u);
+	EXPECT_EQ(stats.optimized_bytes, stats.serialized_bytes);
+	EXPECT_NE(stats.suggestion, bb_suggest_run_optimize);
+
+	// an array that grew one value at a time carries spare capacity
+	BarkingBitmap grown;
+	for (uint32_t i = 0; i < 2100; i++)
+	{
+		grown.add(i * 3);
+	}
+	stats = grown.stats();
+	EXPECT_GT(stats.arrays.bytes_reserved, stats.arrays.bytes_used);
+	EXPECT_EQ(stats.suggestion, bb_suggest_shrink_to_fit);
+	grown.shrinkToFit();
+	stats = grown.stats();
+	EXPECT_EQ(stats.arrays.bytes_reserved, stats.arrays.bytes_used);
+	EXPECT_EQ(stats.bytes_reserved, stats.bytes_used);
+	EXPECT_EQ(stats.suggestion, bb_suggest_nothing);
+	EXPECT_EQ(grown.cardinality(), 2100u);
+}
+
 int main(int argc, char **argv)
 {
 	testing::InitGoogleTest(&argc, argv);